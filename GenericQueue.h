@@ -0,0 +1,223 @@
+/// GenericQueue - A type-generic QUEUE, instantiated for each element type
+///
+/// This module is part of a programming project for the course
+/// AED, DETI / UA.PT
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+///
+/// The AED Team <jmadeira@ua.pt, jmr@ua.pt, ...>
+/// 2025
+///
+/// Header-only. Use as follows:
+///
+/// DEFINE_QUEUE(IntQueue, int, 4096)
+///
+/// defines type IntQueue, storing int elements, and these functions:
+///   IntQueue* IntQueueCreate(uint32_t size);  // in the heap
+///   void IntQueueDestroy(IntQueue** p);
+///   void IntQueueInit(IntQueue* q);           // e.g., a local variable
+///   void IntQueueFree(IntQueue* q);
+///   void IntQueueClear(IntQueue* q);
+///   uint32_t IntQueueSize(const IntQueue* q);
+///   int IntQueueIsFull(const IntQueue* q);   // never full
+///   int IntQueueIsEmpty(const IntQueue* q);
+///   int IntQueuePeek(const IntQueue* q);
+///   void IntQueueEnqueue(IntQueue* q, int x);
+///   int IntQueueDequeue(IntQueue* q);
+///
+/// The queue is stored as a linked list of fixed-size, cache-line-aligned
+/// chunks of CHUNK_BYTES bytes (the growth step).
+/// Elements are enqueued at the tail chunk and dequeued from the head chunk.
+/// Growing the queue just links a new chunk: elements are never copied.
+/// Chunks emptied at the head are kept in a small pool of free chunks,
+/// to be reused at the tail.
+/// The first chunk is stored inside the queue structure itself, so small
+/// queues never use the heap.
+/// (So, a queue must not be copied by value: use pointers to it.)
+
+#ifndef _GENERIC_QUEUE_
+#define _GENERIC_QUEUE_
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdlib.h>
+
+#define QUEUE_CACHE_LINE_SIZE 64
+#define QUEUE_POOL_MAX_CHUNKS 8  // maximum number of free chunks kept
+
+// Hint to keep rarely executed paths out of the inlined code
+#if !defined(CONTAINER_COLD)
+#if defined(__GNUC__)
+#define CONTAINER_COLD __attribute__((noinline, cold, unused))
+#else
+#define CONTAINER_COLD
+#endif
+#endif
+
+#define DEFINE_QUEUE(Name, T, CHUNK_BYTES)                                    \
+                                                                              \
+  enum { Name##ChunkElems = ((CHUNK_BYTES) - sizeof(void*)) / sizeof(T) };    \
+                                                                              \
+  struct _##Name##Chunk {                                                     \
+    _Alignas(QUEUE_CACHE_LINE_SIZE) T data[Name##ChunkElems];                 \
+    struct _##Name##Chunk* next;                                              \
+  };                                                                          \
+                                                                              \
+  struct _##Name {                                                            \
+    uint32_t cur_size;  /* current Queue size */                              \
+    uint32_t head;      /* index of the first element in head_chunk */        \
+    uint32_t tail;      /* index after the last element in tail_chunk */      \
+    uint32_t pool_size; /* number of free chunks */                           \
+    struct _##Name##Chunk* head_chunk;                                        \
+    struct _##Name##Chunk* tail_chunk;                                        \
+    struct _##Name##Chunk* pool; /* list of free chunks */                    \
+    struct _##Name##Chunk first; /* the inline chunk */                       \
+  };                                                                          \
+                                                                              \
+  typedef struct _##Name Name;                                                \
+                                                                              \
+  static inline void Name##Init(Name* q) {                                    \
+    q->cur_size = 0;                                                          \
+    q->head = 0;                                                              \
+    q->tail = 0;                                                              \
+    q->pool_size = 0;                                                         \
+    q->pool = NULL;                                                           \
+    q->first.next = NULL;                                                     \
+    q->head_chunk = q->tail_chunk = &q->first;                                \
+  }                                                                           \
+                                                                              \
+  /* Return a chunk to the pool, or free it if the pool is full */            \
+  static inline void Name##PutChunk(Name* q, struct _##Name##Chunk* c) {      \
+    if (q->pool_size < QUEUE_POOL_MAX_CHUNKS || c == &q->first) {             \
+      c->next = q->pool;                                                      \
+      q->pool = c;                                                            \
+      q->pool_size++;                                                         \
+    } else {                                                                  \
+      free(c);                                                                \
+    }                                                                         \
+  }                                                                           \
+                                                                              \
+  /* Get a chunk from the pool, or allocate a new one */                      \
+  static inline struct _##Name##Chunk* Name##GetChunk(Name* q) {              \
+    struct _##Name##Chunk* c = q->pool;                                       \
+    if (c != NULL) {                                                          \
+      q->pool = c->next;                                                      \
+      q->pool_size--;                                                         \
+    } else {                                                                  \
+      c = aligned_alloc(QUEUE_CACHE_LINE_SIZE, sizeof(*c));                   \
+      if (c == NULL) abort();                                                 \
+    }                                                                         \
+    c->next = NULL;                                                           \
+    return c;                                                                 \
+  }                                                                           \
+                                                                              \
+  static inline void Name##FreeList(Name* q, struct _##Name##Chunk* c) {      \
+    while (c != NULL) {                                                       \
+      struct _##Name##Chunk* next = c->next;                                  \
+      if (c != &q->first) free(c);                                            \
+      c = next;                                                               \
+    }                                                                         \
+  }                                                                           \
+                                                                              \
+  static inline void Name##Free(Name* q) {                                    \
+    Name##FreeList(q, q->head_chunk);                                         \
+    Name##FreeList(q, q->pool);                                               \
+    Name##Init(q);                                                            \
+  }                                                                           \
+                                                                              \
+  /* The size is just a hint of the expected maximum size: the queue */       \
+  /* grows as needed. Chunks for up to QUEUE_POOL_MAX_CHUNKS are */           \
+  /* allocated at once. */                                                    \
+  static inline Name* Name##Create(uint32_t size) {                           \
+    assert(size > 1);                                                         \
+    Name* q = aligned_alloc(QUEUE_CACHE_LINE_SIZE, sizeof(Name));             \
+    if (q == NULL) abort();                                                   \
+    Name##Init(q);                                                            \
+    uint32_t nchunks = (size + Name##ChunkElems - 1) / Name##ChunkElems;      \
+    for (uint32_t i = 1; i < nchunks && i <= QUEUE_POOL_MAX_CHUNKS; i++) {    \
+      struct _##Name##Chunk* c =                                              \
+          aligned_alloc(QUEUE_CACHE_LINE_SIZE, sizeof(*c));                   \
+      if (c == NULL) abort();                                                 \
+      Name##PutChunk(q, c);                                                   \
+    }                                                                         \
+    return q;                                                                 \
+  }                                                                           \
+                                                                              \
+  static inline void Name##Destroy(Name** p) {                                \
+    assert(*p != NULL);                                                       \
+    Name##Free(*p);                                                           \
+    free(*p);                                                                 \
+    *p = NULL;                                                                \
+  }                                                                           \
+                                                                              \
+  static inline void Name##Clear(Name* q) {                                   \
+    /* Keep the head chunk, move the others to the pool */                    \
+    struct _##Name##Chunk* c = q->head_chunk->next;                           \
+    while (c != NULL) {                                                       \
+      struct _##Name##Chunk* next = c->next;                                  \
+      Name##PutChunk(q, c);                                                   \
+      c = next;                                                               \
+    }                                                                         \
+    q->head_chunk->next = NULL;                                               \
+    q->tail_chunk = q->head_chunk;                                            \
+    q->cur_size = 0;                                                          \
+    q->head = 0;                                                              \
+    q->tail = 0;                                                              \
+  }                                                                           \
+                                                                              \
+  /* Link a new chunk at the tail */                                          \
+  static CONTAINER_COLD void Name##Grow(Name* q) {                            \
+    struct _##Name##Chunk* c = Name##GetChunk(q);                             \
+    q->tail_chunk->next = c;                                                  \
+    q->tail_chunk = c;                                                        \
+    q->tail = 0;                                                              \
+  }                                                                           \
+                                                                              \
+  /* Release the exhausted head chunk */                                      \
+  static CONTAINER_COLD void Name##Shrink(Name* q) {                          \
+    struct _##Name##Chunk* old = q->head_chunk;                               \
+    q->head_chunk = old->next;                                                \
+    q->head = 0;                                                              \
+    Name##PutChunk(q, old);                                                   \
+  }                                                                           \
+                                                                              \
+  static inline uint32_t Name##Size(const Name* q) { return q->cur_size; }    \
+                                                                              \
+  static inline int Name##IsFull(const Name* q) {                             \
+    (void)q;                                                                  \
+    return 0;                                                                 \
+  }                                                                           \
+                                                                              \
+  static inline int Name##IsEmpty(const Name* q) {                            \
+    return (q->cur_size == 0);                                                \
+  }                                                                           \
+                                                                              \
+  static inline T Name##Peek(const Name* q) {                                 \
+    assert(q->cur_size > 0);                                                  \
+    if (q->head == Name##ChunkElems) return q->head_chunk->next->data[0];     \
+    return q->head_chunk->data[q->head];                                      \
+  }                                                                           \
+                                                                              \
+  static inline void Name##Enqueue(Name* q, T x) {                            \
+    /* Is the tail chunk full? */                                             \
+    if (q->tail == Name##ChunkElems) Name##Grow(q);                           \
+    q->tail_chunk->data[q->tail++] = x;                                       \
+    q->cur_size++;                                                            \
+  }                                                                           \
+                                                                              \
+  static inline T Name##Dequeue(Name* q) {                                    \
+    assert(q->cur_size > 0);                                                  \
+    /* Is the head chunk exhausted? */                                        \
+    if (q->head == Name##ChunkElems) Name##Shrink(q);                         \
+    T x = q->head_chunk->data[q->head++];                                     \
+    q->cur_size--;                                                            \
+    /* When empty, restart at the beginning of the (single) chunk */          \
+    if (q->cur_size == 0) {                                                   \
+      q->head = 0;                                                            \
+      q->tail = 0;                                                            \
+    }                                                                         \
+    return x;                                                                 \
+  }
+
+#endif  // _GENERIC_QUEUE_
@@ -0,0 +1,139 @@
+/// GenericStack - A type-generic STACK, instantiated for each element type
+///
+/// This module is part of a programming project for the course
+/// AED, DETI / UA.PT
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+///
+/// The AED Team <jmadeira@ua.pt, jmr@ua.pt, ...>
+/// 2025
+///
+/// Header-only. Use as follows:
+///
+/// DEFINE_STACK(IntStack, int, STACK_GROW_DOUBLE, 16)
+///
+/// defines type IntStack, storing int elements, and these functions:
+///   IntStack* IntStackCreate(uint32_t size);  // in the heap
+///   void IntStackDestroy(IntStack** p);
+///   void IntStackInit(IntStack* s);           // e.g., a local variable
+///   void IntStackFree(IntStack* s);
+///   void IntStackClear(IntStack* s);
+///   uint32_t IntStackSize(const IntStack* s);
+///   int IntStackIsFull(const IntStack* s);
+///   int IntStackIsEmpty(const IntStack* s);
+///   int IntStackPeek(const IntStack* s);
+///   void IntStackPush(IntStack* s, int x);
+///   int IntStackPop(IntStack* s);
+///
+/// GROWTH(cap) gives the new capacity of a full stack (see STACK_GROW_*).
+/// The first INLINE_CAP (>= 1) elements are stored inside the stack
+/// structure itself, so small stacks never use the heap.
+/// (So, a stack must not be copied by value: use pointers to it.)
+
+#ifndef _GENERIC_STACK_
+#define _GENERIC_STACK_
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Growth policies
+#define STACK_GROW_DOUBLE(cap) ((cap) * 2)
+#define STACK_GROW_HALF(cap) ((cap) + (cap) / 2 + 1)
+#define STACK_GROW_4K(cap) ((cap) + 4096)
+
+// Hint to keep rarely executed paths out of the inlined code
+#if !defined(CONTAINER_COLD)
+#if defined(__GNUC__)
+#define CONTAINER_COLD __attribute__((noinline, cold, unused))
+#else
+#define CONTAINER_COLD
+#endif
+#endif
+
+#define DEFINE_STACK(Name, T, GROWTH, INLINE_CAP)                             \
+                                                                              \
+  struct _##Name {                                                            \
+    uint32_t max_size; /* maximum stack size */                               \
+    uint32_t cur_size; /* current stack size */                               \
+    T* data;           /* the stack data (inline_data or in the heap) */      \
+    T inline_data[INLINE_CAP];                                                \
+  };                                                                          \
+                                                                              \
+  typedef struct _##Name Name;                                                \
+                                                                              \
+  static inline void Name##Init(Name* s) {                                    \
+    s->max_size = (INLINE_CAP);                                               \
+    s->cur_size = 0;                                                          \
+    s->data = s->inline_data;                                                 \
+  }                                                                           \
+                                                                              \
+  static inline void Name##Free(Name* s) {                                    \
+    if (s->data != s->inline_data) free(s->data);                             \
+    s->data = s->inline_data;                                                 \
+    s->max_size = (INLINE_CAP);                                               \
+    s->cur_size = 0;                                                          \
+  }                                                                           \
+                                                                              \
+  /* Change the capacity to size (>= cur_size) */                             \
+  static CONTAINER_COLD void Name##Resize(Name* s, uint32_t size) {           \
+    assert(size >= s->cur_size);                                              \
+    T* data;                                                                  \
+    if (s->data == s->inline_data) {                                          \
+      data = malloc(size * sizeof(T));                                        \
+      if (data != NULL) memcpy(data, s->data, s->cur_size * sizeof(T));       \
+    } else {                                                                  \
+      data = realloc(s->data, size * sizeof(T));                              \
+    }                                                                         \
+    if (data == NULL) abort();                                                \
+    s->data = data;                                                           \
+    s->max_size = size;                                                       \
+  }                                                                           \
+                                                                              \
+  static inline Name* Name##Create(uint32_t size) {                           \
+    assert(size > 1);                                                         \
+    Name* s = malloc(sizeof(Name));                                           \
+    if (s == NULL) abort();                                                   \
+    Name##Init(s);                                                            \
+    if (size > (INLINE_CAP)) Name##Resize(s, size);                           \
+    return s;                                                                 \
+  }                                                                           \
+                                                                              \
+  static inline void Name##Destroy(Name** p) {                                \
+    assert(*p != NULL);                                                       \
+    Name##Free(*p);                                                           \
+    free(*p);                                                                 \
+    *p = NULL;                                                                \
+  }                                                                           \
+                                                                              \
+  static inline void Name##Clear(Name* s) { s->cur_size = 0; }                \
+                                                                              \
+  static inline uint32_t Name##Size(const Name* s) { return s->cur_size; }    \
+                                                                              \
+  static inline int Name##IsFull(const Name* s) {                             \
+    return (s->cur_size == s->max_size);                                      \
+  }                                                                           \
+                                                                              \
+  static inline int Name##IsEmpty(const Name* s) {                            \
+    return (s->cur_size == 0);                                                \
+  }                                                                           \
+                                                                              \
+  static inline T Name##Peek(const Name* s) {                                 \
+    assert(s->cur_size > 0);                                                  \
+    return s->data[s->cur_size - 1];                                          \
+  }                                                                           \
+                                                                              \
+  static inline void Name##Push(Name* s, T x) {                               \
+    /* Is the stack full? */                                                  \
+    if (s->cur_size == s->max_size) Name##Resize(s, GROWTH(s->max_size));     \
+    s->data[s->cur_size++] = x;                                               \
+  }                                                                           \
+                                                                              \
+  static inline T Name##Pop(Name* s) {                                        \
+    assert(s->cur_size > 0);                                                  \
+    return s->data[--(s->cur_size)];                                          \
+  }
+
+#endif  // _GENERIC_STACK_
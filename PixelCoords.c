@@ -14,27 +14,8 @@
 #include <inttypes.h>
 #include <stdio.h>
 
-PixelCoords PixelCoordsCreate(int u, int v) {
-  PixelCoords p;
-  p.u = u;
-  p.v = v;
-
-  return p;
-}
-
-int PixelCoordsGetU(PixelCoords p) { return p.u; }
-
-int PixelCoordsGetV(PixelCoords p) { return p.v; }
-
-int PixelCoordsIsEqual(PixelCoords p1, PixelCoords p2) {
-  return (p1.u == p2.u) && (p1.v == p2.v);
-}
-
-int PixelCoordsIsDifferent(PixelCoords p1, PixelCoords p2) {
-  return (p1.u != p2.u) || (p1.v != p2.v);
-}
+// The other functions are inline, in PixelCoords.h
 
 void PixelCoordsDisplay(PixelCoords p) {
-  printf("(%3d, %3d)\n", p.u, p.v);
+  printf("(%3d, %3d)\n", (int)p.u, (int)p.v);
 }
-
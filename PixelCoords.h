@@ -14,21 +14,83 @@
 
 #include <inttypes.h>
 
+// Two encodings of (u,v) pixel coordinates are available,
+// chosen at compile time:
+// - by default, two ints (8 bytes);
+// - with PIXELCOORDS_PACKED16 defined, two 16-bit fields (4 bytes),
+//   halving the memory used by stacks and queues of coordinates,
+//   but only valid for coordinates in [0, PIXELCOORDS_MAX].
+// Accessors are inline, to avoid call overhead in hot loops.
+
+#ifdef PIXELCOORDS_PACKED16
+
+#define PIXELCOORDS_MAX UINT16_MAX
+
+struct _PixelCoords {
+  uint16_t u;
+  uint16_t v;
+};
+
+#else
+
+#define PIXELCOORDS_MAX INT32_MAX
+
 struct _PixelCoords {
   int u;
   int v;
 };
 
+#endif
+
 typedef struct _PixelCoords PixelCoords;
 
-PixelCoords PixelCoordsCreate(int u, int v);
+static inline PixelCoords PixelCoordsCreate(int u, int v) {
+  PixelCoords p;
+  p.u = u;
+  p.v = v;
 
-int PixelCoordsGetU(PixelCoords p);
-int PixelCoordsGetV(PixelCoords p);
+  return p;
+}
 
-int PixelCoordsIsEqual(PixelCoords p1, PixelCoords p2);
-int PixelCoordsIsDifferent(PixelCoords p1, PixelCoords p2);
+static inline int PixelCoordsGetU(PixelCoords p) { return p.u; }
+
+static inline int PixelCoordsGetV(PixelCoords p) { return p.v; }
+
+static inline int PixelCoordsIsEqual(PixelCoords p1, PixelCoords p2) {
+  return (p1.u == p2.u) && (p1.v == p2.v);
+}
+
+static inline int PixelCoordsIsDifferent(PixelCoords p1, PixelCoords p2) {
+  return (p1.u != p2.u) || (p1.v != p2.v);
+}
 
 void PixelCoordsDisplay(PixelCoords p);
 
+// Compact encoding of pixel coordinates as a 32-bit linear index:
+//   index = v * stride + u
+// where stride is the image width.
+// Only valid for images with up to 2^32 pixels.
+
+typedef uint32_t PixelIndex;
+
+static inline PixelIndex PixelIndexCreate(int u, int v, uint32_t stride) {
+  return (PixelIndex)v * stride + (PixelIndex)u;
+}
+
+static inline int PixelIndexGetU(PixelIndex i, uint32_t stride) {
+  return (int)(i % stride);
+}
+
+static inline int PixelIndexGetV(PixelIndex i, uint32_t stride) {
+  return (int)(i / stride);
+}
+
+// Decode both coordinates with a single division (for hot loops).
+static inline void PixelIndexGet(PixelIndex i, uint32_t stride, int* u,
+                                 int* v) {
+  PixelIndex q = i / stride;
+  *u = (int)(i - q * stride);
+  *v = (int)q;
+}
+
 #endif  // _PIXELCOORDS_H_
@@ -14,26 +14,21 @@
 
 #include <inttypes.h>
 
+#include "GenericQueue.h"
 #include "PixelCoords.h"
 
-typedef struct _PixelCoordsQueue Queue;
-
-Queue* QueueCreate(uint32_t size);
-
-void QueueDestroy(Queue** p);
-
-void QueueClear(Queue* q);
-
-uint32_t QueueSize(const Queue* q);
-
-int QueueIsFull(const Queue* q);
-
-int QueueIsEmpty(const Queue* q);
-
-PixelCoords QueuePeek(const Queue* q);
-
-void QueueEnqueue(Queue* q, PixelCoords p);
-
-PixelCoords QueueDequeue(Queue* q);
+// An instantiation of the generic queue (see GenericQueue.h), defining:
+//
+// Queue* QueueCreate(uint32_t size);
+// void QueueDestroy(Queue** p);
+// void QueueClear(Queue* q);
+// uint32_t QueueSize(const Queue* q);
+// int QueueIsFull(const Queue* q);  // never full: it grows as needed
+// int QueueIsEmpty(const Queue* q);
+// PixelCoords QueuePeek(const Queue* q);
+// void QueueEnqueue(Queue* q, PixelCoords p);
+// PixelCoords QueueDequeue(Queue* q);
+
+DEFINE_QUEUE(Queue, PixelCoords, 4096)
 
 #endif  // _PIXELCOORDS_QUEUE_
@@ -14,26 +14,21 @@
 
 #include <inttypes.h>
 
+#include "GenericStack.h"
 #include "PixelCoords.h"
 
-typedef struct _PixelCoordsStack Stack;
-
-Stack* StackCreate(uint32_t size);
-
-void StackDestroy(Stack** p);
-
-void StackClear(Stack* s);
-
-uint32_t StackSize(const Stack* s);
-
-int StackIsFull(const Stack* s);
-
-int StackIsEmpty(const Stack* s);
-
-PixelCoords StackPeek(const Stack* s);
-
-void StackPush(Stack* s, PixelCoords p);
-
-PixelCoords StackPop(Stack* s);
+// An instantiation of the generic stack (see GenericStack.h), defining:
+//
+// Stack* StackCreate(uint32_t size);
+// void StackDestroy(Stack** p);
+// void StackClear(Stack* s);
+// uint32_t StackSize(const Stack* s);
+// int StackIsFull(const Stack* s);
+// int StackIsEmpty(const Stack* s);
+// PixelCoords StackPeek(const Stack* s);
+// void StackPush(Stack* s, PixelCoords p);
+// PixelCoords StackPop(Stack* s);
+
+DEFINE_STACK(Stack, PixelCoords, STACK_GROW_DOUBLE, 1)
 
 #endif  // _PIXELCOORDS_STACK_
@@ -0,0 +1,205 @@
+/// ThreadPool - A small persistent pool of threads, with a parallel for
+///
+/// This module is part of a programming project for the course
+/// AED, DETI / UA.PT
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+///
+/// The AED Team <jmadeira@ua.pt, jmr@ua.pt, ...>
+/// 2025
+
+#include "ThreadPool.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Bands per thread: a few, so that threads finishing early get more work
+#define THREADPOOL_BANDS_PER_THREAD 4
+
+// The pool: workers wait for a job, identified by its generation number.
+// A job is only changed when no worker is running it (active == 0).
+static struct {
+  pthread_mutex_t lock;    // protects the fields below (except next_band)
+  pthread_cond_t work_cv;  // signaled when a job is posted (or on shutdown)
+  pthread_cond_t done_cv;  // signaled when the job is done
+  uint32_t num_threads;    // 0: not yet set
+  uint32_t num_workers;    // started worker threads
+  pthread_t workers[THREADPOOL_MAX_THREADS];
+  int shutdown;
+
+  // The current job
+  uint64_t generation;
+  ThreadPoolFunction fn;
+  void* arg;
+  uint32_t n;
+  uint32_t band;        // indices per band
+  uint32_t num_bands;
+  uint32_t next_band;   // next band to run (atomic)
+  uint32_t done_bands;  // bands finished
+  uint32_t active;      // workers running the job
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work_cv = PTHREAD_COND_INITIALIZER,
+    .done_cv = PTHREAD_COND_INITIALIZER,
+};
+
+// Only one job at a time: other callers run serially
+static pthread_mutex_t submit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Set in pool threads, so that nested calls run serially
+static _Thread_local int in_pool = 0;
+
+static uint32_t DefaultThreads(void) {
+  const char* env = getenv("IMAGERGB_THREADS");
+  long n = env != NULL ? strtol(env, NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+  if (n < 1) n = 1;
+  if (n > THREADPOOL_MAX_THREADS) n = THREADPOOL_MAX_THREADS;
+  return (uint32_t)n;
+}
+
+// Run bands of the current job until there are none left.
+// Returns the number of bands run.  (pool.lock must NOT be held.)
+static uint32_t RunBands(ThreadPoolFunction fn, void* arg, uint32_t n,
+                         uint32_t band, uint32_t num_bands) {
+  uint32_t count = 0;
+  uint32_t b;
+  while ((b = __atomic_fetch_add(&pool.next_band, 1, __ATOMIC_RELAXED)) <
+         num_bands) {
+    uint32_t begin = b * band;
+    uint32_t end = n - begin < band ? n : begin + band;
+    fn(arg, begin, end);
+    count++;
+  }
+  return count;
+}
+
+static void* Worker(void* unused) {
+  (void)unused;
+  in_pool = 1;
+  uint64_t seen = 0;
+
+  pthread_mutex_lock(&pool.lock);
+  for (;;) {
+    while (!pool.shutdown && pool.generation == seen) {
+      pthread_cond_wait(&pool.work_cv, &pool.lock);
+    }
+    if (pool.shutdown) break;
+
+    // Join the job (the job cannot change while active > 0)
+    seen = pool.generation;
+    pool.active++;
+    ThreadPoolFunction fn = pool.fn;
+    void* arg = pool.arg;
+    uint32_t n = pool.n;
+    uint32_t band = pool.band;
+    uint32_t num_bands = pool.num_bands;
+    pthread_mutex_unlock(&pool.lock);
+
+    uint32_t count = RunBands(fn, arg, n, band, num_bands);
+
+    pthread_mutex_lock(&pool.lock);
+    pool.done_bands += count;
+    pool.active--;
+    if (pool.done_bands == pool.num_bands && pool.active == 0) {
+      pthread_cond_signal(&pool.done_cv);
+    }
+  }
+  pthread_mutex_unlock(&pool.lock);
+
+  return NULL;
+}
+
+// Stop the worker threads.  (submit_lock must be held.)
+static void StopWorkers(void) {
+  pthread_mutex_lock(&pool.lock);
+  pool.shutdown = 1;
+  pthread_cond_broadcast(&pool.work_cv);
+  pthread_mutex_unlock(&pool.lock);
+
+  for (uint32_t i = 0; i < pool.num_workers; i++) {
+    pthread_join(pool.workers[i], NULL);
+  }
+
+  pthread_mutex_lock(&pool.lock);
+  pool.num_workers = 0;
+  pool.shutdown = 0;
+  pthread_mutex_unlock(&pool.lock);
+}
+
+void ThreadPoolSetThreads(uint32_t n) {
+  pthread_mutex_lock(&submit_lock);
+  StopWorkers();
+  pthread_mutex_lock(&pool.lock);
+  pool.num_threads = n == 0 ? DefaultThreads()
+                     : n > THREADPOOL_MAX_THREADS ? THREADPOOL_MAX_THREADS
+                                                  : n;
+  pthread_mutex_unlock(&pool.lock);
+  pthread_mutex_unlock(&submit_lock);
+}
+
+uint32_t ThreadPoolThreads(void) {
+  pthread_mutex_lock(&pool.lock);
+  if (pool.num_threads == 0) pool.num_threads = DefaultThreads();
+  uint32_t n = pool.num_threads;
+  pthread_mutex_unlock(&pool.lock);
+  return n;
+}
+
+void ThreadPoolFor(uint32_t n, uint32_t work, ThreadPoolFunction fn,
+                   void* arg) {
+  assert(fn != NULL);
+
+  if (n == 0) return;
+
+  uint32_t num_threads = ThreadPoolThreads();
+  if (n == 1 || num_threads == 1 || in_pool ||
+      (uint64_t)n * work < THREADPOOL_MIN_WORK ||
+      pthread_mutex_trylock(&submit_lock) != 0) {
+    fn(arg, 0, n);
+    return;
+  }
+
+  // Start the workers (if not yet started)
+  while (pool.num_workers < num_threads - 1 &&
+         pthread_create(&pool.workers[pool.num_workers], NULL, Worker, NULL) ==
+             0) {
+    pool.num_workers++;
+  }
+
+  // Post the job
+  uint32_t num_bands = THREADPOOL_BANDS_PER_THREAD * num_threads;
+  if (num_bands > n) num_bands = n;
+  uint32_t band = (n + num_bands - 1) / num_bands;
+
+  pthread_mutex_lock(&pool.lock);
+  // A worker may still be leaving a previous job, which it joined late
+  while (pool.active > 0) {
+    pthread_cond_wait(&pool.done_cv, &pool.lock);
+  }
+  pool.fn = fn;
+  pool.arg = arg;
+  pool.n = n;
+  pool.band = band;
+  pool.num_bands = (n + band - 1) / band;
+  pool.next_band = 0;
+  pool.done_bands = 0;
+  pool.generation++;
+  num_bands = pool.num_bands;
+  pthread_cond_broadcast(&pool.work_cv);
+  pthread_mutex_unlock(&pool.lock);
+
+  // Run bands too, then wait for the workers
+  uint32_t count = RunBands(fn, arg, n, band, num_bands);
+
+  pthread_mutex_lock(&pool.lock);
+  pool.done_bands += count;
+  while (pool.done_bands < pool.num_bands || pool.active > 0) {
+    pthread_cond_wait(&pool.done_cv, &pool.lock);
+  }
+  pthread_mutex_unlock(&pool.lock);
+
+  pthread_mutex_unlock(&submit_lock);
+}
@@ -0,0 +1,57 @@
+/// ThreadPool - A small persistent pool of threads, with a parallel for
+///
+/// This module is part of a programming project for the course
+/// AED, DETI / UA.PT
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+///
+/// The AED Team <jmadeira@ua.pt, jmr@ua.pt, ...>
+/// 2025
+///
+/// Use as follows:
+///
+/// static void ClearRows(void* arg, uint32_t begin, uint32_t end) {
+///   for (uint32_t i = begin; i < end; i++) ...  // process row i
+/// }
+/// ...
+/// ThreadPoolFor(height, width, ClearRows, img);
+///
+/// The pool threads are started on the first parallel call and then wait
+/// for more work, so a parallel for costs just a few wake-ups.
+
+#ifndef _THREAD_POOL_
+#define _THREAD_POOL_
+
+#include <inttypes.h>
+
+/// Maximum number of threads (the calling thread included)
+#define THREADPOOL_MAX_THREADS 64
+
+/// Minimum total work (e.g., number of pixels) worth running in parallel
+#define THREADPOOL_MIN_WORK (1 << 16)
+
+/// Type: Pointer to a function that processes indices begin..end-1
+typedef void (*ThreadPoolFunction)(void* arg, uint32_t begin, uint32_t end);
+
+/// Set the number of threads (the calling thread included).
+/// n == 0 restores the default: the value of the IMAGERGB_THREADS
+/// environment variable, or the number of processors.
+/// Running pool threads are stopped, and restarted when needed.
+void ThreadPoolSetThreads(uint32_t n);
+
+/// Get the number of threads (the calling thread included).
+uint32_t ThreadPoolThreads(void);
+
+/// Call fn(arg, begin, end) for consecutive bands of indices covering
+/// 0..n-1, in parallel, and wait for all of them to finish.
+/// The bands are handed out dynamically to the pool threads and to the
+/// calling thread.  Bands never overlap, so fn may write to the rows of
+/// its band without synchronization.
+///   work: the cost of each index (e.g., the number of pixels of a row).
+/// If n * work < THREADPOOL_MIN_WORK, there is a single thread, or the
+/// pool is busy (e.g., a nested call), fn(arg, 0, n) is called directly.
+void ThreadPoolFor(uint32_t n, uint32_t work, ThreadPoolFunction fn,
+                   void* arg);
+
+#endif  // _THREAD_POOL_
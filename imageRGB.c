@@ -24,21 +24,62 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "PixelCoords.h"
+#include "GenericQueue.h"
+#include "GenericStack.h"
 #include "PixelCoordsQueue.h"
 #include "PixelCoordsStack.h"
+#include "ThreadPool.h"
 #include "instrumentation.h"
 
+// Stack and queue of linear pixel indices (see PixelCoords.h),
+// instantiated from the generic containers, for the region filling functions:
+// 4 bytes per pixel, and small frontiers stay in the inline buffers.
+DEFINE_STACK(IndexStack, PixelIndex, STACK_GROW_DOUBLE, 256)
+DEFINE_QUEUE(IndexQueue, PixelIndex, 4096)
+// ... and of 64-bit indices, for images with more than 2^32 pixels.
+DEFINE_STACK(WideIndexStack, uint64_t, STACK_GROW_DOUBLE, 256)
+DEFINE_QUEUE(WideIndexQueue, uint64_t, 4096)
+
+// A record of the undo journal of an image: pixels u..u+len-1 of row v
+// had the labels at the top of the pixels of the journal, or (if len == 0)
+// the LUT had old colors.
+typedef struct {
+  uint32 v, u, len;
+  uint16 old;
+} JournalRecord;
+
+DEFINE_STACK(JournalStack, JournalRecord, STACK_GROW_DOUBLE, 16)
+
+// The undo journal of an image (see ImageJournalBegin).
+struct imageJournal {
+  JournalStack records;
+  uint16* pixels;  // the old labels of the records, one after the other
+  size_t num_pixels, max_pixels;
+  uint32* saved;  // saved[v] == epoch: row v is recorded since the checkpoint
+  uint32 epoch;
+};
+
 // The data structure
 //
 // A RGB image is stored in a structure containing 5 fields:
 // Two integers store the image width and height.
 // The next field is a pointer to an array that stores the pointers
 // to the image rows.
+// The rows are stored one after the other in a single pixel buffer,
+// in blocks of rows that may be shared with copies of the image;
+// the structure, the array of row pointers, the LUT and the other per-row
+// and per-block data are stored in another block (see AllocateImage).
 //
 // Clients should use images only through variables of type Image,
 // which are pointers to the image structure, and should not access the
@@ -54,6 +95,19 @@ struct image {
   uint16** image;  // pointer to an array of pointers referencing the image rows
   uint16 num_colors;  // the number of colors (i.e., pixel labels) used
   rgb_t* LUT;         // table storing (R,G,B) triplets
+  // The blocks of rows: block b (rows b << block_shift, ...) is stored in
+  // stores[b], shared with other images while shared[b] is set (see RowW).
+  uint32 block_shift;
+  uint32 num_blocks;
+  struct pixelStore** stores;
+  uint8* shared;
+  uint8* white_rows;  // white_rows[v] != 0: row v is all WHITE (see RowW)
+  // The arena of the image (if any), and its neighbors in the arena list
+  struct imageArena* arena;
+  struct image* arena_prev;
+  struct image* arena_next;
+  struct imageJournal* journal;  // NULL: modifications are not recorded
+  uint8 tiled;  // the pixels are in a file, in tiles (see RowR)
 };
 
 // Design by Contract
@@ -68,7 +122,7 @@ struct image {
 // In this module, only functions dealing with memory allocation or file
 // (I/O) operations use defensive techniques.
 //
-// When one of these functions detects a memory or I/O error,
+// When one of these functions detects a memory error,
 // it immediately prints an error message and aborts the program.
 // This is a Fail-Fast strategy.
 //
@@ -78,7 +132,11 @@ struct image {
 // It should be used to detect "external" uncontrolable errors,
 // and not for "internal" programmer errors.
 //
-// See how it's used in ImageLoadPBM, for example.
+// File (I/O) errors, on the other hand, are reported to the caller:
+// the function records an error message for the calling thread
+// (see ImageErrMsg), releases what it allocated, and fails
+// (e.g., returns NULL).  Use the IOCHECK macro for that,
+// as in ImageLoadPBM, for example.
 
 // Check a condition and if false, print failmsg and exit.
 static void check(int condition, const char* failmsg) {
@@ -88,59 +146,773 @@ static void check(int condition, const char* failmsg) {
   }
 }
 
+// Message of the last I/O error of each thread
+static _Thread_local char errmsg[256] = "";
+
+// Check an I/O condition and if false, record failmsg (and the errno
+// message, if any) as the error message of the calling thread.
+// Returns the condition.
+static int ioCheck(int condition, const char* failmsg) {
+  if (!condition) {
+    if (errno != 0) {
+      snprintf(errmsg, sizeof(errmsg), "%s: %s", failmsg, strerror(errno));
+    } else {
+      snprintf(errmsg, sizeof(errmsg), "%s", failmsg);
+    }
+  }
+  return condition;
+}
+
+// Check an I/O condition and if false, record failmsg and jump to the
+// `failed` label of the function, where it should clean up and fail.
+// errno is cleared first, so the I/O call must be made in the condition
+// (otherwise, a stale errno could be reported).
+#define IOCHECK(condition, failmsg)                        \
+  do {                                                     \
+    errno = 0;                                             \
+    if (!ioCheck((condition), (failmsg))) goto failed;     \
+  } while (0)
+
+/// Get the message of the last I/O error of the calling thread.
+const char* ImageErrMsg(void) {
+  return errmsg;
+}
+
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Currently, simply set names of counters.
+/// (Instrumentation is calibrated lazily, when first needed.)
 void ImageInit(void) {  ///
-  InstrCalibrate();
   InstrName[0] = "pixmem";  // InstrCount[0] will count pixel array acesses
   // Name other counters here...
 }
 
-// Macros to simplify accessing instrumentation counters:
-#define PIXMEM InstrCount[0]
+/// Set the number of threads used by the library.
+void ImageSetThreads(uint32 n) {
+  ThreadPoolSetThreads(n);
+}
+
+// Macros to simplify counting with instrumentation counters
+// (they compile to nothing with -DNINSTR, see instrumentation.h):
+#define PIXMEM_INC() INSTR_INC(0)
+#define PIXMEM_ADD(n) INSTR_ADD(0, (n))
 // Add more macros here...
 
-// TIP: Search for PIXMEM or InstrCount to see where it is incremented!
+// TIP: Search for PIXMEM to see where it is incremented!
 
 /// Auxiliary (static) functions
 
-static Image AllocateImageHeader(uint32 width, uint32 height) {
-  // Create the header of an image data structure
-  // Allocate the array of pointers to rows
-  // And the look-up table
+// Memory pool
+//
+// The blocks of destroyed images (pixel buffers and header blocks) are
+// kept in free lists, one for each block size, to be reused by the next
+// images that need blocks of the same size: workloads that create and
+// destroy same-sized images (copies, rotations) stop calling malloc and
+// free, and stop fragmenting the heap.
+// At most pool.limit bytes are kept; blocks beyond that are freed.
+
+#define POOL_MAX_CLASSES 32  // maximum number of block sizes kept
+#define POOL_BLOCK_ALIGN 16  // block sizes are multiples of this
+
+struct poolBlock {
+  struct poolBlock* next;
+};
+
+static struct {
+  pthread_mutex_t lock;  // protects the fields below
+  size_t limit;          // maximum number of bytes kept
+  size_t bytes;          // number of bytes kept
+  uint32 num_classes;
+  struct {
+    size_t size;  // block size
+    struct poolBlock* free;
+  } classes[POOL_MAX_CLASSES];
+} pool = {.lock = PTHREAD_MUTEX_INITIALIZER,
+          .limit = IMAGE_POOL_DEFAULT_LIMIT};
+
+static size_t PoolBlockSize(size_t size) {
+  return (size + POOL_BLOCK_ALIGN - 1) / POOL_BLOCK_ALIGN * POOL_BLOCK_ALIGN;
+}
+
+// Blocks of at least POOL_MMAP_MIN bytes are mapped directly from the
+// system: their pages are zero, and only take memory when first written,
+// so a large WHITE image costs nothing until it is drawn on.
+// Such blocks taken from the pool are zeroed the same way, by discarding
+// their pages, instead of writing them all.
+// (Without anonymous mappings, calloc and memset are used.)
+#define POOL_MMAP_MIN ((size_t)256 << 10)
+
+static void* BlockAlloc(size_t size, int zero) {
+  void* p;
+#if defined(MAP_ANONYMOUS) && defined(MADV_DONTNEED)
+  if (size >= POOL_MMAP_MIN) {
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+             -1, 0);
+    check(p != MAP_FAILED, "mmap");
+    return p;
+  }
+#endif
+  // (calloc gets large blocks already zeroed from the system)
+  p = zero ? calloc(1, size) : malloc(size);
+  check(p != NULL, "PoolGet");
+  return p;
+}
+
+static void BlockFree(void* p, size_t size) {
+#if defined(MAP_ANONYMOUS) && defined(MADV_DONTNEED)
+  if (size >= POOL_MMAP_MIN) {
+    munmap(p, size);
+    return;
+  }
+#endif
+  (void)size;
+  free(p);
+}
+
+static void BlockZero(void* p, size_t size) {
+#if defined(MAP_ANONYMOUS) && defined(MADV_DONTNEED)
+  if (size >= POOL_MMAP_MIN && madvise(p, size, MADV_DONTNEED) == 0) return;
+#endif
+  memset(p, 0, size);
+}
+
+// Get a block of (at least) size bytes, all zero if zero is nonzero.
+static void* PoolGet(size_t size, int zero) {
+  size = PoolBlockSize(size);
+  void* p = NULL;
+
+  pthread_mutex_lock(&pool.lock);
+  for (uint32 c = 0; c < pool.num_classes; c++) {
+    if (pool.classes[c].size == size && pool.classes[c].free != NULL) {
+      struct poolBlock* b = pool.classes[c].free;
+      pool.classes[c].free = b->next;
+      pool.bytes -= size;
+      p = b;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&pool.lock);
+
+  if (p == NULL) {
+    p = BlockAlloc(size, zero);
+  } else if (zero) {
+    BlockZero(p, size);
+  }
+  return p;
+}
+
+// Return a block of size bytes (as requested to PoolGet) to the pool.
+static void PoolPut(void* p, size_t size) {
+  size = PoolBlockSize(size);
+
+  pthread_mutex_lock(&pool.lock);
+  if (pool.bytes + size <= pool.limit) {
+    uint32 c;
+    for (c = 0; c < pool.num_classes; c++)
+      if (pool.classes[c].size == size) break;
+    if (c == pool.num_classes) {
+      // New size: a new class or, if all are in use, the class of a size
+      // without free blocks, if any (otherwise, the block is not kept).
+      if (c < POOL_MAX_CLASSES) {
+        pool.num_classes++;
+      } else {
+        for (c = 0; c < POOL_MAX_CLASSES; c++)
+          if (pool.classes[c].free == NULL) break;
+      }
+      if (c < POOL_MAX_CLASSES) pool.classes[c].size = size;
+    }
+    if (c < POOL_MAX_CLASSES) {
+      struct poolBlock* b = p;
+      b->next = pool.classes[c].free;
+      pool.classes[c].free = b;
+      pool.bytes += size;
+      p = NULL;
+    }
+  }
+  pthread_mutex_unlock(&pool.lock);
+
+  if (p != NULL) BlockFree(p, size);  // (if not kept)
+}
+
+// Free the blocks of the pool until it keeps at most limit bytes.
+// (pool.lock must be held.)
+static void PoolShrink(size_t limit) {
+  for (uint32 c = 0; c < pool.num_classes && pool.bytes > limit; c++) {
+    while (pool.classes[c].free != NULL && pool.bytes > limit) {
+      struct poolBlock* b = pool.classes[c].free;
+      pool.classes[c].free = b->next;
+      pool.bytes -= pool.classes[c].size;
+      BlockFree(b, pool.classes[c].size);
+    }
+  }
+}
+
+/// Set the maximum number of bytes kept in the image memory pool.
+void ImagePoolSetLimit(size_t bytes) {
+  pthread_mutex_lock(&pool.lock);
+  pool.limit = bytes;
+  PoolShrink(bytes);
+  pthread_mutex_unlock(&pool.lock);
+}
+
+/// Release all the memory kept in the image memory pool.
+void ImagePoolTrim(void) {
+  pthread_mutex_lock(&pool.lock);
+  PoolShrink(0);
+  pthread_mutex_unlock(&pool.lock);
+}
+
+// Arenas
+//
+// An arena keeps a list of the images created in it (by its thread),
+// so that ImageArenaEnd may destroy those that are still alive.
+// Images may be destroyed before, by any thread: the lists are
+// protected by pool.lock.
+
+struct imageArena {
+  struct imageArena* outer;  // the enclosing arena of the thread
+  struct image* images;      // the images alive, created in this arena
+};
+
+// The current arena of each thread (NULL: none)
+static _Thread_local struct imageArena* current_arena = NULL;
+
+/// Start an image arena for the calling thread.
+void ImageArenaBegin(void) {
+  struct imageArena* a = malloc(sizeof(*a));
+  check(a != NULL, "ImageArenaBegin");
+  a->outer = current_arena;
+  a->images = NULL;
+  current_arena = a;
+}
+
+/// End the current image arena of the calling thread.
+void ImageArenaEnd(void) {
+  struct imageArena* a = current_arena;
+  assert(a != NULL);
+  current_arena = a->outer;
+
+  // Take all the images out of the arena, then destroy them.
+  pthread_mutex_lock(&pool.lock);
+  struct image* img = a->images;
+  for (struct image* i = img; i != NULL; i = i->arena_next) i->arena = NULL;
+  a->images = NULL;
+  pthread_mutex_unlock(&pool.lock);
+
+  while (img != NULL) {
+    Image next = img->arena_next;
+    ImageDestroy(&img);
+    img = next;
+  }
+  free(a);
+}
+
+static void ArenaAdd(Image img) {
+  img->arena = current_arena;
+  img->arena_prev = img->arena_next = NULL;
+  if (img->arena == NULL) return;
+  pthread_mutex_lock(&pool.lock);
+  img->arena_next = img->arena->images;
+  if (img->arena_next != NULL) img->arena_next->arena_prev = img;
+  img->arena->images = img;
+  pthread_mutex_unlock(&pool.lock);
+}
+
+static void ArenaRemove(Image img) {
+  pthread_mutex_lock(&pool.lock);
+  if (img->arena != NULL) {
+    if (img->arena_prev != NULL) img->arena_prev->arena_next = img->arena_next;
+    else img->arena->images = img->arena_next;
+    if (img->arena_next != NULL) img->arena_next->arena_prev = img->arena_prev;
+    img->arena = NULL;
+  }
+  pthread_mutex_unlock(&pool.lock);
+}
+
+// Row stride, in pixels.  Rows whose size is a multiple of 1 KiB get an
+// extra cache line: otherwise, a column (as read by ImageRotate90CW) maps
+// to just a few cache sets, and runs several times slower.
+static size_t RowStride(uint32 width) {
+  return width % 512 == 0 ? (size_t)width + 32 : width;
+}
+
+// Blocks of rows
+//
+// The rows of an image are grouped in blocks of 2^block_shift rows, of
+// about COW_BLOCK_BYTES bytes.  ImageCopy shares the blocks of the image
+// with the copy (copy-on-write): the first write to a shared block, by
+// either image, gives that image its own duplicate of the block.
+// The pixels are stored in pixel stores, with a reference count for each
+// of their blocks: the buffer of a new image holds all of its blocks,
+// a duplicated block is stored alone.
+
+#define COW_BLOCK_BYTES ((size_t)64 << 10)
+
+struct pixelStore {
+  uint16* pixels;      // the buffer (from the pool)
+  size_t size;         // its size, in bytes
+  uint32 first_block;  // the (image) index of its first block
+  uint32 live;         // the sum of refs (atomic)
+  int fd;              // the file of the pixels of a tiled image (-1: none)
+  struct tile* tiles;  // tiles[k]: the tile of its block k (if tiled)
+  size_t tile_bytes;   // the size of a tile (if tiled)
+  uint8 mapped;        // the pixels are mapped from a file (see ImageLoad)
+  uint32 refs[];       // refs[k]: number of images using its block k (atomic)
+};
+
+// Serializes the duplication of shared blocks
+static pthread_mutex_t cow_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32 BlockShift(uint32 width) {
+  size_t row_bytes = RowStride(width) * sizeof(uint16);
+  uint32 shift = 0;
+  while (shift < 16 && (row_bytes << (shift + 1)) <= COW_BLOCK_BYTES) shift++;
+  return shift;
+}
+
+static uint32 NumBlocks(uint32 width, uint32 height) {
+  uint32 shift = BlockShift(width);
+  return (uint32)(((uint64_t)height + (1u << shift) - 1) >> shift);
+}
+
+// Tiles
+//
+// While a tile directory is set (see ImageSetTileStorage), the pixels of
+// a new image of at least POOL_MMAP_MIN bytes are stored in a temporary
+// file, mapped in memory: its blocks of rows are its tiles.
+// The tiles accessed through RowR and RowW are counted as resident; when
+// they exceed the budget, the least recently used ones are dropped from
+// memory (written back to the file by the system, and read again when
+// accessed).  The order is approximated by a clock: a hand goes round the
+// ring of resident tiles, and drops the first one not used since its
+// last visit, so a tile in use is counted with a single atomic load.
+// Only the counting depends on RowR and RowW: a tile read otherwise (e.g.,
+// a pixel next to one being filled) is just read from the file.
+// Tiled images are never shared (see ImageCopy).
+
+#if defined(MAP_SHARED) && defined(MADV_DONTNEED)
+#define TILES_SUPPORTED 1
+#endif
+
+struct tile {
+  struct tile* prev;  // the ring of resident tiles
+  struct tile* next;
+  struct pixelStore* store;
+  uint32 k;       // its block in the store
+  uint8 resident;
+  uint8 used;     // used since the last visit of the hand (atomic)
+};
+
+static struct {
+  pthread_mutex_t lock;  // protects the fields below, and the tiles
+  char* dir;             // the tile directory (NULL: none)
+  size_t budget;         // maximum number of bytes of the resident tiles
+  size_t resident;       // number of bytes of the resident tiles
+  struct tile* hand;     // next tile of the ring visited (NULL: none)
+} tile_cache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// Create an empty temporary file in directory dir.
+// Returns its descriptor, or -1 on failure (see errno).
+static int TileFileOpen(const char* dir) {
+  char* path = malloc(strlen(dir) + sizeof("/imageRGB-XXXXXX"));
+  check(path != NULL, "malloc");
+  strcpy(path, dir);
+  strcat(path, "/imageRGB-XXXXXX");
+  int fd = mkstemp(path);
+  if (fd >= 0) unlink(path);  // (removed when closed)
+  free(path);
+  return fd;
+}
+
+// Whether a new image, with size bytes of pixels, would be tiled.
+static int TilesWanted(size_t size) {
+  pthread_mutex_lock(&tile_cache.lock);
+  int tiled = tile_cache.dir != NULL && size >= POOL_MMAP_MIN;
+  pthread_mutex_unlock(&tile_cache.lock);
+  return tiled;
+}
+
+// Create the file of the pixels of a new image, of size bytes, all zero
+// (WHITE).  Returns its descriptor, or -1 if the image is not tiled.
+static int TileFileCreate(size_t size) {
+  int fd = -1;
+  pthread_mutex_lock(&tile_cache.lock);
+  if (tile_cache.dir != NULL && size >= POOL_MMAP_MIN) {
+    errno = 0;
+    fd = TileFileOpen(tile_cache.dir);
+    check(fd >= 0 && ftruncate(fd, (off_t)size) == 0, "Tile file");
+  }
+  pthread_mutex_unlock(&tile_cache.lock);
+  return fd;
+}
+
+static size_t TileSize(const struct tile* t) {
+  const struct pixelStore* s = t->store;
+  size_t offset = t->k * s->tile_bytes;
+  return s->size - offset < s->tile_bytes ? s->size - offset : s->tile_bytes;
+}
+
+// Take tile t out of the ring.  (tile_cache.lock must be held.)
+static void TileRemove(struct tile* t) {
+  if (t->next == t) {
+    tile_cache.hand = NULL;
+  } else {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    if (tile_cache.hand == t) tile_cache.hand = t->next;
+  }
+  t->resident = 0;
+  tile_cache.resident -= TileSize(t);
+}
+
+// Drop tile t from memory.  (tile_cache.lock must be held.)
+static void TileDrop(struct tile* t) {
+#ifdef TILES_SUPPORTED
+  // The pages partly in the neighbor tiles too (their data is in the file)
+  const struct pixelStore* s = t->store;
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t begin = t->k * s->tile_bytes / page * page;
+  size_t end = t->k * s->tile_bytes + TileSize(t);
+  madvise((char*)s->pixels + begin, end - begin, MADV_DONTNEED);
+#ifdef POSIX_FADV_DONTNEED
+  // Start writing them, and release those already written
+  posix_fadvise(s->fd, (off_t)begin, (off_t)(end - begin),
+                POSIX_FADV_DONTNEED);
+#endif
+#endif
+  TileRemove(t);
+}
+
+// Drop tiles other than keep, until the resident ones fit in the budget.
+// (tile_cache.lock must be held.)
+static void TilesEvict(const struct tile* keep) {
+  while (tile_cache.resident > tile_cache.budget && tile_cache.hand != NULL &&
+         tile_cache.hand->next != tile_cache.hand) {
+    struct tile* t = tile_cache.hand;
+    tile_cache.hand = t->next;
+    if (t == keep) continue;
+    if (__atomic_exchange_n(&t->used, 0, __ATOMIC_RELAXED)) continue;
+    TileDrop(t);
+  }
+}
+
+// Count tile t as used (and resident).
+static CONTAINER_COLD void TileUse(struct tile* t) {
+  pthread_mutex_lock(&tile_cache.lock);
+  __atomic_store_n(&t->used, 1, __ATOMIC_RELAXED);
+  if (!t->resident) {
+    // Insert it behind the hand: the last tile it visits
+    struct tile* h = tile_cache.hand;
+    if (h == NULL) {
+      t->prev = t->next = tile_cache.hand = t;
+    } else {
+      t->next = h;
+      t->prev = h->prev;
+      h->prev->next = t;
+      h->prev = t;
+    }
+    t->resident = 1;
+    tile_cache.resident += TileSize(t);
+    TilesEvict(t);
+  }
+  pthread_mutex_unlock(&tile_cache.lock);
+}
+
+// Count the tile of block b of img (tiled) as used.
+static inline void TileTouch(const Image img, uint32 b) {
+  struct pixelStore* s = img->stores[b];
+  struct tile* t = &s->tiles[b - s->first_block];
+  if (!__atomic_load_n(&t->used, __ATOMIC_RELAXED)) TileUse(t);
+}
+
+// Map the file fd of the pixels of s, and create its num tiles.
+static void TilesCreate(struct pixelStore* s, int fd, uint32 num,
+                        size_t tile_bytes) {
+#ifdef TILES_SUPPORTED
+  s->pixels = mmap(NULL, s->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  check(s->pixels != MAP_FAILED, "mmap");
+#endif
+  s->fd = fd;
+  s->tile_bytes = tile_bytes;
+  s->tiles = calloc(num, sizeof(struct tile));
+  check(s->tiles != NULL, "calloc");
+  for (uint32 k = 0; k < num; k++) {
+    s->tiles[k].store = s;
+    s->tiles[k].k = k;
+  }
+}
+
+// Unmap and close the file of the pixels of s, and destroy its tiles.
+static void TilesDestroy(struct pixelStore* s) {
+  uint32 num = (uint32)((s->size + s->tile_bytes - 1) / s->tile_bytes);
+  pthread_mutex_lock(&tile_cache.lock);
+  for (uint32 k = 0; k < num; k++) {
+    if (s->tiles[k].resident) TileRemove(&s->tiles[k]);
+  }
+  pthread_mutex_unlock(&tile_cache.lock);
+  munmap(s->pixels, s->size);
+  close(s->fd);
+  free(s->tiles);
+}
+
+/// Set the tile directory, and the memory budget for tiles.
+int ImageSetTileStorage(const char* dir, size_t budget) {
+  char* copy = NULL;
+
+  errno = 0;
+  if (dir != NULL) {
+#ifdef TILES_SUPPORTED
+    // Check that files can be created there
+    int fd;
+    IOCHECK((fd = TileFileOpen(dir)) >= 0, "Creating a tile file failed");
+    close(fd);
+    copy = strdup(dir);
+    check(copy != NULL, "strdup");
+#else
+    IOCHECK(0, "Tiled images are not supported");
+#endif
+  }
+
+  pthread_mutex_lock(&tile_cache.lock);
+  free(tile_cache.dir);
+  tile_cache.dir = copy;
+  tile_cache.budget = budget;
+  TilesEvict(NULL);
+  pthread_mutex_unlock(&tile_cache.lock);
+  return 1;
+
+failed:
+  return 0;
+}
+
+/// Get the number of bytes of the tiles kept in memory.
+size_t ImageTileResidentBytes(void) {
+  pthread_mutex_lock(&tile_cache.lock);
+  size_t bytes = tile_cache.resident;
+  pthread_mutex_unlock(&tile_cache.lock);
+  return bytes;
+}
+
+// A new store for blocks first..first+num-1, rows first<<shift, ...,
+// of an image, still without pixels.
+static struct pixelStore* StoreAlloc(Image img, uint32 first, uint32 num) {
+  struct pixelStore* s = malloc(sizeof(*s) + num * sizeof(uint32));
+  check(s != NULL, "malloc");
+  uint32 rows = num << img->block_shift;
+  if (rows > img->height - (first << img->block_shift)) {
+    rows = img->height - (first << img->block_shift);
+  }
+  s->size = RowStride(img->width) * rows * sizeof(uint16);
+  s->first_block = first;
+  s->live = num;
+  for (uint32 k = 0; k < num; k++) s->refs[k] = 1;
+  s->fd = -1;
+  s->tiles = NULL;
+  s->mapped = 0;
+  return s;
+}
 
-  Image newHeader = malloc(sizeof(struct image));
-  // Error handling
-  check(newHeader != NULL, "malloc");
+// Make the rows of the blocks of s (with its pixels) those of img.
+static void StoreAttach(Image img, struct pixelStore* s, uint32 num) {
+  size_t stride = RowStride(img->width);
+  uint32 row0 = s->first_block << img->block_shift;
+  uint32 rows = (uint32)(s->size / (stride * sizeof(uint16)));
+  for (uint32 i = 0; i < rows; i++) {
+    img->image[row0 + i] = s->pixels + i * stride;
+  }
+  for (uint32 b = s->first_block; b < s->first_block + num; b++) {
+    img->stores[b] = s;
+  }
+}
+
+// A new store for blocks first..first+num-1 of an image.
+// If white is nonzero, all its pixels are WHITE.
+// If fd >= 0, the pixels are in that file, all zero (see TileFileCreate).
+static struct pixelStore* StoreCreate(Image img, uint32 first, uint32 num,
+                                      int white, int fd) {
+  struct pixelStore* s = StoreAlloc(img, first, num);
+  if (fd >= 0) {
+    size_t stride = RowStride(img->width);
+    TilesCreate(s, fd, num, (stride * sizeof(uint16)) << img->block_shift);
+  } else {
+    s->pixels = PoolGet(s->size, white);
+  }
+  StoreAttach(img, s, num);
+  return s;
+}
 
-  newHeader->width = width;
-  newHeader->height = height;
+// Drop the reference of an image to block b of store s.
+static void StoreRelease(struct pixelStore* s, uint32 b) {
+  __atomic_sub_fetch(&s->refs[b - s->first_block], 1, __ATOMIC_ACQ_REL);
+  if (__atomic_sub_fetch(&s->live, 1, __ATOMIC_ACQ_REL) == 0) {
+    if (s->tiles != NULL) TilesDestroy(s);
+    else if (s->mapped) munmap(s->pixels, s->size);
+    else PoolPut(s->pixels, s->size);
+    free(s);
+  }
+}
 
-  // Allocating the array of pointers to image rows
-  newHeader->image = malloc(height * sizeof(uint16*));
-  // Error handling
-  check(newHeader->image != NULL, "Alloc failed ->image array");
+// Size of the header block of an image with the given dimensions:
+// the structure, the arrays of row pointers and of store pointers,
+// the LUT, and the row and block flags.
+static size_t HeaderSize(uint32 width, uint32 height) {
+  uint32 num_blocks = NumBlocks(width, height);
+  return sizeof(struct image) + (size_t)height * sizeof(uint16*) +
+         (size_t)num_blocks * sizeof(struct pixelStore*) +
+         FIXED_LUT_SIZE * sizeof(rgb_t) + height + num_blocks;
+}
 
-  // Allocating the LUT
-  newHeader->LUT = malloc(FIXED_LUT_SIZE * sizeof(rgb_t));
-  // Error handling
-  check(newHeader->LUT != NULL, "Alloc failed ->LUT array");
+// Allocate the header block of an image, with a 2-color LUT (WHITE and
+// BLACK), but no pixels.
+static Image AllocateHeader(uint32 width, uint32 height) {
+  assert(width > 0 && height > 0);
+
+  Image img = PoolGet(HeaderSize(width, height), 0);
+  img->width = width;
+  img->height = height;
+  img->block_shift = BlockShift(width);
+  img->num_blocks = NumBlocks(width, height);
+  img->image = (uint16**)(img + 1);
+  img->stores = (struct pixelStore**)(img->image + height);
+  img->LUT = (rgb_t*)(img->stores + img->num_blocks);
+  img->white_rows = (uint8*)(img->LUT + FIXED_LUT_SIZE);
+  img->shared = img->white_rows + height;
 
   // Initialize LUT with 2 fixed colors
-  newHeader->num_colors = 2;
-  newHeader->LUT[0] = 0xffffff;  // RGB WHITE
-  newHeader->LUT[1] = 0x000000;  // RGB BLACK
+  img->num_colors = 2;
+  img->LUT[0] = 0xffffff;  // RGB WHITE
+  img->LUT[1] = 0x000000;  // RGB BLACK
+
+  img->journal = NULL;
+  img->tiled = 0;
+  ArenaAdd(img);
+  return img;
+}
+
+// Allocate an image, with a 2-color LUT (WHITE and BLACK).
+// If white is nonzero, all its pixels are WHITE (label 0), and all its
+// rows are flagged as such; otherwise, they are not initialized, and no
+// row is flagged (so, they may be written directly, without RowW, unless
+// the image is tiled).
+static Image AllocateImage(uint32 width, uint32 height, int white) {
+  Image img = AllocateHeader(width, height);
+  memset(img->white_rows, white != 0, height);
+  memset(img->shared, 0, img->num_blocks);
+
+  // The rows, one after the other (in a file, if tiled)
+  int fd = TileFileCreate(RowStride(width) * height * sizeof(uint16));
+  img->tiled = fd >= 0;
+  StoreCreate(img, 0, img->num_blocks, white, fd);
+  return img;
+}
+
+// The all-WHITE row flags
+//
+// A row flagged in white_rows is known to have only WHITE pixels, so
+// readers may skip it (e.g., ImageSavePBM, ImageIsEqual): the rows of a
+// large blank image are then never touched, and take no memory.
+// A flag may be clear for a WHITE row, but never set for another row.
+//
+// Every write to a pixel of an image that may have flagged rows or shared
+// blocks (i.e., not just allocated by AllocateImage with white == 0) must
+// go through RowW, which clears the flag of the row, and first duplicates
+// its block if shared.
+// The rows of a tiled image are written through RowW, and read row by row
+// through RowR, which count their tiles as used (see Tiles).
+// (The flags are accessed atomically, as threads filling a region in
+// parallel may write to the same row.)
+
+static inline int RowIsWhite(const Image img, uint32 v) {
+  return __atomic_load_n(&img->white_rows[v], __ATOMIC_RELAXED);
+}
+
+// Give img its own copy of block b, if still shared with other images.
+static CONTAINER_COLD void BlockUnshare(Image img, uint32 b) {
+  pthread_mutex_lock(&cow_lock);
+  if (img->shared[b]) {
+    struct pixelStore* s = img->stores[b];
+    if (__atomic_load_n(&s->refs[b - s->first_block], __ATOMIC_ACQUIRE) > 1) {
+      uint16* old = img->image[b << img->block_shift];
+      struct pixelStore* own = StoreCreate(img, b, 1, 0, -1);
+      memcpy(own->pixels, old, own->size);
+      StoreRelease(s, b);
+    }
+    // (The new row pointers are published by this store.)
+    __atomic_store_n(&img->shared[b], 0, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&cow_lock);
+}
+
+// Get row v of img, for reading.
+static inline const uint16* RowR(const Image img, uint32 v) {
+  if (img->tiled) TileTouch(img, v >> img->block_shift);
+  return img->image[v];
+}
+
+// Get row v of img, for writing.
+static inline uint16* RowW(Image img, uint32 v) {
+  uint32 b = v >> img->block_shift;
+  if (__atomic_load_n(&img->shared[b], __ATOMIC_ACQUIRE)) BlockUnshare(img, b);
+  if (img->tiled) TileTouch(img, b);
+  if (RowIsWhite(img, v)) {
+    __atomic_store_n(&img->white_rows[v], 0, __ATOMIC_RELAXED);
+  }
+  return img->image[v];
+}
+
+// The undo journal
+//
+// While an image has a journal, the functions that modify it (region
+// filling, segmentation, ImageSetPixel) record the old labels of each row
+// they change, once since the last checkpoint, before its first change,
+// and the growth of the LUT.  So, whatever order the pixels are changed
+// in (e.g., by the STACK and QUEUE fills), the journal holds at most one
+// record per row between checkpoints, and at most a copy of the image.
+
+// Record row v of img, unless already recorded since the checkpoint.
+static void JournalRow(Image img, uint32 v) {
+  struct imageJournal* j = img->journal;
+  if (j->saved[v] == j->epoch) return;
+  j->saved[v] = j->epoch;
+  uint32 w = img->width;
+  if (j->num_pixels + w > j->max_pixels) {
+    j->max_pixels = j->max_pixels == 0 ? (size_t)w * 16 : 2 * j->max_pixels;
+    if (j->max_pixels < j->num_pixels + w) j->max_pixels = j->num_pixels + w;
+    j->pixels = realloc(j->pixels, j->max_pixels * sizeof(uint16));
+    check(j->pixels != NULL, "realloc");
+  }
+  memcpy(j->pixels + j->num_pixels, img->image[v], w * sizeof(uint16));
+  j->num_pixels += w;
+  JournalStackPush(&j->records, (JournalRecord){v, 0, w, 0});
+}
 
-  return newHeader;
+// Start a new epoch of the journal of img: the rows changed next are
+// recorded again.
+static void JournalNewEpoch(Image img) {
+  struct imageJournal* j = img->journal;
+  if (++j->epoch == 0) {  // (wrapped around)
+    memset(j->saved, 0, img->height * sizeof(uint32));
+    j->epoch = 1;
+  }
 }
 
-// Allocate row of background (label=0) pixels
-static uint16* AllocateRowArray(uint32 size) {
-  uint16* newArray = calloc((size_t)size, sizeof(uint16));
-  // Error handling
-  check(newArray != NULL, "AllocateRowArray");
+// Set pixel (u, v) of img to label (recording the old one, if journaled).
+static inline void PixelW(Image img, uint32 u, uint32 v, uint16 label) {
+  uint16* row = RowW(img, v);
+  if (img->journal != NULL) JournalRow(img, v);
+  row[u] = label;
+}
 
-  return newArray;
+// Add color to the LUT of img (which must not be full).
+// Returns its label.
+static int LUTAppend(Image img, rgb_t color) {
+  assert(img->num_colors < FIXED_LUT_SIZE);
+  if (img->journal != NULL) {
+    JournalStackPush(&img->journal->records,
+                     (JournalRecord){0, 0, 0, img->num_colors});
+  }
+  int index = img->num_colors++;
+  img->LUT[index] = color;
+  return index;
 }
 
 /// Find color label for given RGB color in img LUT.
@@ -154,12 +926,12 @@ static int LUTFindColor(Image img, rgb_t color) {
 
 /// Return color label for RGB color in img LUT.
 /// Finds existing color or allocs new one!
+/// Returns -1 if the LUT is full.
 static int LUTAllocColor(Image img, rgb_t color) {
   int index = LUTFindColor(img, color);
   if (index < 0) {
-    check(img->num_colors < FIXED_LUT_SIZE, "LUT Overflow");
-    index = img->num_colors++;
-    img->LUT[index] = color;
+    if (img->num_colors >= FIXED_LUT_SIZE) return -1;
+    index = LUTAppend(img, color);
   }
   return index;
 }
@@ -169,6 +941,68 @@ static rgb_t GenerateNextColor(rgb_t color) {
   return (color + 7639) & 0xffffff;
 }
 
+/// Return color label for the RGB color of a new region.
+/// Finds existing color or allocs new one!
+/// If the LUT is full, region labels are reused in round-robin.
+static int RegionLabel(Image img, rgb_t color, int region_count) {
+  int label = LUTFindColor(img, color);
+  if (label < 0) {
+    // Se a LUT estiver cheia, reutiliza cores já existentes.
+    if (img->num_colors >= FIXED_LUT_SIZE) {
+      label = (region_count % (img->num_colors - 2)) + 2;
+    // Senão, adicionar a nova cor à LUT.
+    } else {
+      label = LUTAppend(img, color);
+    }
+  }
+  return label;
+}
+
+/// Union-find (disjoint sets) over labels 1..n, stored in a parent array.
+/// The root of a set is always its smallest label, so parent[i] <= i.
+
+/// Find the root of label i (with path halving).
+static uint32 UFFind(uint32* parent, uint32 i) {
+  while (parent[i] != i) {
+    parent[i] = parent[parent[i]];
+    i = parent[i];
+  }
+  return i;
+}
+
+/// Join the sets of labels i and j. Returns the root of the joined set.
+static uint32 UFUnion(uint32* parent, uint32 i, uint32 j) {
+  uint32 ri = UFFind(parent, i);
+  uint32 rj = UFFind(parent, j);
+  if (ri < rj) {
+    parent[rj] = ri;
+    return ri;
+  }
+  parent[ri] = rj;
+  return rj;
+}
+
+/// Row bands
+
+// Bulk operations process the image rows in bands (ranges of rows), in
+// parallel, using ThreadPoolFor.  Each band function receives the
+// arguments in a struct rowBands.
+struct rowBands {
+  Image src;     // source image (if any)
+  Image dst;     // destination image
+  uint32 edge;   // chess square / palete tile size
+  uint16 label;  // chess color label
+  int differ;    // set when a difference is found (atomic)
+  char* text;    // PPM text of the rows
+  uint32 first;  // first row of the PPM text / of the strip of dst rows
+  uint32 src_begin, src_end;  // strip of src rows (tiled ImageRotate90CW)
+  struct imgRun* runs;    // runs of the rows (ImageSave)
+  uint32* num_runs;       // number of runs of each row (ImageSave)
+  const uint8* file;      // the native image file, mapped (ImageLoad)
+  const uint64_t* index;  // offsets of the runs of each row (ImageLoad)
+  int invalid;            // set when invalid runs are found (atomic)
+};
+
 /// Image management functions
 
 /// Create a new RGB image. All pixels with the background WHITE color.
@@ -181,15 +1015,21 @@ Image ImageCreate(uint32 width, uint32 height) {
   assert(width > 0);
   assert(height > 0);
 
-  // Just two possible pixel colors
-  Image img = AllocateImageHeader(width, height);
+  // Just two possible pixel colors, all pixels WHITE
+  return AllocateImage(width, height, 1);
+}
 
-  // Creating the image rows
-  for (uint32 i = 0; i < height; i++) {
-    img->image[i] = AllocateRowArray(width);  // Alloc all WHITE row
+static void ChessRows(void* arg, uint32 begin, uint32 end) {
+  struct rowBands* b = arg;
+  Image img = b->dst;
+  for (uint32 i = begin; i < end; i++) {
+    uint16* row = RowW(img, i);
+    uint32 I = i / b->edge;
+    for (uint32 j = 0; j < img->width; j++) {
+      uint32 J = j / b->edge;
+      row[j] = (I + J) % 2 ? 0 : b->label;
+    }
   }
-
-  return img;
 }
 
 /// Create a new RGB image, with a color chess pattern.
@@ -206,33 +1046,46 @@ Image ImageCreateChess(uint32 width, uint32 height, uint32 edge, rgb_t color) {
   assert(height > 0);
   assert(edge > 0);
 
-  Image img = ImageCreate(width, height);
+  // (All pixels are written below)
+  Image img = AllocateImage(width, height, 0);
 
   // Alloc color in LUT.
-  uint8 label = LUTAllocColor(img, color);
+  int label = LUTAllocColor(img, color);
+  assert(label >= 0);  // (a new image has only 2 colors)
 
   // Assigning the color to each image pixel
 
   // Pixel (0, 0) gets the chosen color label
-  for (uint32 i = 0; i < height; i++) {
-    uint32 I = i / edge;
-    for (uint32 j = 0; j < width; j++) {
-      uint32 J = j / edge;
-      img->image[i][j] = (I + J) % 2 ? 0 : label;
-    }
-  }
+  struct rowBands b = {.dst = img, .edge = edge, .label = (uint16)label};
+  ThreadPoolFor(height, width, ChessRows, &b);
 
   // Return the created chess image
   return img;
 }
 
+static void PaleteRows(void* arg, uint32 begin, uint32 end) {
+  struct rowBands* b = arg;
+  Image img = b->dst;
+  // number of tiles
+  uint32 wtiles = img->width / b->edge;
+  for (uint32 i = begin; i < end; i++) {
+    uint16* row = RowW(img, i);
+    uint32 I = i / b->edge;
+    for (uint32 j = 0; j < img->width; j++) {
+      uint32 J = j / b->edge;
+      row[j] = (I * wtiles + J) % FIXED_LUT_SIZE;
+    }
+  }
+}
+
 /// Create an image with a palete of generated colors.
 Image ImageCreatePalete(uint32 width, uint32 height, uint32 edge) {
   assert(width > 0);
   assert(height > 0);
   assert(edge > 0);
 
-  Image img = ImageCreate(width, height);
+  // (All pixels are written below)
+  Image img = AllocateImage(width, height, 0);
 
   // Fill LUT with generated colors
   rgb_t color = 0x000000;
@@ -241,17 +1094,9 @@ Image ImageCreatePalete(uint32 width, uint32 height, uint32 edge) {
     img->LUT[img->num_colors++] = color;
   }
 
-  // number of tiles
-  uint32 wtiles = width / edge;
-
   // Pixel (0, 0) gets the chosen color label
-  for (uint32 i = 0; i < height; i++) {
-    uint32 I = i / edge;
-    for (uint32 j = 0; j < width; j++) {
-      uint32 J = j / edge;
-      img->image[i][j] = (I * wtiles + J) % FIXED_LUT_SIZE;
-    }
-  }
+  struct rowBands b = {.dst = img, .edge = edge};
+  ThreadPoolFor(height, width, PaleteRows, &b);
 
   return img;
 }
@@ -265,27 +1110,60 @@ void ImageDestroy(Image* imgp) {
   assert(imgp != NULL);
 
   Image img = *imgp;
+  if (img == NULL) return;
 
-  for (uint32 i = 0; i < img->height; i++) {
-    free(img->image[i]);
-  }
-  free(img->image);
-  free(img->LUT);
-  free(img);
+  // The blocks are kept in the pool, to be reused
+  // (the pixels, once no other image shares them)
+  ArenaRemove(img);
+  if (img->journal != NULL) ImageJournalEnd(img);
+  for (uint32 b = 0; b < img->num_blocks; b++) StoreRelease(img->stores[b], b);
+  PoolPut(img, HeaderSize(img->width, img->height));
 
   *imgp = NULL;
 }
 
-/// Create a deep copy of the image pointed to by img.
+// Copiar as linhas begin..end-1 (de uma imagem em tiles).
+static void CopyRows(void* arg, uint32 begin, uint32 end) {
+  struct rowBands* b = arg;
+  for (uint32 i = begin; i < end; i++) {
+    if (RowIsWhite(b->src, i)) {
+      if (!b->dst->tiled) {
+        memset(b->dst->image[i], 0, b->src->width * sizeof(uint16));
+      }
+      b->dst->white_rows[i] = 1;
+      continue;
+    }
+    memcpy(RowW(b->dst, i), RowR(b->src, i), b->src->width * sizeof(uint16));
+    PIXMEM_ADD(2 * b->src->width);
+  }
+}
+
+/// Create a copy of the image pointed to by img.
 ///   img : address of an Image variable.
 ///
 /// On success, a new copied image is returned.
 /// (The caller is responsible for destroying the returned image!)
+///
+/// The copy shares the pixels of img (copy-on-write), so it takes
+/// little time and memory: the blocks of rows written later, in either
+/// image, are then duplicated.
+/// A tiled image is copied tile by tile, instead (see ImageSetTileStorage).
 Image ImageCopy(const Image img) {
   assert(img != NULL);
 
-  // Criar uma nova imagem com as mesmas dimensões da imagem original.
-  Image copyImg = AllocateImageHeader(img->width, img->height);
+  // Uma imagem em tiles não é partilhada: é copiada por linhas, em ordem.
+  if (img->tiled) {
+    Image copyImg = AllocateImage(img->width, img->height, 0);
+    copyImg->num_colors = img->num_colors;
+    memcpy(copyImg->LUT, img->LUT, img->num_colors * sizeof(rgb_t));
+    struct rowBands b = {.src = img, .dst = copyImg};
+    ThreadPoolFor(img->height, img->width, CopyRows, &b);
+    return copyImg;
+  }
+
+  // Criar uma nova imagem com as mesmas dimensões da imagem original,
+  // ainda sem pixels.
+  Image copyImg = AllocateHeader(img->width, img->height);
 
   // Copia o número de cores utilizadas na LUT (Look-Up Table) para a imagem copiada.
   copyImg->num_colors = img->num_colors;
@@ -295,11 +1173,21 @@ Image ImageCopy(const Image img) {
   // temos de multiplicar pelo tamanho de LUT (num_colors).
   memcpy(copyImg->LUT, img->LUT, img->num_colors * sizeof(rgb_t));
 
-  // Localizar e copiar linha por linha da imagem.
-  for (uint32 i = 0; i < img->height; i++) {
-    copyImg->image[i] = AllocateRowArray(img->width);
-    memcpy(copyImg->image[i], img->image[i], img->width * sizeof(uint16));
+  // Partilhar as linhas da imagem original, bloco a bloco: os blocos
+  // ficam marcados como partilhados nas duas imagens, e só são
+  // duplicados quando alguma delas os modificar (ver RowW).
+  memcpy(copyImg->image, img->image, img->height * sizeof(uint16*));
+  memcpy(copyImg->white_rows, img->white_rows, img->height);
+  pthread_mutex_lock(&cow_lock);
+  for (uint32 b = 0; b < img->num_blocks; b++) {
+    struct pixelStore* s = img->stores[b];
+    __atomic_add_fetch(&s->refs[b - s->first_block], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->live, 1, __ATOMIC_RELAXED);
+    copyImg->stores[b] = s;
   }
+  memset(img->shared, 1, img->num_blocks);
+  memset(copyImg->shared, 1, img->num_blocks);
+  pthread_mutex_unlock(&cow_lock);
 
   return copyImg;                                         // Retornar a imagem copiada.
 }
@@ -316,8 +1204,9 @@ void ImageRAWPrint(const Image img) {
 
   // Print the pixel labels of each image row
   for (uint32 i = 0; i < img->height; i++) {
+    const uint16* row = RowR(img, i);
     for (uint32 j = 0; j < img->width; j++) {
-      printf("%2d", img->image[i][j]);
+      printf("%2d", row[j]);
     }
     // At current row end
     printf("\n");
@@ -384,46 +1273,63 @@ static int skipComments(FILE* f) {
 /// Only binary PBM files are accepted.
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL (see ImageErrMsg).
 Image ImageLoadPBM(const char* filename) {  ///
   int w, h;
   char c;
   FILE* f = NULL;
   Image img = NULL;
+  uint8* bytes = NULL;
+  uint8* raw_row = NULL;
 
-  check((f = fopen(filename, "rb")) != NULL, "Open failed");
+  InstrBegin("load");
+  errno = 0;
+  IOCHECK((f = fopen(filename, "rb")) != NULL, "Open failed");
   // Parse PBM header
-  check(fscanf(f, "P%c ", &c) == 1 && c == '4', "Invalid file format");
+  IOCHECK(fscanf(f, "P%c ", &c) == 1 && c == '4', "Invalid file format");
   skipComments(f);
-  check(fscanf(f, "%d ", &w) == 1 && w >= 0, "Invalid width");
+  IOCHECK(fscanf(f, "%d ", &w) == 1 && w > 0, "Invalid width");
   skipComments(f);
-  check(fscanf(f, "%d", &h) == 1 && h >= 0, "Invalid height");
-  check(fscanf(f, "%c", &c) == 1 && isspace(c), "Whitespace expected");
+  IOCHECK(fscanf(f, "%d", &h) == 1 && h > 0, "Invalid height");
+  IOCHECK(fscanf(f, "%c", &c) == 1 && isspace(c), "Whitespace expected");
 
-  // Allocate image
-  img = AllocateImageHeader((uint32)w, (uint32)h);
+  // Allocate image (all pixels are read below)
+  img = AllocateImage((uint32)w, (uint32)h, 0);
 
   // Read pixels
   int nbytes = (w + 8 - 1) / 8;  // number of bytes for each row
-  // using VLAs...
-  uint8 bytes[nbytes];
-  uint8 raw_row[nbytes * 8];
+  bytes = malloc(nbytes);
+  raw_row = malloc(nbytes * 8);
+  check(bytes != NULL && raw_row != NULL, "malloc");
   for (uint32 i = 0; i < img->height; i++) {
-    check(fread(bytes, sizeof(uint8), nbytes, f) == (size_t)nbytes,
-          "Reading pixels");
+    IOCHECK(fread(bytes, sizeof(uint8), nbytes, f) == (size_t)nbytes,
+            "Reading pixels");
     unpackBits(nbytes, bytes, raw_row);
-    img->image[i] = AllocateRowArray((uint32)w);
+    uint16* row = RowW(img, i);
     for (uint32 j = 0; j < (uint32)w; j++) {
-      img->image[i][j] = (uint16)raw_row[j];
+      row[j] = (uint16)raw_row[j];
     }
   }
 
+  free(bytes);
+  free(raw_row);
   fclose(f);
+  InstrEnd();
   return img;
+
+failed:
+  free(bytes);
+  free(raw_row);
+  if (f != NULL) fclose(f);
+  if (img != NULL) ImageDestroy(&img);
+  InstrEnd();
+  return NULL;
 }
 
 /// Save image to PBM file.
 /// On success, returns nonzero.
-/// On failure, a partial and invalid file may be left in the system.
+/// On failure, returns 0 (see ImageErrMsg),
+/// and a partial and invalid file may be left in the system.
 int ImageSavePBM(const Image img, const char* filename) {  ///
   assert(img != NULL);
   assert(img->num_colors == 2);
@@ -431,29 +1337,51 @@ int ImageSavePBM(const Image img, const char* filename) {  ///
   int w = (int)img->width;
   int h = (int)img->height;
   FILE* f = NULL;
+  uint8* bytes = NULL;
+  uint8* raw_row = NULL;
 
-  check((f = fopen(filename, "wb")) != NULL, "Open failed");
-  check(fprintf(f, "P4\n%d %d\n", w, h) > 0, "Writing header failed");
+  InstrBegin("save");
+  errno = 0;
+  IOCHECK((f = fopen(filename, "wb")) != NULL, "Open failed");
+  IOCHECK(fprintf(f, "P4\n%d %d\n", w, h) > 0, "Writing header failed");
 
   // Write pixels
   int nbytes = (w + 8 - 1) / 8;  // number of bytes for each row
-  // using VLAs...
-  uint8 bytes[nbytes];
-  uint8 raw_row[nbytes * 8];
+  bytes = malloc(nbytes);
+  raw_row = malloc(nbytes * 8);
+  check(bytes != NULL && raw_row != NULL, "malloc");
   for (uint32 i = 0; i < img->height; i++) {
-    for (uint32 j = 0; j < img->width; j++) {
-      raw_row[j] = (uint8)img->image[i][j];
+    if (RowIsWhite(img, i)) {
+      // All WHITE: all bits 0, without reading the row
+      memset(bytes, 0, nbytes);
+    } else {
+      const uint16* row = RowR(img, i);
+      for (int j = 0; j < w; j++) {
+        raw_row[j] = (uint8)row[j];
+      }
+      // Fill padding pixels with WHITE
+      memset(raw_row + w, WHITE, nbytes * 8 - w);
+      packBits(nbytes, bytes, raw_row);
     }
-    // Fill padding pixels with WHITE
-    memset(raw_row + w, WHITE, nbytes * 8 - w);
-    packBits(nbytes, bytes, raw_row);
-    check(fwrite(bytes, sizeof(uint8), nbytes, f) == (size_t)nbytes,
-          "Writing pixels failed");
+    IOCHECK(fwrite(bytes, sizeof(uint8), nbytes, f) == (size_t)nbytes,
+            "Writing pixels failed");
   }
 
   // Cleanup
-  fclose(f);
-
+  FILE* closing = f;
+  f = NULL;
+  IOCHECK(fclose(closing) == 0, "Closing file failed");
+  free(bytes);
+  free(raw_row);
+
+  InstrEnd();
+  return 1;
+
+failed:
+  free(bytes);
+  free(raw_row);
+  if (f != NULL) fclose(f);
+  InstrEnd();
   return 0;
 }
 
@@ -463,117 +1391,911 @@ int ImageSavePBM(const Image img, const char* filename) {  ///
 /// Only ASCII PPM files are accepted.
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL (see ImageErrMsg).
 Image ImageLoadPPM(const char* filename) {
   assert(filename != NULL);
   int w, h;
   int levels;
   char c;
   FILE* f = NULL;
+  Image img = NULL;
 
-  check((f = fopen(filename, "rb")) != NULL, "Open failed");
+  InstrBegin("load");
+  errno = 0;
+  IOCHECK((f = fopen(filename, "rb")) != NULL, "Open failed");
   // Parse PPM header
-  check(fscanf(f, "P%c ", &c) == 1 && c == '3', "Invalid file format");
+  IOCHECK(fscanf(f, "P%c ", &c) == 1 && c == '3', "Invalid file format");
   skipComments(f);
-  check(fscanf(f, "%d ", &w) == 1 && w >= 0, "Invalid width");
+  IOCHECK(fscanf(f, "%d ", &w) == 1 && w > 0, "Invalid width");
   skipComments(f);
-  check(fscanf(f, "%d", &h) == 1 && h >= 0, "Invalid height");
+  IOCHECK(fscanf(f, "%d", &h) == 1 && h > 0, "Invalid height");
   skipComments(f);
-  check(fscanf(f, "%d", &levels) == 1 && 0 <= levels && levels <= 255,
-        "Invalid depth");
-  check(fscanf(f, "%c", &c) == 1 && isspace(c), "Whitespace expected");
+  IOCHECK(fscanf(f, "%d", &levels) == 1 && 0 <= levels && levels <= 255,
+          "Invalid depth");
+  IOCHECK(fscanf(f, "%c", &c) == 1 && isspace(c), "Whitespace expected");
 
-  // Allocate image
-  Image img = ImageCreate((uint32)w, (uint32)h);
+  // Allocate image (all pixels are read below)
+  img = AllocateImage((uint32)w, (uint32)h, 0);
 
   // Read pixels
   for (uint32 i = 0; i < img->height; i++) {
+    uint16* row = RowW(img, i);
     for (uint32 j = 0; j < img->width; j++) {
       int r, g, b;
-      check(fscanf(f, "%d %d %d", &r, &g, &b) == 3 && 0 <= r && r <= levels &&
-                0 <= g && g <= levels && 0 <= b && b <= levels,
-            "Invalid pixel color");
+      IOCHECK(fscanf(f, "%d %d %d", &r, &g, &b) == 3 && 0 <= r &&
+                  r <= levels && 0 <= g && g <= levels && 0 <= b &&
+                  b <= levels,
+              "Invalid pixel color");
       rgb_t color = r << 16 | g << 8 | b;
-      uint16 index = LUTAllocColor(img, color);
-      img->image[i][j] = index;
+      int index = LUTAllocColor(img, color);
+      IOCHECK(index >= 0, "LUT Overflow");
+      row[j] = (uint16)index;
       // printf("[%u][%u]: (%d,%d,%d) -> %u (%6x)\n", i, j, r,g,b, index,
       // color);
     }
-    fprintf(f, "\n");
   }
 
   fclose(f);
+  InstrEnd();
   return img;
+
+failed:
+  if (f != NULL) fclose(f);
+  if (img != NULL) ImageDestroy(&img);
+  InstrEnd();
+  return NULL;
+}
+
+// Each pixel is saved as "  %3d %3d %3d", so each PPM row has a fixed length
+#define PPM_PIXEL_CHARS 13
+#define PPM_CHUNK_BYTES (1 << 22)  // maximum size of the text formatted at once
+
+// Format level x (0..255) as with "%3d".
+static inline char* FormatLevel(char* p, int x) {
+  p[0] = x >= 100 ? '0' + x / 100 : ' ';
+  p[1] = x >= 10 ? '0' + x / 10 % 10 : ' ';
+  p[2] = '0' + x % 10;
+  return p + 3;
+}
+
+// Format the text of rows begin..end-1 of the chunk starting at row first.
+static void PPMRows(void* arg, uint32 begin, uint32 end) {
+  struct rowBands* b = arg;
+  Image img = b->src;
+  size_t row_len = (size_t)img->width * PPM_PIXEL_CHARS + 1;
+  for (uint32 i = begin; i < end; i++) {
+    const uint16* row = RowR(img, b->first + i);
+    char* p = b->text + i * row_len;
+    for (uint32 j = 0; j < img->width; j++) {
+      rgb_t color = img->LUT[row[j]];
+      *p++ = ' ';
+      *p++ = ' ';
+      p = FormatLevel(p, color >> 16 & 0xff);
+      *p++ = ' ';
+      p = FormatLevel(p, color >> 8 & 0xff);
+      *p++ = ' ';
+      p = FormatLevel(p, color & 0xff);
+    }
+    *p = '\n';
+  }
 }
 
 /// Save image to PPM file.
 /// On success, returns nonzero.
-/// On failure, a partial and invalid file may be left in the system.
+/// On failure, returns 0 (see ImageErrMsg),
+/// and a partial and invalid file may be left in the system.
 int ImageSavePPM(const Image img, const char* filename) {
   assert(img != NULL);
 
   int w = (int)img->width;
   int h = (int)img->height;
   FILE* f = NULL;
-
-  check((f = fopen(filename, "wb")) != NULL, "Open failed");
-  check(fprintf(f, "P3\n%d %d\n255\n", w, h) > 0, "Writing header failed");
-
-  // The pixel RGB values
-  for (uint32 i = 0; i < img->height; i++) {
-    for (uint32 j = 0; j < img->width; j++) {
-      uint16 index = img->image[i][j];
-      rgb_t color = img->LUT[index];
-      int r = color >> 16 & 0xff;
-      int g = color >> 8 & 0xff;
-      int b = color & 0xff;
-      fprintf(f, "  %3d %3d %3d", r, g, b);
-    }
-    fprintf(f, "\n");
+  char* text = NULL;
+
+  InstrBegin("save");
+  errno = 0;
+  IOCHECK((f = fopen(filename, "wb")) != NULL, "Open failed");
+  IOCHECK(fprintf(f, "P3\n%d %d\n255\n", w, h) > 0, "Writing header failed");
+
+  // The pixel RGB values, formatted in parallel, a chunk of rows at a time
+  size_t row_len = (size_t)img->width * PPM_PIXEL_CHARS + 1;
+  uint32 chunk_rows = PPM_CHUNK_BYTES / row_len;
+  if (chunk_rows == 0) chunk_rows = 1;
+  if (chunk_rows > img->height) chunk_rows = img->height;
+  text = malloc(chunk_rows * row_len);
+  check(text != NULL, "malloc");
+
+  struct rowBands b = {.src = img, .text = text};
+  for (b.first = 0; b.first < img->height; b.first += chunk_rows) {
+    uint32 rows = img->height - b.first < chunk_rows ? img->height - b.first
+                                                     : chunk_rows;
+    ThreadPoolFor(rows, img->width, PPMRows, &b);
+    IOCHECK(fwrite(text, row_len, rows, f) == rows, "Writing pixels failed");
   }
 
   // Cleanup
-  fclose(f);
-
+  FILE* closing = f;
+  f = NULL;
+  IOCHECK(fclose(closing) == 0, "Closing file failed");
+  free(text);
+
+  InstrEnd();
+  return 1;
+
+failed:
+  free(text);
+  if (f != NULL) fclose(f);
+  InstrEnd();
   return 0;
 }
 
-/// Information queries
+/// QOI file operations --- For RGB images, compressed
+
+// See QOI format specification: https://qoiformat.org/qoi-specification.pdf
+// After a 14-byte header, the pixels are a stream of chunks, each with a
+// run of the previous pixel, a recently seen pixel (from an index of 64,
+// by hash), a small difference to the previous pixel, or a full value.
+// The flat regions of segmented images take 1 byte per 62 pixels.
+// Pixels are 0xAARRGGBB here (all opaque, in images).
+
+#define QOI_OP_INDEX 0x00  // 00xxxxxx
+#define QOI_OP_DIFF 0x40   // 01xxxxxx
+#define QOI_OP_LUMA 0x80   // 10xxxxxx
+#define QOI_OP_RUN 0xc0    // 11xxxxxx
+#define QOI_OP_RGB 0xfe
+#define QOI_OP_RGBA 0xff
+#define QOI_MASK_2 0xc0
+#define QOI_RUN_MAX 62
+#define QOI_HEADER_SIZE 14
+#define QOI_PADDING 8              // the end marker: 7 0x00, then 0x01
+#define QOI_OPAQUE 0xff000000u     // the alpha of the pixels of an image
+#define QOI_BUF_BYTES (1 << 20)    // chunks encoded before being written
+#define QOI_COLORS_BITS 11         // (2^11 > 2 * FIXED_LUT_SIZE)
+#define QOI_COLORS_SIZE (1 << QOI_COLORS_BITS)
+#define QOI_COLOR_USED (1u << 24)  // in the keys of a table of colors
+
+static inline uint32 QOIHash(uint32 px) {
+  return ((px >> 16 & 0xff) * 3 + (px >> 8 & 0xff) * 5 + (px & 0xff) * 7 +
+          (px >> 24) * 11) % 64;
+}
 
-/// These functions do not modify the image and never fail.
+// The state of the encoder (and the chunks not yet written)
+struct qoiEncoder {
+  uint8* buf;
+  size_t pos;
+  uint32 index[64];  // recently seen pixels
+  uint32 px;         // the previous pixel
+  uint32 run;        // pixels equal to px, not yet encoded
+};
 
-/// Get image width
-uint32 ImageWidth(const Image img) {
-  assert(img != NULL);
-  return img->width;
+// Encode n more pixels equal to the previous one.
+static inline void QOIRun(struct qoiEncoder* e, uint32 n) {
+  e->run += n;
+  while (e->run >= QOI_RUN_MAX) {
+    e->buf[e->pos++] = QOI_OP_RUN | (QOI_RUN_MAX - 1);
+    e->run -= QOI_RUN_MAX;
+  }
 }
 
-/// Get image height
-uint32 ImageHeight(const Image img) {
-  assert(img != NULL);
-  return img->height;
+// Encode pixel px (opaque), different from the previous one.
+static inline void QOIPixel(struct qoiEncoder* e, uint32 px) {
+  if (e->run > 0) {
+    e->buf[e->pos++] = QOI_OP_RUN | (e->run - 1);
+    e->run = 0;
+  }
+  uint32 hash = QOIHash(px);
+  if (e->index[hash] == px) {
+    e->buf[e->pos++] = QOI_OP_INDEX | hash;
+  } else {
+    e->index[hash] = px;
+    int8_t vr = (int8_t)((px >> 16) - (e->px >> 16));
+    int8_t vg = (int8_t)((px >> 8) - (e->px >> 8));
+    int8_t vb = (int8_t)(px - e->px);
+    int8_t vg_r = vr - vg;
+    int8_t vg_b = vb - vg;
+    if (vr >= -2 && vr <= 1 && vg >= -2 && vg <= 1 && vb >= -2 && vb <= 1) {
+      e->buf[e->pos++] = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+    } else if (vg_r >= -8 && vg_r <= 7 && vg >= -32 && vg <= 31 &&
+               vg_b >= -8 && vg_b <= 7) {
+      e->buf[e->pos++] = QOI_OP_LUMA | (vg + 32);
+      e->buf[e->pos++] = (vg_r + 8) << 4 | (vg_b + 8);
+    } else {
+      e->buf[e->pos++] = QOI_OP_RGB;
+      e->buf[e->pos++] = px >> 16 & 0xff;
+      e->buf[e->pos++] = px >> 8 & 0xff;
+      e->buf[e->pos++] = px & 0xff;
+    }
+  }
+  e->px = px;
 }
 
-/// Get number of image colors
-uint16 ImageColors(const Image img) {
-  assert(img != NULL);
-  return img->num_colors;
+// Encode row v of img: a pixel for each run of equal labels, then a run.
+// (At most 5 bytes per pixel.)
+static void QOIEncodeRow(struct qoiEncoder* e, const Image img, uint32 v) {
+  uint32 w = img->width;
+  if (RowIsWhite(img, v)) {
+    // All WHITE, without reading the row
+    uint32 px = img->LUT[WHITE] | QOI_OPAQUE;
+    if (px != e->px) {
+      QOIPixel(e, px);
+      QOIRun(e, w - 1);
+    } else {
+      QOIRun(e, w);
+    }
+    return;
+  }
+  const uint16* row = RowR(img, v);
+  for (uint32 u = 0; u < w;) {
+    uint16 label = row[u];
+    uint32 end = u + 1;
+    while (end < w && row[end] == label) end++;
+    uint32 px = img->LUT[label] | QOI_OPAQUE;
+    if (px != e->px) {
+      QOIPixel(e, px);
+      u++;
+    }
+    QOIRun(e, end - u);
+    u = end;
+  }
+  PIXMEM_ADD(2 * w);
 }
 
-/// Image comparison
-
-/// These functions do not modify the images and never fail.
+// The slot of color in a table of the labels of colors, by hash (with open
+// addressing): the slot with key color | QOI_COLOR_USED, or a free one (0).
+static inline uint32 QOIColorSlot(const uint32* key, rgb_t color) {
+  uint32 k = (color * 2654435761u) >> (32 - QOI_COLORS_BITS);
+  while (key[k] != 0 && key[k] != (color | QOI_COLOR_USED)) {
+    k = (k + 1) & (QOI_COLORS_SIZE - 1);
+  }
+  return k;
+}
 
-/// Check if img1 and img2 represent equal images.
-/// NOTE: The same rgb color may correspond to different LUT labels in
-/// different images!
-int ImageIsEqual(const Image img1, const Image img2) {              
-  assert(img1 != NULL);
-  assert(img2 != NULL);
+static inline void QOIPut32(uint8* p, uint32 x) {
+  p[0] = x >> 24;
+  p[1] = x >> 16 & 0xff;
+  p[2] = x >> 8 & 0xff;
+  p[3] = x & 0xff;
+}
 
-  // Número de comparações realizadas pixel a pixel.
-  int comp = 0;
+static inline uint32 QOIGet32(const uint8* p) {
+  return (uint32)p[0] << 24 | (uint32)p[1] << 16 | (uint32)p[2] << 8 | p[3];
+}
 
-  // Se a altura ou a largura de uma imagem for diferente à outra,
+/// Load a QOI file.
+/// The alpha of the pixels is ignored.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL (see ImageErrMsg).
+Image ImageLoadQOI(const char* filename) {
+  assert(filename != NULL);
+  FILE* f = NULL;
+  Image img = NULL;
+  uint8* file = MAP_FAILED;
+  size_t size = 0;
+  struct stat st;
+  // The labels of the colors seen (see QOIColorSlot)
+  uint32 color_key[QOI_COLORS_SIZE];
+  uint16 color_label[QOI_COLORS_SIZE];
+
+  InstrBegin("load");
+  errno = 0;
+  IOCHECK((f = fopen(filename, "rb")) != NULL, "Open failed");
+  IOCHECK(fstat(fileno(f), &st) == 0, "Reading file failed");
+  IOCHECK(st.st_size >= QOI_HEADER_SIZE + QOI_PADDING, "Invalid file format");
+  size = (size_t)st.st_size;
+  IOCHECK((file = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(f), 0)) !=
+              MAP_FAILED,
+          "Mapping file failed");
+  // Parse QOI header
+  IOCHECK(memcmp(file, "qoif", 4) == 0, "Invalid file format");
+  uint32 w = QOIGet32(file + 4);
+  uint32 h = QOIGet32(file + 8);
+  // (Each byte of the chunks encodes at most QOI_RUN_MAX pixels)
+  IOCHECK(w > 0 && h > 0 &&
+              (uint64_t)w * h <= (uint64_t)(size - QOI_HEADER_SIZE -
+                                            QOI_PADDING) * QOI_RUN_MAX,
+          "Invalid size");
+  IOCHECK(file[12] == 3 || file[12] == 4, "Invalid channels");
+
+  // Allocate image (all WHITE: the WHITE pixels are not written)
+  img = AllocateImage(w, h, 1);
+  memset(color_key, 0, sizeof(color_key));
+  for (uint16 l = 0; l < img->num_colors; l++) {
+    uint32 k = QOIColorSlot(color_key, img->LUT[l]);
+    color_key[k] = img->LUT[l] | QOI_COLOR_USED;
+    color_label[k] = l;
+  }
+
+  // Decode the chunks (each needs at most 5 bytes, before the end marker)
+  const uint8* p = file + QOI_HEADER_SIZE;
+  const uint8* end = file + size - QOI_PADDING;
+  uint32 index[64];
+  uint16 index_label[64];  // the labels of the index pixels
+  memset(index, 0, sizeof(index));
+  for (int k = 0; k < 64; k++) index_label[k] = BLACK;
+  uint32 px = QOI_OPAQUE;
+  uint16 label = BLACK;
+  uint32 u = 0;
+  uint32 v = 0;
+  uint16* row = NULL;
+  while (v < h) {
+    IOCHECK(p < end, "Truncated file");
+    uint32 b1 = *p++;
+    uint32 n = 1;   // the number of pixels
+    int fresh = 1;  // whether px is a new pixel (not from the index)
+    if (b1 == QOI_OP_RGB) {
+      px = (px & QOI_OPAQUE) | (uint32)p[0] << 16 | (uint32)p[1] << 8 | p[2];
+      p += 3;
+    } else if (b1 == QOI_OP_RGBA) {
+      px = (uint32)p[3] << 24 | (uint32)p[0] << 16 | (uint32)p[1] << 8 | p[2];
+      p += 4;
+    } else if ((b1 & QOI_MASK_2) == QOI_OP_INDEX) {
+      px = index[b1];
+      label = index_label[b1];
+      fresh = 0;
+    } else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF) {
+      uint8 r = (px >> 16) + ((b1 >> 4 & 3) - 2);
+      uint8 g = (px >> 8) + ((b1 >> 2 & 3) - 2);
+      uint8 b = px + ((b1 & 3) - 2);
+      px = (px & QOI_OPAQUE) | (uint32)r << 16 | (uint32)g << 8 | b;
+    } else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA) {
+      uint32 b2 = *p++;
+      int vg = (int)(b1 & 0x3f) - 32;
+      uint8 r = (px >> 16) + vg - 8 + (b2 >> 4 & 0x0f);
+      uint8 g = (px >> 8) + vg;
+      uint8 b = px + vg - 8 + (b2 & 0x0f);
+      px = (px & QOI_OPAQUE) | (uint32)r << 16 | (uint32)g << 8 | b;
+    } else {
+      n = (b1 & 0x3f) + 1;  // QOI_OP_RUN
+      fresh = 0;
+    }
+    if (fresh) {
+      // Find the label of its color, or add the color to the LUT
+      rgb_t color = px & 0xffffff;
+      uint32 k = QOIColorSlot(color_key, color);
+      if (color_key[k] == 0) {
+        IOCHECK(img->num_colors < FIXED_LUT_SIZE, "LUT Overflow");
+        color_key[k] = color | QOI_COLOR_USED;
+        color_label[k] = (uint16)LUTAppend(img, color);
+      }
+      label = color_label[k];
+      uint32 hash = QOIHash(px);
+      index[hash] = px;
+      index_label[hash] = label;
+    }
+
+    // Write the n pixels, possibly on several rows
+    while (n > 0 && v < h) {
+      uint32 k = n < w - u ? n : w - u;
+      if (label != WHITE) {
+        if (row == NULL) row = RowW(img, v);
+        for (uint32 j = u; j < u + k; j++) row[j] = label;
+        PIXMEM_ADD(2 * k);
+      }
+      u += k;
+      n -= k;
+      if (u == w) {
+        u = 0;
+        v++;
+        row = NULL;
+      }
+    }
+  }
+
+  munmap(file, size);
+  fclose(f);
+  InstrEnd();
+  return img;
+
+failed:
+  if (file != MAP_FAILED) munmap(file, size);
+  if (f != NULL) fclose(f);
+  if (img != NULL) ImageDestroy(&img);
+  InstrEnd();
+  return NULL;
+}
+
+/// Save image to QOI file.
+/// On success, returns nonzero.
+/// On failure, returns 0 (see ImageErrMsg),
+/// and a partial and invalid file may be left in the system.
+int ImageSaveQOI(const Image img, const char* filename) {
+  assert(img != NULL);
+
+  FILE* f = NULL;
+  struct qoiEncoder e = {.px = QOI_OPAQUE};
+
+  InstrBegin("save");
+  errno = 0;
+  IOCHECK((f = fopen(filename, "wb")) != NULL, "Open failed");
+  uint8 header[QOI_HEADER_SIZE] = {'q', 'o', 'i', 'f'};
+  QOIPut32(header + 4, img->width);
+  QOIPut32(header + 8, img->height);
+  header[12] = 3;  // RGB
+  header[13] = 0;  // sRGB
+  IOCHECK(fwrite(header, sizeof(header), 1, f) == 1, "Writing header failed");
+
+  // Encode the rows, writing the chunks when the buffer is nearly full
+  e.buf = malloc(QOI_BUF_BYTES + 5 * (size_t)img->width + QOI_PADDING);
+  check(e.buf != NULL, "malloc");
+  for (uint32 v = 0; v < img->height; v++) {
+    QOIEncodeRow(&e, img, v);
+    if (e.pos >= QOI_BUF_BYTES) {
+      IOCHECK(fwrite(e.buf, 1, e.pos, f) == e.pos, "Writing pixels failed");
+      e.pos = 0;
+    }
+  }
+  if (e.run > 0) e.buf[e.pos++] = QOI_OP_RUN | (e.run - 1);
+  memset(e.buf + e.pos, 0, QOI_PADDING - 1);
+  e.buf[e.pos + QOI_PADDING - 1] = 1;
+  e.pos += QOI_PADDING;
+  IOCHECK(fwrite(e.buf, 1, e.pos, f) == e.pos, "Writing pixels failed");
+
+  // Cleanup
+  FILE* closing = f;
+  f = NULL;
+  IOCHECK(fclose(closing) == 0, "Closing file failed");
+  free(e.buf);
+
+  InstrEnd();
+  return 1;
+
+failed:
+  free(e.buf);
+  if (f != NULL) fclose(f);
+  InstrEnd();
+  return 0;
+}
+
+/// Native image files
+
+// A native image file has a header, the LUT, and the pixel labels, in the
+// byte order of the machine that wrote it:
+//   offset 0:            struct imgHeader
+//   offset sizeof(hdr):  the LUT, num_colors rgb_t
+//   IMAGE_RAW: at offset pixels (a multiple of IMG_ALIGN), the rows of
+//     stride labels each, as in memory (so ImageLoad may map them);
+//   IMAGE_RLE: at offset pixels, the runs of each row (struct imgRun),
+//     and at offset index, the offsets of the runs of each row, and of
+//     their end (height + 1 uint64_t).
+
+#define IMG_MAGIC "imageRGB"
+#define IMG_BYTE_ORDER 0x01020304u
+#define IMG_VERSION 1
+#define IMG_ALIGN 4096              // alignment of the raw pixels
+#define IMG_RUN_MAX 65535           // maximum length of a run
+#define IMG_CHUNK_BYTES (1 << 22)   // maximum size of the runs encoded at once
+
+struct imgHeader {
+  char magic[8];      // IMG_MAGIC
+  uint32 byte_order;  // IMG_BYTE_ORDER (in the byte order of the file)
+  uint32 version;     // IMG_VERSION
+  uint32 width;
+  uint32 height;
+  uint32 num_colors;
+  uint32 format;      // IMAGE_RAW or IMAGE_RLE
+  uint32 stride;      // labels per row (IMAGE_RAW)
+  uint32 reserved;
+  uint64_t pixels;    // offset of the pixels
+  uint64_t index;     // offset of the row index (IMAGE_RLE)
+  uint64_t size;      // size of the file
+};
+
+// A run of len (> 0) pixels with label label
+struct imgRun {
+  uint16 len;
+  uint16 label;
+};
+
+// Encode the runs of rows first+begin..first+end-1: row first+i at
+// runs + i * width.
+static void RLEEncodeRows(void* arg, uint32 begin, uint32 end) {
+  struct rowBands* b = arg;
+  Image img = b->src;
+  uint32 w = img->width;
+  for (uint32 i = begin; i < end; i++) {
+    uint32 v = b->first + i;
+    struct imgRun* r = b->runs + (size_t)i * w;
+    uint32 n = 0;
+    if (RowIsWhite(img, v)) {
+      // All WHITE, without reading the row
+      for (uint32 u = 0; u < w; u += IMG_RUN_MAX) {
+        r[n++] = (struct imgRun){w - u < IMG_RUN_MAX ? w - u : IMG_RUN_MAX,
+                                 WHITE};
+      }
+    } else {
+      const uint16* row = RowR(img, v);
+      for (uint32 u = 0; u < w;) {
+        uint32 e = u + 1;
+        while (e < w && row[e] == row[u] && e - u < IMG_RUN_MAX) e++;
+        r[n++] = (struct imgRun){e - u, row[u]};
+        u = e;
+      }
+      PIXMEM_ADD(2 * w);
+    }
+    b->num_runs[i] = n;
+  }
+}
+
+// Decode the runs of rows begin..end-1 (of a WHITE image).
+// Rows of just WHITE runs are not written, and stay flagged as WHITE.
+static void RLEDecodeRows(void* arg, uint32 begin, uint32 end) {
+  struct rowBands* b = arg;
+  Image img = b->dst;
+  for (uint32 v = begin; v < end; v++) {
+    if (__atomic_load_n(&b->invalid, __ATOMIC_RELAXED)) return;
+    const struct imgRun* r = (const struct imgRun*)(b->file + b->index[v]);
+    uint32 n = (uint32)((b->index[v + 1] - b->index[v]) / sizeof(*r));
+    uint64_t total = 0;
+    int white = 1;
+    for (uint32 k = 0; k < n; k++) {
+      if (r[k].len == 0 || r[k].label >= img->num_colors) total = UINT64_MAX;
+      else total += r[k].len;
+      white &= r[k].label == WHITE;
+      if (total > img->width) break;
+    }
+    if (total != img->width) {
+      __atomic_store_n(&b->invalid, 1, __ATOMIC_RELAXED);
+      return;
+    }
+    if (white) continue;
+    uint16* row = RowW(img, v);
+    for (uint32 k = 0; k < n; k++) {
+      for (uint32 j = 0; j < r[k].len; j++) *row++ = r[k].label;
+    }
+    PIXMEM_ADD(2 * img->width);
+  }
+}
+
+// Check that the labels of the rows of b->dst are in its LUT.
+static void RawCheckRows(void* arg, uint32 begin, uint32 end) {
+  struct rowBands* b = arg;
+  Image img = b->dst;
+  for (uint32 v = begin; v < end; v++) {
+    if (__atomic_load_n(&b->invalid, __ATOMIC_RELAXED)) return;
+    const uint16* row = RowR(img, v);
+    uint16 max = 0;
+    for (uint32 u = 0; u < img->width; u++) {
+      if (row[u] > max) max = row[u];
+    }
+    PIXMEM_ADD(img->width);
+    if (max >= img->num_colors) {
+      __atomic_store_n(&b->invalid, 1, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+}
+
+// Open a new file, to be renamed to filename when complete, in the same
+// directory (so that the images mapped from filename, see ImageLoad, keep
+// the old one).  Its name is stored in *tmp, to be freed.
+// Returns the stream, or NULL (see errno).
+static FILE* TempFileOpen(const char* filename, char** tmp) {
+  static uint32 counter = 0;  // (atomic)
+  size_t size = strlen(filename) + 32;
+  *tmp = malloc(size);
+  check(*tmp != NULL, "malloc");
+  snprintf(*tmp, size, "%s.%d.%u.tmp", filename, (int)getpid(),
+           __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED));
+  int fd = open(*tmp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+  if (fd < 0) return NULL;
+  FILE* f = fdopen(fd, "wb");
+  if (f == NULL) {
+    int saved = errno;
+    close(fd);
+    unlink(*tmp);
+    errno = saved;
+  }
+  return f;
+}
+
+/// Save image to a native image file, with the pixels in format.
+/// On success, returns nonzero.
+/// On failure, returns 0 (see ImageErrMsg).
+int ImageSave(const Image img, const char* filename, int format) {
+  assert(img != NULL);
+  assert(format == IMAGE_RAW || format == IMAGE_RLE);
+
+  uint32 w = img->width;
+  uint32 h = img->height;
+  FILE* f = NULL;
+  uint16* zero = NULL;
+  struct imgRun* runs = NULL;
+  uint32* num_runs = NULL;
+  uint64_t* index = NULL;
+  char* tmp = NULL;
+
+  InstrBegin("save");
+  errno = 0;
+  // (Escrever num ficheiro novo, e só no fim substituir o antigo: as
+  // imagens carregadas dele, mapeadas, continuam válidas.)
+  IOCHECK((f = TempFileOpen(filename, &tmp)) != NULL, "Open failed");
+
+  struct imgHeader hd;
+  memset(&hd, 0, sizeof(hd));
+  memcpy(hd.magic, IMG_MAGIC, sizeof(hd.magic));
+  hd.byte_order = IMG_BYTE_ORDER;
+  hd.version = IMG_VERSION;
+  hd.width = w;
+  hd.height = h;
+  hd.num_colors = img->num_colors;
+  hd.format = (uint32)format;
+  hd.stride = (uint32)RowStride(w);
+  size_t lut_end = sizeof(hd) + img->num_colors * sizeof(rgb_t);
+  size_t row_bytes = (size_t)hd.stride * sizeof(uint16);
+  if (format == IMAGE_RAW) {
+    hd.pixels = (lut_end + IMG_ALIGN - 1) / IMG_ALIGN * IMG_ALIGN;
+    hd.size = hd.pixels + (uint64_t)row_bytes * h;
+  } else {
+    hd.pixels = lut_end;  // (a multiple of sizeof(struct imgRun))
+  }
+  IOCHECK(fwrite(&hd, sizeof(hd), 1, f) == 1 &&
+              fwrite(img->LUT, sizeof(rgb_t), img->num_colors, f) ==
+                  img->num_colors,
+          "Writing header failed");
+
+  // Zeros, for the padding and the WHITE rows
+  zero = calloc(1, row_bytes > IMG_ALIGN ? row_bytes : IMG_ALIGN);
+  check(zero != NULL, "calloc");
+
+  if (format == IMAGE_RAW) {
+    // The rows, as in memory (the padding pixels as WHITE)
+    IOCHECK(fwrite(zero, 1, hd.pixels - lut_end, f) == hd.pixels - lut_end,
+            "Writing header failed");
+    for (uint32 i = 0; i < h; i++) {
+      if (RowIsWhite(img, i)) {
+        IOCHECK(fwrite(zero, row_bytes, 1, f) == 1, "Writing pixels failed");
+        continue;
+      }
+      IOCHECK(fwrite(RowR(img, i), sizeof(uint16), w, f) == w &&
+                  fwrite(zero, sizeof(uint16), hd.stride - w, f) ==
+                      hd.stride - w,
+              "Writing pixels failed");
+      PIXMEM_ADD(2 * w);
+    }
+  } else {
+    // The runs, encoded in parallel, a chunk of rows at a time
+    uint32 chunk_rows = IMG_CHUNK_BYTES / (w * sizeof(struct imgRun));
+    if (chunk_rows == 0) chunk_rows = 1;
+    if (chunk_rows > h) chunk_rows = h;
+    runs = malloc((size_t)chunk_rows * w * sizeof(struct imgRun));
+    num_runs = malloc(chunk_rows * sizeof(uint32));
+    index = malloc(((size_t)h + 1) * sizeof(uint64_t));
+    check(runs != NULL && num_runs != NULL && index != NULL, "malloc");
+
+    uint64_t offset = hd.pixels;
+    struct rowBands b = {.src = img, .runs = runs, .num_runs = num_runs};
+    for (b.first = 0; b.first < h; b.first += chunk_rows) {
+      uint32 rows = h - b.first < chunk_rows ? h - b.first : chunk_rows;
+      ThreadPoolFor(rows, w, RLEEncodeRows, &b);
+      for (uint32 i = 0; i < rows; i++) {
+        index[b.first + i] = offset;
+        IOCHECK(fwrite(runs + (size_t)i * w, sizeof(struct imgRun),
+                       num_runs[i], f) == num_runs[i],
+                "Writing pixels failed");
+        offset += num_runs[i] * sizeof(struct imgRun);
+      }
+    }
+    index[h] = offset;
+
+    // The row index (aligned), then the header, complete
+    size_t pad = (size_t)(-offset % sizeof(uint64_t));
+    hd.index = offset + pad;
+    hd.size = hd.index + ((uint64_t)h + 1) * sizeof(uint64_t);
+    IOCHECK(fwrite(zero, 1, pad, f) == pad &&
+                fwrite(index, sizeof(uint64_t), (size_t)h + 1, f) ==
+                    (size_t)h + 1,
+            "Writing pixels failed");
+    IOCHECK(fseek(f, 0, SEEK_SET) == 0 && fwrite(&hd, sizeof(hd), 1, f) == 1,
+            "Writing header failed");
+  }
+
+  // Cleanup
+  FILE* closing = f;
+  f = NULL;
+  IOCHECK(fclose(closing) == 0, "Closing file failed");
+  IOCHECK(rename(tmp, filename) == 0, "Renaming file failed");
+  free(zero);
+  free(runs);
+  free(num_runs);
+  free(index);
+  free(tmp);
+
+  InstrEnd();
+  return 1;
+
+failed:
+  free(zero);
+  free(runs);
+  free(num_runs);
+  free(index);
+  if (f != NULL) fclose(f);
+  if (tmp != NULL) {
+    int saved = errno;
+    unlink(tmp);
+    errno = saved;
+    free(tmp);
+  }
+  InstrEnd();
+  return 0;
+}
+
+/// Load a native image file.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL (see ImageErrMsg).
+Image ImageLoad(const char* filename) {
+  assert(filename != NULL);
+  FILE* f = NULL;
+  Image img = NULL;
+  uint8* file = MAP_FAILED;  // the file, mapped (IMAGE_RLE)
+  size_t file_size = 0;
+  struct imgHeader hd;
+  rgb_t lut[FIXED_LUT_SIZE];
+  struct stat st;
+
+  InstrBegin("load");
+  errno = 0;
+  IOCHECK((f = fopen(filename, "rb")) != NULL, "Open failed");
+  // Parse header
+  IOCHECK(fread(&hd, sizeof(hd), 1, f) == 1 &&
+              memcmp(hd.magic, IMG_MAGIC, sizeof(hd.magic)) == 0,
+          "Invalid file format");
+  IOCHECK(hd.byte_order == IMG_BYTE_ORDER, "Unsupported byte order");
+  IOCHECK(hd.version == IMG_VERSION, "Unsupported version");
+  IOCHECK(hd.width > 0 && hd.height > 0, "Invalid size");
+  IOCHECK(2 <= hd.num_colors && hd.num_colors <= FIXED_LUT_SIZE,
+          "Invalid number of colors");
+  IOCHECK(fread(lut, sizeof(rgb_t), hd.num_colors, f) == hd.num_colors,
+          "Reading LUT failed");
+  // (Label 0 is WHITE and label 1 is BLACK in every image.)
+  IOCHECK(lut[WHITE] == 0xffffff && lut[BLACK] == 0x000000, "Invalid LUT");
+  IOCHECK(fstat(fileno(f), &st) == 0 && (uint64_t)st.st_size >= hd.size,
+          "Truncated file");
+  uint64_t lut_end = sizeof(hd) + hd.num_colors * sizeof(rgb_t);
+  uint32 w = hd.width;
+  uint32 h = hd.height;
+
+  if (hd.format == IMAGE_RAW) {
+    uint64_t row_bytes = (uint64_t)hd.stride * sizeof(uint16);
+    IOCHECK(hd.stride >= w && hd.pixels >= lut_end && hd.pixels <= hd.size &&
+                (hd.size - hd.pixels) / row_bytes >= h,
+            "Invalid pixels");
+    if (hd.stride == RowStride(w) &&
+        hd.pixels % (uint64_t)sysconf(_SC_PAGESIZE) == 0 &&
+        !TilesWanted(row_bytes * h)) {
+      // Use the pixels in place: the file is mapped privately, so writes
+      // to the image do not change it.
+      void* pixels;
+      IOCHECK((pixels = mmap(NULL, row_bytes * h, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE, fileno(f), (off_t)hd.pixels)) !=
+                  MAP_FAILED,
+              "Mapping pixels failed");
+      img = AllocateHeader(w, h);
+      memset(img->white_rows, 0, h);
+      memset(img->shared, 0, img->num_blocks);
+      struct pixelStore* s = StoreAlloc(img, 0, img->num_blocks);
+      s->pixels = pixels;
+      s->mapped = 1;
+      StoreAttach(img, s, img->num_blocks);
+    } else {
+      // Read the rows (e.g., written with another stride)
+      img = AllocateImage(w, h, 0);
+      IOCHECK(fseek(f, (long)hd.pixels, SEEK_SET) == 0, "Reading pixels");
+      for (uint32 i = 0; i < h; i++) {
+        IOCHECK(fread(RowW(img, i), sizeof(uint16), w, f) == w &&
+                    fseek(f, (long)(hd.stride - w) * 2, SEEK_CUR) == 0,
+                "Reading pixels");
+      }
+    }
+
+    // Check the labels in parallel (reading the pixels in place, once)
+    img->num_colors = (uint16)hd.num_colors;
+    struct rowBands b = {.dst = img};
+    ThreadPoolFor(h, w, RawCheckRows, &b);
+    IOCHECK(!b.invalid, "Invalid pixels");
+  } else {
+    IOCHECK(hd.format == IMAGE_RLE, "Invalid pixel format");
+    IOCHECK(hd.pixels >= lut_end && hd.pixels % sizeof(struct imgRun) == 0 &&
+                hd.index >= hd.pixels && hd.index % sizeof(uint64_t) == 0 &&
+                hd.index <= hd.size &&
+                (hd.size - hd.index) / sizeof(uint64_t) > h,
+            "Invalid pixels");
+    file_size = hd.size;
+    IOCHECK((file = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fileno(f),
+                         0)) != MAP_FAILED,
+            "Mapping pixels failed");
+    const uint64_t* index = (const uint64_t*)(file + hd.index);
+    IOCHECK(index[0] == hd.pixels && index[h] <= hd.index, "Invalid pixels");
+    for (uint32 i = 0; i < h; i++) {
+      IOCHECK(index[i] <= index[i + 1] &&
+                  (index[i + 1] - index[i]) % sizeof(struct imgRun) == 0,
+              "Invalid pixels");
+    }
+
+    // Decode the rows in parallel (the LUT is needed to check the labels)
+    img = AllocateImage(w, h, 1);
+    img->num_colors = (uint16)hd.num_colors;
+    struct rowBands b = {.dst = img, .file = file, .index = index};
+    ThreadPoolFor(h, w, RLEDecodeRows, &b);
+    IOCHECK(!b.invalid, "Invalid pixels");
+    munmap(file, file_size);
+    file = MAP_FAILED;
+  }
+
+  img->num_colors = (uint16)hd.num_colors;
+  memcpy(img->LUT, lut, hd.num_colors * sizeof(rgb_t));
+
+  fclose(f);
+  InstrEnd();
+  return img;
+
+failed:
+  if (file != MAP_FAILED) munmap(file, file_size);
+  if (f != NULL) fclose(f);
+  if (img != NULL) ImageDestroy(&img);
+  InstrEnd();
+  return NULL;
+}
+
+/// Information queries
+
+/// These functions do not modify the image and never fail.
+
+/// Get image width
+uint32 ImageWidth(const Image img) {
+  assert(img != NULL);
+  return img->width;
+}
+
+/// Get image height
+uint32 ImageHeight(const Image img) {
+  assert(img != NULL);
+  return img->height;
+}
+
+/// Get number of image colors
+uint16 ImageColors(const Image img) {
+  assert(img != NULL);
+  return img->num_colors;
+}
+
+/// Image comparison
+
+/// These functions do not modify the images and never fail.
+
+// Comparar as cores das linhas begin..end-1 das duas imagens.
+// Quando uma banda encontra uma diferença, as outras param também.
+static void IsEqualRows(void* arg, uint32 begin, uint32 end) {
+  struct rowBands* b = arg;
+  for (uint32 i = begin; i < end; i++) {
+    if (__atomic_load_n(&b->differ, __ATOMIC_RELAXED)) return;
+    // Duas linhas todas WHITE são iguais (o label 0 é WHITE em todas as LUT).
+    if (RowIsWhite(b->src, i) && RowIsWhite(b->dst, i)) continue;
+    const uint16* row1 = RowR(b->src, i);
+    const uint16* row2 = RowR(b->dst, i);
+    for (uint32 j = 0; j < b->src->width; j++) {
+      if (b->src->LUT[row1[j]] != b->dst->LUT[row2[j]]) {
+        PIXMEM_ADD(2 * (j + 1));
+        __atomic_store_n(&b->differ, 1, __ATOMIC_RELAXED);
+        return;
+      }
+    }
+    PIXMEM_ADD(2 * b->src->width);
+  }
+}
+
+/// Check if img1 and img2 represent equal images.
+/// NOTE: The same rgb color may correspond to different LUT labels in
+/// different images!
+int ImageIsEqual(const Image img1, const Image img2) {              
+  assert(img1 != NULL);
+  assert(img2 != NULL);
+
+  // Número de comparações realizadas pixel a pixel.
+  int comp = 0;
+
+  // Se a altura ou a largura de uma imagem for diferente à outra,
   // então as imagens não são iguais (return 0).
   if (img1->height != img2->height || img1->width != img2->width) {
     printf("Numero de comparacoes: %d\n", comp);      
@@ -587,17 +2309,15 @@ int ImageIsEqual(const Image img1, const Image img2) {
     return 0;
   }
 
-  // Percorrer sobre todas as linhas e colunas da imagem1.
+  // Percorrer sobre todas as linhas e colunas da imagem1 (por bandas de linhas, em paralelo).
   // Se a cor do pixel da imagem1 for diferente ao da imagem2 (nas mesmas posições),
   // então não são imagens iguais (return 0).
-  for (uint32 i = 0; i < img1->height; i++) {
-    for (uint32 j = 0; j < img1->width; j++) {
-      comp ++;                                                                       // Incrementa 1 a cada comparação.
-      if (img1->LUT[img1->image[i][j]] != img2->LUT[img2->image[i][j]]){                  //  Compara as cores pixel a pixel.
-        return 0;             
-      }
-    }
+  struct rowBands b = {.src = img1, .dst = img2, .differ = 0};
+  ThreadPoolFor(img1->height, img1->width, IsEqualRows, &b);
+  if (b.differ) {
+    return 0;
   }
+  comp = (int)(img1->width * img1->height);                    // Imagens iguais: foram comparados todos os pixels.
   printf("Numero de comparacoes: %d\n", comp);      
   return 1;                                                                              // Retorna 1 se as imagens forem iguais.
 }
@@ -617,6 +2337,47 @@ int ImageIsDifferent(const Image img1, const Image img2) {
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 
+// Preencher as linhas begin..end-1 da imagem rodada 90CW:
+// a linha j é a coluna j da imagem original, de baixo para cima.
+static void Rotate90CWRows(void* arg, uint32 begin, uint32 end) {
+  struct rowBands* b = arg;
+  uint32 h = b->src->height;
+  for (uint32 j = begin; j < end; j++) {
+    uint16* row = b->dst->image[j];
+    for (uint32 i = 0; i < h; i++) {
+      row[h - 1 - i] = b->src->image[i][j];
+    }
+    PIXMEM_ADD(2 * h);
+  }
+}
+
+// Preencher as linhas first+begin..first+end-1 da imagem rodada 90CW,
+// só nas colunas das linhas src_begin..src_end-1 da imagem original
+// (imagens em tiles: ver ImageRotate90CW).
+static void Rotate90CWStrip(void* arg, uint32 begin, uint32 end) {
+  struct rowBands* b = arg;
+  uint32 h = b->src->height;
+  for (uint32 j = b->first + begin; j < b->first + end; j++) {
+    uint16* row = RowW(b->dst, j);
+    for (uint32 i = b->src_begin; i < b->src_end; i++) {
+      row[h - 1 - i] = b->src->image[i][j];
+    }
+    PIXMEM_ADD(2 * (b->src_end - b->src_begin));
+  }
+}
+
+// Number of rows of img (tiled) that take at most a fraction 1/parts of
+// the tile budget: a whole number of tiles, at least one.
+static uint32 TileStripRows(const Image img, uint32 parts) {
+  pthread_mutex_lock(&tile_cache.lock);
+  size_t bytes = tile_cache.budget / parts;
+  pthread_mutex_unlock(&tile_cache.lock);
+  size_t tile = RowStride(img->width) * sizeof(uint16) << img->block_shift;
+  size_t rows = (bytes / tile) << img->block_shift;
+  if (rows == 0) rows = (size_t)1 << img->block_shift;
+  return rows < img->height ? (uint32)rows : img->height;
+}
+
 /// Rotate 90 degrees clockwise (CW).
 /// Returns a rotated version of the image.
 /// Ensures: The original img is not modified.
@@ -627,7 +2388,7 @@ Image ImageRotate90CW(const Image img) {
   assert(img != NULL);
 
   // Criar uma nova imagem com as dimensões invertidas(linha passa a coluna e coluna passa a linha).
-  Image img90CW = AllocateImageHeader(img->height, img->width);
+  Image img90CW = AllocateImage(img->height, img->width, 0);
 
   // Copiar o número de cores utilizadas na LUT (Look-Up Table) para a imagem rodada.
   img90CW->num_colors = img->num_colors;
@@ -636,21 +2397,60 @@ Image ImageRotate90CW(const Image img) {
   // Como as cores estão no formato LUT, temos de multiplicar pelo tamanho de LUT.
   memcpy(img90CW->LUT, img->LUT, img->num_colors * sizeof(rgb_t));
 
-  // Alocar a linha que vai usar.
-  for (uint32 i = 0; i < img->width; i++)
-        img90CW->image[i] = AllocateRowArray(img90CW->width);
-
   // O pixel da img(i, j) passa a ser img90CW(j, imgHeight - 1 - i).
   // A primeira linha passa a ser a última coluna.
-  for (uint32 i = 0; i < img->height; i++) {
-    for (uint32 j = 0; j < img->width; j++) {
-      img90CW->image[j][(img->height) - 1 - i] = img->image[i][j];
+  // Cada banda de linhas da imagem rodada é preenchida em paralelo.
+  struct rowBands b = {.src = img, .dst = img90CW};
+  if (!img->tiled && !img90CW->tiled) {
+    ThreadPoolFor(img90CW->height, img90CW->width, Rotate90CWRows, &b);
+    return img90CW;
+  }
+
+  // Imagens em tiles: cada coluna da original passaria por todos os seus
+  // tiles.  Assim, a imagem rodada é preenchida por faixas de linhas que
+  // cabem em metade do orçamento de memória, e a original é lida, para
+  // cada faixa, em ordem, por faixas de linhas que cabem num quarto.
+  uint32 w = img90CW->width;
+  uint32 h = img90CW->height;
+  uint32 dst_rows = img90CW->tiled ? TileStripRows(img90CW, 2) : h;
+  uint32 src_rows = img->tiled ? TileStripRows(img, 4) : w;
+  for (b.first = 0; b.first < h; b.first += dst_rows) {
+    uint32 rows = h - b.first < dst_rows ? h - b.first : dst_rows;
+    for (b.src_begin = 0; b.src_begin < w; b.src_begin = b.src_end) {
+      b.src_end = w - b.src_begin < src_rows ? w : b.src_begin + src_rows;
+      for (uint32 i = b.src_begin; i < b.src_end; i += 1u << img->block_shift) {
+        RowR(img, i);  // (os tiles da faixa, lidos por Rotate90CWStrip)
+      }
+      ThreadPoolFor(rows, b.src_end - b.src_begin, Rotate90CWStrip, &b);
     }
   }
 
   return img90CW;                   // Retorna a imagem rodada 90 graus.
 }
 
+// Preencher as linhas begin..end-1 da imagem rodada 180CW:
+// a linha i é a linha imgHeight - 1 - i da imagem original, invertida.
+static void Rotate180CWRows(void* arg, uint32 begin, uint32 end) {
+  struct rowBands* b = arg;
+  uint32 w = b->src->width;
+  uint32 h = b->src->height;
+  for (uint32 i = begin; i < end; i++) {
+    if (RowIsWhite(b->src, h - 1 - i)) {
+      // Linha toda WHITE: continua toda WHITE, sem a ler (numa imagem
+      // em tiles, nova, os pixels já são todos WHITE no ficheiro).
+      if (!b->dst->tiled) memset(b->dst->image[i], 0, w * sizeof(uint16));
+      b->dst->white_rows[i] = 1;
+      continue;
+    }
+    uint16* row = RowW(b->dst, i);
+    const uint16* src_row = RowR(b->src, h - 1 - i);
+    for (uint32 j = 0; j < w; j++) {
+      row[w - 1 - j] = src_row[j];
+    }
+    PIXMEM_ADD(2 * w);
+  }
+}
+
 /// Rotate 180 degrees clockwise (CW).
 /// Returns a rotated version of the image.
 /// Ensures: The original img is not modified.
@@ -661,7 +2461,7 @@ Image ImageRotate180CW(const Image img) {
   assert(img != NULL);
 
   // Criar uma nova imagem com as mesmas dimensões da imagem original.
-  Image img180CW = AllocateImageHeader(img->width, img->height);
+  Image img180CW = AllocateImage(img->width, img->height, 0);
 
   // Igualar o número de cores.
   img180CW->num_colors = img->num_colors;
@@ -670,16 +2470,10 @@ Image ImageRotate180CW(const Image img) {
   // Como as cores estão no formato LUT, temos de multiplicar pelo tamanho de LUT.
   memcpy(img180CW->LUT, img->LUT, img->num_colors * sizeof(rgb_t));
 
-  // Alocar a linha que vai usar.
-  for (uint32 i = 0; i < img180CW->height; i++)
-        img180CW->image[i] = AllocateRowArray(img180CW->width);
-
   // O pixel da img(i, j) passa a ser img180CW(imgHeight - 1 - i, imgWidth - 1 - j)
-  for (uint32 i = 0; i < img->height; i++) {
-    for (uint32 j = 0; j < img->width; j++) {
-      img180CW->image[(img->height) - 1 - i][(img->width) - 1 - j] = img->image[i][j];
-    }
-  }
+  // Cada banda de linhas da imagem rodada é preenchida em paralelo.
+  struct rowBands b = {.src = img, .dst = img180CW};
+  ThreadPoolFor(img180CW->height, img180CW->width, Rotate180CWRows, &b);
   return img180CW;                  // Retorna a imagem rodada 180 graus.                                                     
 }
 
@@ -691,6 +2485,83 @@ int ImageIsValidPixel(const Image img, int u, int v) {
   return 0 <= u && u < (int)img->width && 0 <= v && v < (int)img->height;
 }
 
+/// Pixel access
+
+/// Get the color label (LUT index) of pixel (u, v).
+uint16 ImageGetPixel(const Image img, int u, int v) {
+  assert(img != NULL);
+  assert(ImageIsValidPixel(img, u, v));
+  return RowR(img, v)[u];
+}
+
+/// Set the color label (LUT index) of pixel (u, v).
+void ImageSetPixel(Image img, int u, int v, uint16 label) {
+  assert(img != NULL);
+  assert(ImageIsValidPixel(img, u, v));
+  assert(label < img->num_colors);
+  PixelW(img, u, v, label);
+}
+
+/// Undo journal
+
+/// Start recording the modifications of img, to undo them later.
+void ImageJournalBegin(Image img) {
+  assert(img != NULL);
+  if (img->journal != NULL) return;
+  struct imageJournal* j = malloc(sizeof(struct imageJournal));
+  check(j != NULL, "malloc");
+  JournalStackInit(&j->records);
+  j->pixels = NULL;
+  j->num_pixels = j->max_pixels = 0;
+  j->saved = calloc(img->height, sizeof(uint32));
+  check(j->saved != NULL, "calloc");
+  j->epoch = 1;
+  img->journal = j;
+}
+
+/// Stop recording the modifications of img, and discard the journal.
+void ImageJournalEnd(Image img) {
+  assert(img != NULL);
+  if (img->journal == NULL) return;
+  JournalStackFree(&img->journal->records);
+  free(img->journal->pixels);
+  free(img->journal->saved);
+  free(img->journal);
+  img->journal = NULL;
+}
+
+/// Get a checkpoint of img, to undo the modifications made after it.
+uint32 ImageCheckpoint(Image img) {
+  assert(img != NULL);
+  assert(img->journal != NULL);
+  JournalNewEpoch(img);
+  return JournalStackSize(&img->journal->records);
+}
+
+/// Undo the modifications of img made after the checkpoint.
+void ImageUndo(Image img, uint32 checkpoint) {
+  assert(img != NULL);
+  assert(img->journal != NULL);
+  struct imageJournal* j = img->journal;
+  assert(checkpoint <= JournalStackSize(&j->records));
+
+  // Repor os registos do mais recente para o mais antigo.
+  while (JournalStackSize(&j->records) > checkpoint) {
+    JournalRecord r = JournalStackPop(&j->records);
+    if (r.len == 0) {
+      img->num_colors = r.old;
+      continue;
+    }
+    j->num_pixels -= r.len;
+    memcpy(RowW(img, r.v) + r.u, j->pixels + j->num_pixels,
+           r.len * sizeof(uint16));
+    PIXMEM_ADD(r.len);
+  }
+  // (As linhas alteradas a seguir voltam a ser registadas, para se poder
+  // voltar aqui.)
+  JournalNewEpoch(img);
+}
+
 /// Region Growing
 
 /// The following three *RegionFilling* functions perform region growing
@@ -707,25 +2578,79 @@ int ImageIsValidPixel(const Image img, int u, int v) {
 
 /// Each function carries out a different version of the algorithm.
 
-/// Region growing using the recursive flood-filling algorithm.
-int ImageRegionFillingRecursive(Image img, int u, int v, uint16 label) {
-  assert(img != NULL);
-  assert(ImageIsValidPixel(img, u, v));
-  assert(label < FIXED_LUT_SIZE);
+// Serial region filling
+//
+// The STACK, QUEUE and recursive fills write their pixels in no order of
+// rows, so, instead of going through PixelW (and RowW) for each one, they
+// check the image once, with FillBegin, and then write its rows directly,
+// through img->image, with FillW: it only copies the shared blocks (of a
+// copy), the first time it writes to each.  FillEnd clears the all-WHITE
+// flags of the rows the fill wrote.  (A WHITE region that reaches a
+// flagged row fills all of it, so its first pixel tells whether it was
+// written.)
+// Tiled and journaled images are still written through PixelW, which
+// counts their tiles as used, and records the old labels.
+
+// Prepare img for a serial fill.
+// Returns whether its rows may be written directly.
+static int FillBegin(Image img) {
+  return !img->tiled && img->journal == NULL;
+}
 
-  // Guardar a cor do pixel atual da imagem em original_color.
-  uint16 original_color = img->image[v][u];
-  
-  // Se a cor do pixel atual (original_color) for igual à que pretendemos mudar (label),
-  // não altera a cor (return 0).
-  if (original_color == label) {
-    return 0;
+// PixelW, out of line, so that FillW is small enough to be inlined.
+static CONTAINER_COLD void FillPixelW(Image img, uint32 u, uint32 v,
+                                      uint16 label) {
+  PixelW(img, u, v, label);
+}
+
+// Set pixel (u, v) of img to label, in a serial fill.
+// (Only the filling thread unshares the blocks of img, so their flags
+// need not be read atomically.)
+static inline void FillW(Image img, int direct, uint32 u, uint32 v,
+                         uint16 label) {
+  if (!direct) {
+    FillPixelW(img, u, v, label);
+    return;
   }
-  
-  // Mudar a cor do pixel atual para a cor pretendida (label).
+  uint32 b = v >> img->block_shift;
+  if (img->shared[b]) BlockUnshare(img, b);
   img->image[v][u] = label;
-  PIXMEM++;                        // Incrementar o contador de acessos à memória de pixels.
+}
+
+// Finish a serial fill of the pixels with color orig, which wrote
+// (at most) rows v0..v1 of img.
+static void FillEnd(Image img, int direct, uint16 orig, uint32 v0,
+                    uint32 v1) {
+  if (!direct || orig != WHITE) return;
+  for (uint32 v = v0; v <= v1; v++) {
+    if (RowIsWhite(img, v) && img->image[v][0] != WHITE) {
+      __atomic_store_n(&img->white_rows[v], 0, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+// A recursive fill: what its calls share.
+// (Only u, v and count are kept in each stack frame, which must be small:
+// the recursion is as deep as the region is large.)
+typedef struct {
+  Image img;
+  uint16 original_color;  // the color of the region
+  uint16 label;
+  int direct;  // (see FillBegin)
+  uint32 v0, v1;  // the rows written
+} RecursiveFill;
+
+// The recursive flood-filling algorithm (not timed at each call).
+// (The pixel (u, v) has the original color.)
+static int RegionFillingRecursive(RecursiveFill* fill, int u, int v) {
+  Image img = fill->img;
+
+  // Mudar a cor do pixel atual para a cor pretendida (label).
+  FillW(img, fill->direct, u, v, fill->label);
+  PIXMEM_INC();                        // Incrementar o contador de acessos à memória de pixels.
   int count = 1;                    // Incrementa 1 ao número de pixels alterados (labeled pixels).
+  if ((uint32)v < fill->v0) fill->v0 = v;
+  if ((uint32)v > fill->v1) fill->v1 = v;
   
   // Percurrer os 4 pixels vizinhos (direita, baixo, cima, esquerda).
 
@@ -734,40 +2659,124 @@ int ImageRegionFillingRecursive(Image img, int u, int v, uint16 label) {
   // então muda a cor para a cor pretendida (label) e incrementa 1 ao número de pixels alterados.
 
   // Deslocar para a direita (u+1, v).
-  if (ImageIsValidPixel(img, u + 1, v) && img->image[v][u + 1] == original_color) {
-    PIXMEM++;                    // Incrementar o contador de acessos à memória de pixels.  
-    count += ImageRegionFillingRecursive(img, u + 1, v, label);
+  if (ImageIsValidPixel(img, u + 1, v) && img->image[v][u + 1] == fill->original_color) {
+    PIXMEM_INC();                    // Incrementar o contador de acessos à memória de pixels.  
+    count += RegionFillingRecursive(fill, u + 1, v);
   }
   
   // Deslocar para baixo (u, v+1).
-  if (ImageIsValidPixel(img, u, v + 1) && img->image[v + 1][u] == original_color) {
-    PIXMEM++;                    // Incrementar o contador de acessos à memória de pixels.  
-    count += ImageRegionFillingRecursive(img, u, v + 1, label);
+  if (ImageIsValidPixel(img, u, v + 1) && img->image[v + 1][u] == fill->original_color) {
+    PIXMEM_INC();                    // Incrementar o contador de acessos à memória de pixels.  
+    count += RegionFillingRecursive(fill, u, v + 1);
   }
   
   // Deslocar para cima (u, v-1).
-  if (ImageIsValidPixel(img, u, v - 1) && img->image[v - 1][u] == original_color) {
-    PIXMEM++;                    // Incrementar o contador de acessos à memória de pixels.
-    count += ImageRegionFillingRecursive(img, u, v - 1, label);
+  if (ImageIsValidPixel(img, u, v - 1) && img->image[v - 1][u] == fill->original_color) {
+    PIXMEM_INC();                    // Incrementar o contador de acessos à memória de pixels.
+    count += RegionFillingRecursive(fill, u, v - 1);
   }
 
   // Deslocar para a esquerda (u-1, v).
-  if (ImageIsValidPixel(img, u - 1, v) && img->image[v][u - 1] == original_color) {
-    PIXMEM++;                    // Incrementar o contador de acessos à memória de pixels.
-    count += ImageRegionFillingRecursive(img, u - 1, v, label);
+  if (ImageIsValidPixel(img, u - 1, v) && img->image[v][u - 1] == fill->original_color) {
+    PIXMEM_INC();                    // Incrementar o contador de acessos à memória de pixels.
+    count += RegionFillingRecursive(fill, u - 1, v);
   }
   
   return count;                     // Returnar o número de pixels alterados.
 }
 
+/// Region growing using the recursive flood-filling algorithm.
+int ImageRegionFillingRecursive(Image img, int u, int v, uint16 label) {
+  assert(img != NULL);
+  assert(ImageIsValidPixel(img, u, v));
+  assert(label < FIXED_LUT_SIZE);
+  InstrBegin("fill");
+
+  // Guardar a cor do pixel atual da imagem em original_color.
+  uint16 original_color = img->image[v][u];
+
+  // Se a cor do pixel atual (original_color) for igual à que pretendemos mudar (label),
+  // não altera a cor (return 0).
+  if (original_color == label) {
+    InstrEnd();
+    return 0;
+  }
+
+  RecursiveFill fill = {img, original_color, label, FillBegin(img), v, v};
+  int count = RegionFillingRecursive(&fill, u, v);
+  FillEnd(img, fill.direct, original_color, fill.v0, fill.v1);
+  InstrEnd();
+  return count;
+}
+
+// Does img have more pixels than a PixelIndex can number?
+static inline int FillIsWide(const Image img) {
+  return (uint64_t)img->width * img->height > (uint64_t)UINT32_MAX + 1;
+}
+
+// ImageRegionFillingWithSTACK and ImageRegionFillingWithQUEUE (if queue),
+// with 64-bit pixel indices, for images with more than 2^32 pixels.
+// (The pixel (u, v) does not have the label.)
+static CONTAINER_COLD int FillWide(Image img, int u, int v, uint16 label,
+                                   int queue) {
+  uint16 orig = img->image[v][u];
+  uint64_t w = img->width;
+  int direct = FillBegin(img);
+  uint32 v0 = v, v1 = v;
+  int count = 0;
+  WideIndexStack stack;
+  WideIndexQueue fifo;
+  WideIndexStackInit(&stack);
+  WideIndexQueueInit(&fifo);
+  const int du[4] = {1, 0, 0, -1};  // direita, baixo, cima, esquerda
+  const int dv[4] = {0, 1, -1, 0};
+
+  // Os pixels entram no stack/queue já alterados.
+  FillW(img, direct, u, v, label);
+  PIXMEM_INC();
+  count++;
+  if (queue) {
+    WideIndexQueueEnqueue(&fifo, (uint64_t)v * w + (uint64_t)u);
+  } else {
+    WideIndexStackPush(&stack, (uint64_t)v * w + (uint64_t)u);
+  }
+  while (queue ? !WideIndexQueueIsEmpty(&fifo)
+               : !WideIndexStackIsEmpty(&stack)) {
+    uint64_t i = queue ? WideIndexQueueDequeue(&fifo) : WideIndexStackPop(&stack);
+    int cu = (int)(i % w);
+    int cv = (int)(i / w);
+    for (int k = 0; k < 4; k++) {
+      int nu = cu + du[k];
+      int nv = cv + dv[k];
+      if (!ImageIsValidPixel(img, nu, nv) || img->image[nv][nu] != orig) {
+        continue;
+      }
+      FillW(img, direct, nu, nv, label);
+      PIXMEM_INC();
+      count++;
+      if ((uint32)nv < v0) v0 = nv;
+      if ((uint32)nv > v1) v1 = nv;
+      if (queue) {
+        WideIndexQueueEnqueue(&fifo, (uint64_t)nv * w + (uint64_t)nu);
+      } else {
+        WideIndexStackPush(&stack, (uint64_t)nv * w + (uint64_t)nu);
+      }
+    }
+  }
+
+  WideIndexStackFree(&stack);
+  WideIndexQueueFree(&fifo);
+  FillEnd(img, direct, orig, v0, v1);
+  return count;
+}
+
 /// Region growing using a STACK of pixel coordinates to
 /// implement the flood-filling algorithm.
 int ImageRegionFillingWithSTACK(Image img, int u, int v, uint16 label) {
   assert(img != NULL);
   assert(ImageIsValidPixel(img, u, v));
   assert(label < FIXED_LUT_SIZE);
-
-  PIXMEM = 0;                         // Zera o contador de acessos à memória de pixels.
+  InstrBegin("fill");
 
   // Guardar a cor do pixel atual da imagem em original_color.
   uint16 original_color = img->image[v][u];
@@ -775,64 +2784,83 @@ int ImageRegionFillingWithSTACK(Image img, int u, int v, uint16 label) {
   // Se a cor do pixel atual (original_color) for igual à que pretendemos mudar(label),
   // não altera a cor (return 0).
   if (original_color == label) {
+    InstrEnd();
     return 0;
   }
+
+  // Imagens com mais de 2^32 pixels: índices de 64 bits.
+  if (FillIsWide(img)) {
+    int count = FillWide(img, u, v, label, 0);
+    InstrEnd();
+    return count;
+  }
   
-  // Criar um stack vazio para guardar as coordenadas dos pixels com um tamanho inicial de 100 pixels.
-  Stack* stack = StackCreate(100);
+  // Criar um stack vazio para guardar as coordenadas dos pixels (índices lineares).
+  IndexStack stack;
+  IndexStackInit(&stack);
+  uint32 w = img->width;
   
+  // Escrever as linhas diretamente, se possível, e registar as linhas
+  // alteradas (v0..v1).
+  int direct = FillBegin(img);
+  uint32 v0 = v, v1 = v;
+
   // Contar os pixels alterados.
   int count = 0;
   
   // Adicionar o pixel inicial ao stack (stack push).
-  StackPush(stack, PixelCoordsCreate(u, v));
+  IndexStackPush(&stack, PixelIndexCreate(u, v, w));
   
   // Remover o pixel do topo do stack enquanto não estiver vazio.
-  while (!StackIsEmpty(stack)) {
-    PixelCoords current = StackPop(stack);            // Remove o pixel.
-    int cu = PixelCoordsGetU(current);                // Obtem a coordenada u do pixel a remover (cu = current u (coluna)).
-    int cv = PixelCoordsGetV(current);                // Obtem a coordenada v do pixel a remover (cv = current v (linha)).
+  while (!IndexStackIsEmpty(&stack)) {
+    PixelIndex current = IndexStackPop(&stack);       // Remove o pixel.
+    int cu, cv;                                       // Coordenadas do pixel removido (cu = coluna, cv = linha),
+    PixelIndexGet(current, w, &cu, &cv);              // obtidas com uma só divisão.
     
     // Se o pixel não for valido, ou seja, se não estiver dentro do limite da imagem 
     // ou se o pixel atual não tem a cor do pixel original (original_color),
     // então o pixel é ignorado (continue), ou seja, não é alterado e passa para o próximo pixel do stack.
     if (!ImageIsValidPixel(img, cu, cv) || img->image[cv][cu] != original_color) {
-      PIXMEM++;                        // Incrementar o contador de acessos à memória de pixels.
+      PIXMEM_INC();                        // Incrementar o contador de acessos à memória de pixels.
       continue;
     }
     
     // Mudar a cor do pixel atual para a cor pretendida (label).
-    img->image[cv][cu] = label;
-    PIXMEM++;                        // Incrementar o contador de acessos à memória de pixels.
+    FillW(img, direct, cu, cv, label);
+    PIXMEM_INC();                        // Incrementar o contador de acessos à memória de pixels.
     count++;                                          // Incrementar 1 ao número de pixels alterados (labeld pixels).
+    if ((uint32)cv < v0) v0 = cv;
+    if ((uint32)cv > v1) v1 = cv;
     
     // Percurrer os 4 pixels vizinhos (direita, baixo, cima, esquerda).
     // Se o pixel for valido, adiciona o pixel atual ao topo do stack.
     
     // Deslocar para a direita (u+1, v).
     if (ImageIsValidPixel(img, cu + 1, cv)) {
-      StackPush(stack, PixelCoordsCreate(cu + 1, cv));
+      IndexStackPush(&stack, PixelIndexCreate(cu + 1, cv, w));
     }
     
     // Deslocar para baixo (u, v+1).
     if (ImageIsValidPixel(img, cu, cv + 1)) {
-      StackPush(stack, PixelCoordsCreate(cu, cv + 1));
+      IndexStackPush(&stack, PixelIndexCreate(cu, cv + 1, w));
     }
     
     // Deslocar para cima (u, v-1).
     if (ImageIsValidPixel(img, cu, cv - 1)) {
-      StackPush(stack, PixelCoordsCreate(cu, cv - 1));
+      IndexStackPush(&stack, PixelIndexCreate(cu, cv - 1, w));
     }
 
     // Deslocar para a esquerda (u-1, v).
     if (ImageIsValidPixel(img, cu - 1, cv)) {
-      StackPush(stack, PixelCoordsCreate(cu - 1, cv));
+      IndexStackPush(&stack, PixelIndexCreate(cu - 1, cv, w));
     }
   }
   
   // Destruir o stack.
-  StackDestroy(&stack);
+  IndexStackFree(&stack);
+  FillEnd(img, direct, original_color, v0, v1);
   
+  InstrEnd();
   return count;                // Retornar o número de pixels alterados.
 }
 
@@ -842,8 +2870,7 @@ int ImageRegionFillingWithQUEUE(Image img, int u, int v, uint16 label) {
   assert(img != NULL);
   assert(ImageIsValidPixel(img, u, v));
   assert(label < FIXED_LUT_SIZE);
-
-  PIXMEM = 0;                         // Zera o contador de acessos à memória de pixels.
+  InstrBegin("fill");
 
   // Guardar a cor do pixel atual da imagem em original_color.
   uint16 original_color = img->image[v][u];
@@ -851,28 +2878,42 @@ int ImageRegionFillingWithQUEUE(Image img, int u, int v, uint16 label) {
   // Se a cor do pixel atual (original_color) for igual à que pretendemos mudar (label),
   // não altera a cor (return 0).
   if (original_color == label) {
+    InstrEnd();
     return 0;
   }
-  
-  // Criar uma queue vazia para guardar as coordenadas dos pixels com um tamanho inicial igual ao tamanho da imagem.
-  Queue* queue = QueueCreate(img->width * img->height);
-  if (queue == NULL) {
-    return 0;
+
+  // Imagens com mais de 2^32 pixels: índices de 64 bits.
+  if (FillIsWide(img)) {
+    int count = FillWide(img, u, v, label, 1);
+    InstrEnd();
+    return count;
   }
+  
+  // Criar uma queue vazia para guardar as coordenadas dos pixels (índices lineares).
+  // A queue cresce conforme necessário.
+  IndexQueue queue;
+  IndexQueueInit(&queue);
+  uint32 w = img->width;
+
+  // Escrever as linhas diretamente, se possível, e registar as linhas
+  // alteradas (v0..v1).
+  int direct = FillBegin(img);
+  uint32 v0 = v, v1 = v;
 
   // Adicionar o pixel inicial à fila.
-  PixelCoords start = {u, v};
-  QueueEnqueue(queue, start);
+  IndexQueueEnqueue(&queue, PixelIndexCreate(u, v, w));
 
   // Mudar a cor do pixel atual para a cor pretendida (label).
-  img->image[v][u] = label;
+  FillW(img, direct, u, v, label);
   int count = 1;                                    // Incrementar 1 ao número de pixels alterados (labeld pixels).
 
   // Remover o pixel do início da queue enquanto não estiver vazia.
-  while (!QueueIsEmpty(queue)) {
-    PixelCoords curr = QueueDequeue(queue);         // Remove o pixel.
-    int curr_u = curr.u;                            // Obtem a coordenada u do pixel a remover (curr_u = current u (coluna)).
-    int curr_v = curr.v;                            // Obtem a coordenada v do pixel a remover (curr_v = current v (linha)).
+  while (!IndexQueueIsEmpty(&queue)) {
+    PixelIndex curr = IndexQueueDequeue(&queue);    // Remove o pixel.
+    int curr_u, curr_v;                             // Coordenadas do pixel removido (curr_u = coluna, curr_v = linha),
+    PixelIndexGet(curr, w, &curr_u, &curr_v);       // obtidas com uma só divisão.
+    if ((uint32)curr_v < v0) v0 = curr_v;           // (Todos os pixels alterados passam pela fila.)
+    if ((uint32)curr_v > v1) v1 = curr_v;
 
     // Percurrer os 4 pixels vizinhos (direita, baixo, cima, esquerda).
 
@@ -883,46 +2924,369 @@ int ImageRegionFillingWithQUEUE(Image img, int u, int v, uint16 label) {
 
     // Verificar e adicionar o vizinho da direita (u+1, v).
     if (ImageIsValidPixel(img, curr_u + 1, curr_v) && img->image[curr_v][curr_u + 1] == original_color) {
-      PIXMEM++;                    // Incrementar o contador de acessos à memória de pixels.
-      img->image[curr_v][curr_u + 1] = label;
-      PixelCoords next = {curr_u + 1, curr_v};
-      QueueEnqueue(queue, next);
+      PIXMEM_INC();                    // Incrementar o contador de acessos à memória de pixels.
+      FillW(img, direct, curr_u + 1, curr_v, label);
+      IndexQueueEnqueue(&queue, PixelIndexCreate(curr_u + 1, curr_v, w));
       count++;
     }
       
     // Verificar e adicionar o vizinho de baixo (u, v+1).
     if (ImageIsValidPixel(img, curr_u, curr_v + 1) && img->image[curr_v + 1][curr_u] == original_color) {
-      PIXMEM++;                    // Incrementar o contador de acessos à memória de pixels.
-      img->image[curr_v + 1][curr_u] = label;
-      PixelCoords next = {curr_u, curr_v + 1};
-      QueueEnqueue(queue, next);
+      PIXMEM_INC();                    // Incrementar o contador de acessos à memória de pixels.
+      FillW(img, direct, curr_u, curr_v + 1, label);
+      IndexQueueEnqueue(&queue, PixelIndexCreate(curr_u, curr_v + 1, w));
       count++;
     }
     
     // Verificar e adicionar o vizinho de cima (u, v-1).
     if (ImageIsValidPixel(img, curr_u, curr_v - 1) && img->image[curr_v - 1][curr_u] == original_color) {
-      PIXMEM++;                    // Incrementar o contador de acessos à memória de pixels.
-      img->image[curr_v - 1][curr_u] = label;
-      PixelCoords next = {curr_u, curr_v - 1};
-      QueueEnqueue(queue, next);
+      PIXMEM_INC();                    // Incrementar o contador de acessos à memória de pixels.
+      FillW(img, direct, curr_u, curr_v - 1, label);
+      IndexQueueEnqueue(&queue, PixelIndexCreate(curr_u, curr_v - 1, w));
       count++;
     }
 
     // Verificar e adicionar o vizinho da esquerda (u-1, v).
     if (ImageIsValidPixel(img, curr_u - 1, curr_v) && img->image[curr_v][curr_u - 1] == original_color) {
-      PIXMEM++;                    // Incrementar o contador de acessos à memória de pixels.
-      img->image[curr_v][curr_u - 1] = label;
-      PixelCoords next = {curr_u - 1, curr_v};
-      QueueEnqueue(queue, next);
+      PIXMEM_INC();                    // Incrementar o contador de acessos à memória de pixels.
+      FillW(img, direct, curr_u - 1, curr_v, label);
+      IndexQueueEnqueue(&queue, PixelIndexCreate(curr_u - 1, curr_v, w));
       count++;
     }
   }
   
-  QueueDestroy(&queue);                       // Destruir a queue.
+  IndexQueueFree(&queue);                     // Destruir a queue.
+  FillEnd(img, direct, original_color, v0, v1);
 
+  InstrEnd();
   return count;                             // Retorna o número de pixels alterados.
 }
 
+/// Parallel region filling
+
+// Regions are first filled serially: only when a region turns out to have
+// more than PARALLEL_FILL_MIN_PIXELS pixels, is the rest of it filled by
+// several threads.
+#define PARALLEL_FILL_MIN_PIXELS (1 << 16)
+#define PARALLEL_FILL_STEAL_MAX 32  // maximum spans stolen at once
+#define PARALLEL_FILL_SPINS 64      // failed steal rounds before sleeping
+
+// A span of pixels u0..u1 of row v, the candidate seeds of runs to fill.
+typedef struct {
+  uint32 v, u0, u1;
+} FillSpan;
+
+DEFINE_STACK(SpanStack, FillSpan, STACK_GROW_DOUBLE, 64)
+
+// Work-stealing deque of a filling thread: the owner pushes and pops spans
+// at the top, other threads steal the oldest spans at the bottom.
+struct fillWorker {
+  _Alignas(64) pthread_mutex_t lock;
+  FillSpan* spans;  // spans[bottom .. top-1]
+  uint32 bottom, top, max;
+  uint32 id;
+  struct fillJob* job;
+  uint64_t count;  // pixels filled by this thread
+};
+
+struct fillJob {
+  Image img;
+  uint16 orig, label;
+  uint32 num_workers;
+  struct fillWorker* workers;
+  uint32 pending;  // spans pushed, but not yet processed (atomic)
+  // Idle threads sleep on idle_cond until a span is pushed (or the
+  // fill ends), which increments generation.
+  pthread_mutex_t idle_lock;
+  pthread_cond_t idle_cond;
+  uint32 sleepers;    // threads going to sleep (atomic)
+  uint32 generation;  // (atomic)
+};
+
+// Wake up the idle threads of job.
+static void FillJobWake(struct fillJob* job) {
+  pthread_mutex_lock(&job->idle_lock);
+  __atomic_add_fetch(&job->generation, 1, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&job->idle_cond);
+  pthread_mutex_unlock(&job->idle_lock);
+}
+
+typedef void (*SpanPushFunction)(void* ctx, FillSpan s);
+
+// Change pixel *p from color orig to label, if it still has color orig.
+// If shared, the pixel is claimed with an atomic compare-and-swap, so that
+// each pixel is filled by exactly one of the threads.
+static inline int ClaimPixel(uint16* p, uint16 orig, uint16 label,
+                             int shared) {
+  if (!shared) {
+    if (*p != orig) return 0;
+    *p = label;
+    return 1;
+  }
+  uint16 expected = orig;
+  return __atomic_load_n(p, __ATOMIC_RELAXED) == orig &&
+         __atomic_compare_exchange_n(p, &expected, label, 0, __ATOMIC_RELAXED,
+                                     __ATOMIC_RELAXED);
+}
+
+// Fill the runs of pixels with color orig that touch span s,
+// and push the spans of the rows above and below each run.
+// Returns the number of filled pixels.
+static uint32 FillSpanRuns(Image img, FillSpan s, uint16 orig, uint16 label,
+                           int shared, SpanPushFunction push, void* ctx) {
+  uint32 w = img->width;
+
+  // Uma linha toda WHITE é um único run, preenchido sem ler a linha.
+  // (Só em série: em paralelo, outra thread pode estar a preenchê-la.)
+  if (!shared && orig == WHITE && RowIsWhite(img, s.v)) {
+    uint16* row = RowW(img, s.v);
+    if (img->journal != NULL) JournalRow(img, s.v);
+    for (uint32 u = 0; u < w; u++) row[u] = label;
+    PIXMEM_ADD(w);
+    if (s.v > 0) push(ctx, (FillSpan){s.v - 1, 0, w - 1});
+    if (s.v + 1 < img->height) push(ctx, (FillSpan){s.v + 1, 0, w - 1});
+    return w;
+  }
+
+  uint16* row = RowW(img, s.v);
+  uint32 count = 0;
+
+  uint32 u = s.u0;
+  while (u <= s.u1) {
+    PIXMEM_INC();
+    // Registar a linha antes de a alterar.
+    // (Com journal, o preenchimento é sempre em série: ver abaixo.)
+    if (img->journal != NULL && row[u] == orig) JournalRow(img, s.v);
+    if (!ClaimPixel(&row[u], orig, label, shared)) {
+      u++;
+      continue;
+    }
+    // Estender o run para a esquerda e para a direita.
+    uint32 l = u;
+    uint32 r = u;
+    while (l > 0 && ClaimPixel(&row[l - 1], orig, label, shared)) l--;
+    while (r + 1 < w && ClaimPixel(&row[r + 1], orig, label, shared)) r++;
+    count += r - l + 1;
+    PIXMEM_ADD(r - l);
+
+    // Os pixels das linhas de cima e de baixo, adjacentes ao run,
+    // são candidatos a sementes de novos runs.
+    if (s.v > 0) push(ctx, (FillSpan){s.v - 1, l, r});
+    if (s.v + 1 < img->height) push(ctx, (FillSpan){s.v + 1, l, r});
+
+    // O pixel r+1 não tem a cor orig (ou já foi preenchido).
+    u = r + 2;
+  }
+  return count;
+}
+
+static void SpanStackPushSpan(void* ctx, FillSpan s) {
+  SpanStackPush((SpanStack*)ctx, s);
+}
+
+// Add a span to the top of the deque of wk.  (wk->lock must be held.)
+static void FillWorkerPut(struct fillWorker* wk, FillSpan s) {
+  if (wk->top == wk->max) {
+    if (wk->bottom > 0) {
+      // Reaproveitar o espaço dos spans roubados.
+      memmove(wk->spans, wk->spans + wk->bottom,
+              (wk->top - wk->bottom) * sizeof(FillSpan));
+      wk->top -= wk->bottom;
+      wk->bottom = 0;
+    } else {
+      wk->max = wk->max == 0 ? 256 : 2 * wk->max;
+      wk->spans = realloc(wk->spans, wk->max * sizeof(FillSpan));
+      check(wk->spans != NULL, "realloc");
+    }
+  }
+  wk->spans[wk->top++] = s;
+}
+
+static void FillWorkerPush(void* ctx, FillSpan s) {
+  struct fillWorker* wk = ctx;
+  __atomic_add_fetch(&wk->job->pending, 1, __ATOMIC_ACQ_REL);
+  pthread_mutex_lock(&wk->lock);
+  FillWorkerPut(wk, s);
+  pthread_mutex_unlock(&wk->lock);
+  if (__atomic_load_n(&wk->job->sleepers, __ATOMIC_SEQ_CST) > 0) {
+    FillJobWake(wk->job);
+  }
+}
+
+static int FillWorkerPop(struct fillWorker* wk, FillSpan* s) {
+  int found = 0;
+  pthread_mutex_lock(&wk->lock);
+  if (wk->top > wk->bottom) {
+    *s = wk->spans[--wk->top];
+    found = 1;
+  }
+  if (wk->top == wk->bottom) wk->top = wk->bottom = 0;
+  pthread_mutex_unlock(&wk->lock);
+  return found;
+}
+
+// Steal (up to) half of the spans of victim, the oldest ones.
+static uint32 FillWorkerSteal(struct fillWorker* victim, FillSpan stolen[]) {
+  pthread_mutex_lock(&victim->lock);
+  uint32 n = (victim->top - victim->bottom + 1) / 2;
+  if (n > PARALLEL_FILL_STEAL_MAX) n = PARALLEL_FILL_STEAL_MAX;
+  memcpy(stolen, victim->spans + victim->bottom, n * sizeof(FillSpan));
+  victim->bottom += n;
+  if (victim->top == victim->bottom) victim->top = victim->bottom = 0;
+  pthread_mutex_unlock(&victim->lock);
+  return n;
+}
+
+// Process spans, stealing them if needed, until there are none left.
+// (Each filling thread may also be run after the others, e.g., if the
+// pool is busy: it then steals the spans left in the other deques.)
+static void FillWorkerRun(struct fillWorker* wk) {
+  struct fillJob* job = wk->job;
+  FillSpan stolen[PARALLEL_FILL_STEAL_MAX];
+  FillSpan s;
+  uint32 spins = 0;
+
+  for (;;) {
+    if (FillWorkerPop(wk, &s)) {
+      wk->count += FillSpanRuns(job->img, s, job->orig, job->label, 1,
+                                FillWorkerPush, wk);
+      // Os spans filhos já foram contados: pending só chega a 0 no fim.
+      if (__atomic_sub_fetch(&job->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        FillJobWake(job);
+      }
+      continue;
+    }
+
+    // Deque vazio: roubar spans às outras threads.
+    // Antes de dormir, a thread regista-se em sleepers e tenta de novo:
+    // um span posto depois dessa tentativa acorda-a (ver FillWorkerPush).
+    int sleeping = spins == PARALLEL_FILL_SPINS;
+    uint32 generation = __atomic_load_n(&job->generation, __ATOMIC_ACQUIRE);
+    if (sleeping) __atomic_add_fetch(&job->sleepers, 1, __ATOMIC_SEQ_CST);
+    uint32 n = 0;
+    for (uint32 i = 1; i < job->num_workers && n == 0; i++) {
+      n = FillWorkerSteal(&job->workers[(wk->id + i) % job->num_workers],
+                          stolen);
+    }
+    if (n > 0) {
+      if (sleeping) __atomic_sub_fetch(&job->sleepers, 1, __ATOMIC_SEQ_CST);
+      spins = 0;
+      pthread_mutex_lock(&wk->lock);
+      for (uint32 k = 0; k < n; k++) FillWorkerPut(wk, stolen[k]);
+      pthread_mutex_unlock(&wk->lock);
+      continue;
+    }
+
+    // Nada para roubar: terminar, se não há spans por processar;
+    // senão, esperar um pouco (sched_yield) e, depois, dormir.
+    if (__atomic_load_n(&job->pending, __ATOMIC_ACQUIRE) == 0) {
+      if (sleeping) __atomic_sub_fetch(&job->sleepers, 1, __ATOMIC_SEQ_CST);
+      break;
+    }
+    if (!sleeping) {
+      spins++;
+      sched_yield();
+      continue;
+    }
+    pthread_mutex_lock(&job->idle_lock);
+    while (__atomic_load_n(&job->generation, __ATOMIC_ACQUIRE) == generation &&
+           __atomic_load_n(&job->pending, __ATOMIC_ACQUIRE) != 0) {
+      pthread_cond_wait(&job->idle_cond, &job->idle_lock);
+    }
+    pthread_mutex_unlock(&job->idle_lock);
+    __atomic_sub_fetch(&job->sleepers, 1, __ATOMIC_SEQ_CST);
+    spins = 0;
+  }
+}
+
+// Run the filling threads begin..end-1 (one per pool thread).
+static void FillWorkersRun(void* arg, uint32 begin, uint32 end) {
+  struct fillJob* job = arg;
+  for (uint32 i = begin; i < end; i++) {
+    FillWorkerRun(&job->workers[i]);
+  }
+}
+
+// Fill the rest of a region, from the spans in stack, using num_threads
+// threads of the pool (the calling thread included).
+// Returns the number of filled pixels.
+static uint64_t FillSpansParallel(Image img, uint16 orig, uint16 label,
+                                  uint32 num_threads, SpanStack* stack) {
+  struct fillJob job = {.img = img, .orig = orig, .label = label,
+                        .num_workers = num_threads};
+  pthread_mutex_init(&job.idle_lock, NULL);
+  pthread_cond_init(&job.idle_cond, NULL);
+  job.workers = aligned_alloc(64, num_threads * sizeof(struct fillWorker));
+  check(job.workers != NULL, "aligned_alloc");
+  for (uint32 i = 0; i < num_threads; i++) {
+    struct fillWorker* wk = &job.workers[i];
+    pthread_mutex_init(&wk->lock, NULL);
+    wk->spans = NULL;
+    wk->bottom = wk->top = wk->max = 0;
+    wk->id = i;
+    wk->job = &job;
+    wk->count = 0;
+  }
+
+  // Distribuir os spans pendentes pelas threads, alternadamente.
+  for (uint32 i = 0; !SpanStackIsEmpty(stack); i++) {
+    FillWorkerPut(&job.workers[i % num_threads], SpanStackPop(stack));
+    job.pending++;
+  }
+
+  ThreadPoolFor(num_threads, UINT32_MAX, FillWorkersRun, &job);
+
+  uint64_t count = 0;
+  for (uint32 i = 0; i < num_threads; i++) {
+    count += job.workers[i].count;
+    free(job.workers[i].spans);
+    pthread_mutex_destroy(&job.workers[i].lock);
+  }
+  free(job.workers);
+  pthread_mutex_destroy(&job.idle_lock);
+  pthread_cond_destroy(&job.idle_cond);
+
+  return count;
+}
+
+/// Region growing using several threads, for very large regions.
+int ImageRegionFillingParallel(Image img, int u, int v, uint16 label) {
+  assert(img != NULL);
+  assert(ImageIsValidPixel(img, u, v));
+  assert(label < FIXED_LUT_SIZE);
+  InstrBegin("fill");
+
+  uint16 orig = img->image[v][u];
+  if (orig == label) {
+    InstrEnd();
+    return 0;
+  }
+
+  // Uma imagem com journal é preenchida em série (o journal não é
+  // partilhado entre threads).
+  uint32 num_threads = img->journal != NULL ? 1 : ThreadPoolThreads();
+  uint64_t count = 0;
+
+  // Preencher em série, por spans: regiões pequenas terminam aqui.
+  SpanStack stack;
+  SpanStackInit(&stack);
+  SpanStackPush(&stack, (FillSpan){v, u, u});
+  while (!SpanStackIsEmpty(&stack) &&
+         (num_threads == 1 || count < PARALLEL_FILL_MIN_PIXELS)) {
+    count += FillSpanRuns(img, SpanStackPop(&stack), orig, label, 0,
+                          SpanStackPushSpan, &stack);
+  }
+
+  // Região grande: continuar em paralelo, a partir dos spans pendentes.
+  if (!SpanStackIsEmpty(&stack)) {
+    count += FillSpansParallel(img, orig, label, num_threads, &stack);
+  }
+  SpanStackFree(&stack);
+
+  InstrEnd();
+  return (int)count;
+}
+
 /// Image Segmentation
 
 /// Label each WHITE region with a different color.
@@ -939,39 +3303,20 @@ int ImageSegmentation(Image img, FillingFunction fillFunct) {
 
   int region_count = 0;            // Contador para as regiões encontradas.
   rgb_t current_color = 0x000000;  // Começar com uma cor base (preto).
+  InstrBegin("segment");
 
   // Percorrer todos os pixels da imagem.
   for (uint32 v = 0; v < img->height; v++) {
     for (uint32 u = 0; u < img->width; u++) {
       
       // Se encontrar um pixel do background (WHITE).
-      if (img->image[v][u] == WHITE) {
+      if (RowR(img, v)[u] == WHITE) {
         
         // Gerar uma cor nova para a região.
         current_color = GenerateNextColor(current_color);
         
-        // Usar LUTAllocColor para obter um label para esta cor.
-        // Como é função é static verifica se a cor já existe na LUT.
-        int label = -1;
-        for (uint16 i = 0; i < img->num_colors; i++) {
-          if (img->LUT[i] == current_color) {
-            label = i;
-            break;
-          }
-        }
-        
-        // Se a cor não existir na LUT.
-        if (label == -1) {    
-          // Se a LUT estiver cheia, reutiliza cores já existentes.  
-          if (img->num_colors >= FIXED_LUT_SIZE) {
-            label = (region_count % (img->num_colors - 2)) + 2;
-          // Senão, adicionar a nova cor à LUT.
-          } else {
-            label = img->num_colors;
-            img->LUT[label] = current_color;
-            img->num_colors++;
-          }
-        }
+        // Obter um label para esta cor (existente ou novo).
+        int label = RegionLabel(img, current_color, region_count);
 
         // Preencher a região usando uma função anterior.
         int pixels_filled = fillFunct(img, u, v, label);
@@ -984,5 +3329,813 @@ int ImageSegmentation(Image img, FillingFunction fillFunct) {
     }
   }
   
+  InstrEnd();
   return region_count;                    // Retorna o número de regiões encontradas.
-}
\ No newline at end of file
+}
+
+// A pixel found by ImageSegmentationUpdate, with its original label.
+typedef struct {
+  PixelCoords p;
+  uint16 label;
+} UpdatePixel;
+
+DEFINE_STACK(UpdateStack, UpdatePixel, STACK_GROW_DOUBLE, 256)
+
+// Temporary labels of the components found by ImageSegmentationUpdate:
+// FIXED_LUT_SIZE .. UINT16_MAX - 1 (never used in the LUT).
+#define UPDATE_MAX_COMPONENTS (UINT16_MAX - FIXED_LUT_SIZE)
+
+// A component found by ImageSegmentationUpdate.
+typedef struct {
+  PixelCoords seed;
+  int final;   // its label, or -1 for a new color
+  int merged;  // it joined regions with different labels
+} UpdateComponent;
+
+// Label the components comps[0..n-1] of ImageSegmentationUpdate, marked
+// with temporary labels.  The components without a label get new colors,
+// after *color; *new_regions counts them.
+static void UpdateApply(Image img, const UpdateComponent* comps, uint32 n,
+                        FillingFunction fillFunct, rgb_t* color,
+                        int* new_regions) {
+  for (uint32 i = 0; i < n; i++) {
+    int label = comps[i].final;
+    if (label < 0) {
+      do {
+        *color = GenerateNextColor(*color);
+      } while (LUTFindColor(img, *color) >= 0);
+      label = RegionLabel(img, *color, (*new_regions)++);
+    }
+    fillFunct(img, PixelCoordsGetU(comps[i].seed),
+              PixelCoordsGetV(comps[i].seed), (uint16)label);
+  }
+}
+
+/// Incremental re-segmentation after a localized edit.
+/// Relabel only the regions that intersect the dirty rectangle
+/// (u, v, w, h), splitting or merging them as needed.
+///
+/// Returns the number of regions (re)labeled.
+int ImageSegmentationUpdate(Image img, int u, int v, uint32 w, uint32 h,
+                            FillingFunction fillFunct) {
+  assert(img != NULL);
+  assert(fillFunct != NULL);
+  assert(img->width - 1 <= PIXELCOORDS_MAX && img->height - 1 <= PIXELCOORDS_MAX);
+  InstrBegin("update");
+
+  // Alargar o retângulo 1 pixel em cada direção (limitado à imagem):
+  // um traço no limite do retângulo pode separar pixels que ficam fora dele.
+  int u0 = u > 1 ? u - 1 : 0;
+  int v0 = v > 1 ? v - 1 : 0;
+  int u1 = u + (int)w + 1 < (int)img->width ? u + (int)w + 1 : (int)img->width;
+  int v1 = v + (int)h + 1 < (int)img->height ? v + (int)h + 1 : (int)img->height;
+  uint32 rect_w = (uint32)(u1 - u0);
+
+  // Labels já atribuídos a uma componente nesta atualização, e a última
+  // componente (+1) onde cada label foi encontrado.
+  uint8 claimed[FIXED_LUT_SIZE] = {0};
+  uint32 seen[FIXED_LUT_SIZE] = {0};
+
+  // Componentes encontradas (no máximo UPDATE_MAX_COMPONENTS por lote).
+  uint32 max_comps = 16;
+  uint32 num_comps = 0;    // no lote atual
+  uint32 num_regions = 0;  // no total
+  UpdateComponent* comps = malloc(max_comps * sizeof(UpdateComponent));
+  check(comps != NULL, "malloc");
+  rgb_t color = img->LUT[img->num_colors - 1];
+  int new_regions = 0;
+  // Pixels do retângulo já com o label final (só depois do 1º lote).
+  uint8* done = NULL;
+
+  UpdateStack stack;
+  UpdateStackInit(&stack);
+
+  // Fase 1: marcar cada componente (4-vizinhos) que toca no retângulo
+  // com um label temporário (>= FIXED_LUT_SIZE, nunca usado na LUT), para
+  // distinguir as partes de uma região dividida.  Uma componente junta os
+  // pixels WHITE (novos) com todos os vizinhos não BLACK, e os pixels de
+  // uma região com os vizinhos do mesmo label: as regiões ligadas por
+  // pixels WHITE são juntas, mas regiões vizinhas com labels diferentes
+  // nunca são juntas diretamente.
+  // Na 1ª passagem as sementes são pixels de regiões, na 2ª os pixels
+  // WHITE que sobram (que formam regiões novas).
+  for (int pass = 0; pass < 2; pass++)
+  for (int y = v0; y < v1; y++) {
+    for (int x = u0; x < u1; x++) {
+      uint16 l = img->image[y][x];
+      if (l == BLACK || l >= FIXED_LUT_SIZE) continue;
+      if ((l == WHITE) != (pass == 1)) continue;
+      size_t r = (size_t)(y - v0) * rect_w + (uint32)(x - u0);
+      if (done != NULL && (done[r / 8] >> (r % 8) & 1)) continue;
+
+      if (num_comps == UPDATE_MAX_COMPONENTS) {
+        // Sem labels temporários livres: aplicar já os labels finais deste
+        // lote, e marcar os seus pixels do retângulo, para não serem
+        // sementes outra vez.  Uma componente que juntou regiões recebe
+        // uma cor nova (e devolve o label), para os pixels das outras
+        // regiões não se juntarem a ela nas componentes seguintes.
+        if (done == NULL) {
+          done = calloc(((size_t)rect_w * (uint32)(v1 - v0) + 7) / 8, 1);
+          check(done != NULL, "calloc");
+          for (int yy = v0; yy < v1; yy++) {
+            for (int xx = u0; xx < u1; xx++) {
+              if (img->image[yy][xx] < FIXED_LUT_SIZE) continue;
+              size_t rr = (size_t)(yy - v0) * rect_w + (uint32)(xx - u0);
+              done[rr / 8] |= (uint8)(1 << (rr % 8));
+            }
+          }
+        }
+        for (uint32 i = 0; i < num_comps; i++) {
+          if (comps[i].merged && comps[i].final >= 0) {
+            claimed[comps[i].final] = 0;
+            comps[i].final = -1;
+          }
+        }
+        UpdateApply(img, comps, num_comps, fillFunct, &color, &new_regions);
+        num_comps = 0;
+      }
+      uint16 tmp = (uint16)(FIXED_LUT_SIZE + num_comps);
+      uint32 id = num_regions + 1;
+      int final = -1;
+      int num_labels = 0;
+
+      PixelW(img, x, y, tmp);
+      PIXMEM_INC();
+      if (done != NULL) done[r / 8] |= (uint8)(1 << (r % 8));
+      UpdateStackPush(&stack, (UpdatePixel){PixelCoordsCreate(x, y), l});
+
+      while (!UpdateStackIsEmpty(&stack)) {
+        UpdatePixel p = UpdateStackPop(&stack);
+        // A componente fica com o primeiro dos seus labels ainda livre.
+        if (p.label != WHITE && seen[p.label] != id) {
+          seen[p.label] = id;
+          num_labels++;
+          if (final < 0 && !claimed[p.label]) {
+            final = p.label;
+            claimed[p.label] = 1;
+          }
+        }
+        int cu = PixelCoordsGetU(p.p);
+        int cv = PixelCoordsGetV(p.p);
+        const int du[4] = {1, 0, 0, -1};
+        const int dv[4] = {0, 1, -1, 0};
+        for (int k = 0; k < 4; k++) {
+          int nu = cu + du[k];
+          int nv = cv + dv[k];
+          if (!ImageIsValidPixel(img, nu, nv)) continue;
+          uint16 nl = img->image[nv][nu];
+          PIXMEM_INC();
+          if (nl == BLACK || nl >= FIXED_LUT_SIZE) continue;
+          if (nl != p.label && nl != WHITE && p.label != WHITE) continue;
+          if (done != NULL && u0 <= nu && nu < u1 && v0 <= nv && nv < v1) {
+            size_t rn = (size_t)(nv - v0) * rect_w + (uint32)(nu - u0);
+            if (done[rn / 8] >> (rn % 8) & 1) continue;
+            done[rn / 8] |= (uint8)(1 << (rn % 8));
+          }
+          PixelW(img, nu, nv, tmp);
+          UpdateStackPush(&stack, (UpdatePixel){PixelCoordsCreate(nu, nv), nl});
+        }
+      }
+
+      if (num_comps == max_comps) {
+        max_comps *= 2;
+        comps = realloc(comps, max_comps * sizeof(UpdateComponent));
+        check(comps != NULL, "realloc");
+      }
+      comps[num_comps++] =
+          (UpdateComponent){PixelCoordsCreate(x, y), final, num_labels > 1};
+      num_regions++;
+    }
+  }
+  UpdateStackFree(&stack);
+
+  // Fase 2: aplicar os labels finais. As partes sem label original livre
+  // (regiões divididas ou novas) recebem uma cor nova, ainda não usada.
+  UpdateApply(img, comps, num_comps, fillFunct, &color, &new_regions);
+
+  free(comps);
+  free(done);
+
+  InstrEnd();
+  return (int)num_regions;
+}
+
+// Read the header of a PBM (P4) or PPM (P3) file.
+// Returns the format character ('4' or '3'), or 0 on failure.
+static char ReadStreamHeader(FILE* f, int* w, int* h, int* levels) {
+  char c, fmt;
+  IOCHECK(fscanf(f, "P%c ", &fmt) == 1 && (fmt == '4' || fmt == '3'),
+          "Invalid file format");
+  skipComments(f);
+  IOCHECK(fscanf(f, "%d ", w) == 1 && *w > 0, "Invalid width");
+  skipComments(f);
+  IOCHECK(fscanf(f, "%d", h) == 1 && *h > 0, "Invalid height");
+  *levels = 1;
+  if (fmt == '3') {
+    skipComments(f);
+    IOCHECK(fscanf(f, "%d", levels) == 1 && 0 <= *levels && *levels <= 255,
+            "Invalid depth");
+  }
+  IOCHECK(fscanf(f, "%c", &c) == 1 && isspace(c), "Whitespace expected");
+  return fmt;
+
+failed:
+  return 0;
+}
+
+// Read the next row of a PBM or PPM file as RGB colors.
+// bytes and raw_row are work buffers for PBM rows (see ImageLoadPBM).
+// Returns nonzero on success, 0 on failure.
+static int ReadStreamRow(FILE* f, char fmt, int w, int levels, rgb_t row[],
+                         uint8 bytes[], uint8 raw_row[]) {
+  if (fmt == '4') {
+    int nbytes = (w + 8 - 1) / 8;
+    IOCHECK(fread(bytes, sizeof(uint8), nbytes, f) == (size_t)nbytes,
+            "Reading pixels");
+    unpackBits(nbytes, bytes, raw_row);
+    for (int j = 0; j < w; j++) {
+      row[j] = raw_row[j] ? 0x000000 : 0xffffff;
+    }
+    return 1;
+  }
+  for (int j = 0; j < w; j++) {
+    int r, g, b;
+    IOCHECK(fscanf(f, "%d %d %d", &r, &g, &b) == 3 && 0 <= r &&
+                r <= levels && 0 <= g && g <= levels && 0 <= b && b <= levels,
+            "Invalid pixel color");
+    row[j] = r << 16 | g << 8 | b;
+  }
+  return 1;
+
+failed:
+  return 0;
+}
+
+// Union of the classes of provisional labels a and b of the streaming
+// segmentation, keeping the first pixel (raster index) of the class.
+static uint32 StreamUnion(uint32* parent, uint64_t* first, uint32 a,
+                          uint32 b) {
+  uint32 ra = UFFind(parent, a);
+  uint32 rb = UFFind(parent, b);
+  if (ra == rb) return ra;
+  uint64_t f = first[ra] < first[rb] ? first[ra] : first[rb];
+  uint32 r = UFUnion(parent, ra, rb);
+  first[r] = f;
+  return r;
+}
+
+static int CompareUint64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+// Read n elements of the given size that end at offset *pos of file f,
+// moving *pos back to their start.
+// Returns nonzero on success, 0 on failure.
+static int ReadBack(FILE* f, off_t* pos, void* v, size_t size, size_t n) {
+  *pos -= (off_t)(n * size);
+  IOCHECK(*pos >= 0 && fseeko(f, *pos, SEEK_SET) == 0 &&
+              fread(v, size, n, f) == n,
+          "Reading temporary file failed");
+  return 1;
+
+failed:
+  return 0;
+}
+
+/// Streaming (out-of-core) segmentation.
+/// Segment a PBM/PPM file row by row and write the result as a PPM file,
+/// using O(width + number of regions) memory.
+///
+/// Returns the number of image regions found, or -1 on failure.
+int ImageSegmentationStream(const char* infilename, const char* outfilename) {
+  assert(infilename != NULL);
+  assert(outfilename != NULL);
+
+  // Marca (bit mais alto) dos valores guardados no ficheiro temporário:
+  // nos pixels, cores de pixels que não são do fundo (e não labels);
+  // nas transições, regiões fechadas (e não labels da linha seguinte).
+  const uint32 MARK = 0x80000000u;
+
+  FILE* in = NULL;
+  FILE* tmp = NULL;
+  FILE* out = NULL;
+  rgb_t* row = NULL;
+  uint8* bytes = NULL;
+  uint8* raw_row = NULL;
+  uint32* prev = NULL;
+  uint32* cur = NULL;
+  uint32* parent = NULL;
+  uint32* remap = NULL;
+  uint32* trans = NULL;
+  uint64_t* first = NULL;
+  uint64_t* next_first = NULL;
+  uint64_t* closed = NULL;
+  uint64_t* firsts = NULL;
+  char* text = NULL;
+  int region_count = -1;
+
+  int w, h, levels;
+  char fmt;
+  InstrBegin("segment-stream");
+  errno = 0;
+  IOCHECK((in = fopen(infilename, "rb")) != NULL, "Open failed");
+  if ((fmt = ReadStreamHeader(in, &w, &h, &levels)) == 0) goto failed;
+
+  // Buffers de uma linha: cores lidas, labels da linha anterior e atual.
+  // Em cada fronteira de linha, os labels da linha atual são renumerados
+  // 1..k (k <= (w+1)/2), e uma linha cria no máximo (w+1)/2 labels
+  // novos: as tabelas dos labels (union-find, primeiro pixel de cada
+  // classe, ...) têm tamanho fixo, O(w).  O label 0 não é usado.
+  int nbytes = (w + 8 - 1) / 8;
+  size_t max_labels = (size_t)w + 2;
+  row = malloc(w * sizeof(rgb_t));
+  bytes = malloc(nbytes);
+  raw_row = malloc(nbytes * 8);
+  prev = calloc(max_labels, sizeof(uint32));
+  cur = calloc(max_labels, sizeof(uint32));
+  parent = malloc(max_labels * sizeof(uint32));
+  remap = calloc(max_labels, sizeof(uint32));
+  trans = malloc(max_labels * sizeof(uint32));
+  first = malloc(max_labels * sizeof(uint64_t));
+  next_first = malloc(max_labels * sizeof(uint64_t));
+  closed = malloc(max_labels * sizeof(uint64_t));
+  check(row && bytes && raw_row && prev && cur && parent && remap && trans &&
+            first && next_first && closed,
+        "malloc");
+  uint32 num_prev = 0;  // labels da linha anterior: 1..num_prev
+
+  // Primeiro pixel de cada região fechada.
+  uint32 num_regions = 0;
+  uint32 max_regions = 1024;
+  firsts = malloc(max_regions * sizeof(uint64_t));
+  check(firsts != NULL, "malloc");
+
+  // As regiões são numeradas pela ordem (raster) do seu primeiro pixel,
+  // tal como em ImageSegmentation, e essa ordem só é conhecida no fim:
+  // p.ex., os dentes de um pente só se juntam na última linha. Por isso
+  // as linhas são guardadas num ficheiro temporário, com labels locais
+  // à linha, e a imagem só é escrita numa 2ª passagem.
+  // Registo de cada linha i: a transição da linha i-1 (num_prev labels:
+  // label da linha i, ou MARK | índice de uma região fechada), o primeiro
+  // pixel das regiões fechadas, o número de regiões fechadas e num_prev,
+  // seguidos dos pixels da linha i (label local, ou MARK | cor).
+  // Depois da última linha, vem a transição que fecha as regiões todas.
+  IOCHECK((tmp = tmpfile()) != NULL, "tmpfile");
+
+  // 1ª passagem: etiquetagem com a linha anterior e a atual.
+  for (int i = 0; i <= h; i++) {
+    uint32 num_labels = num_prev;
+    if (i < h) {
+      if (!ReadStreamRow(in, fmt, w, levels, row, bytes, raw_row)) goto failed;
+      for (int j = 0; j < w; j++) {
+        if (row[j] != 0xffffff) {
+          cur[j] = 0;
+          continue;
+        }
+        uint32 left = j > 0 ? cur[j - 1] : 0;
+        uint32 up = prev[j];
+        if (left && up) {
+          cur[j] = left == up ? left : StreamUnion(parent, first, left, up);
+        } else if (left || up) {
+          cur[j] = left ? left : up;
+        } else {
+          // Novo label provisório.
+          num_labels++;
+          parent[num_labels] = num_labels;
+          first[num_labels] = (uint64_t)i * w + j;
+          cur[j] = num_labels;
+        }
+      }
+    }
+
+    // Renumerar as classes da linha atual (1..k)...
+    // (os pixels de uma sequência têm o mesmo label)
+    uint32 k = 0;
+    uint32 last = 0;
+    uint32 last_new = 0;
+    for (int j = 0; i < h && j < w; j++) {
+      if (cur[j] == 0 || cur[j] == last) {
+        cur[j] = cur[j] ? last_new : 0;
+        continue;
+      }
+      last = cur[j];
+      uint32 r = UFFind(parent, last);
+      if (remap[r] == 0) {
+        remap[r] = ++k;
+        next_first[k] = first[r];
+      }
+      cur[j] = last_new = remap[r];
+    }
+    // ... e fechar as classes da linha anterior que não continuam.
+    uint32 num_closed = 0;
+    for (uint32 l = 1; l <= num_prev; l++) {
+      uint32 r = UFFind(parent, l);
+      if (remap[r] == 0) {
+        if (num_regions == max_regions) {
+          check(max_regions < MARK, "Too many regions");
+          max_regions *= 2;
+          firsts = realloc(firsts, max_regions * sizeof(uint64_t));
+          check(firsts != NULL, "realloc");
+        }
+        firsts[num_regions++] = first[r];
+        closed[num_closed] = first[r];
+        remap[r] = MARK | num_closed++;
+      }
+      trans[l] = remap[r];
+    }
+    IOCHECK(fwrite(trans + 1, sizeof(uint32), num_prev, tmp) == num_prev &&
+                fwrite(closed, sizeof(uint64_t), num_closed, tmp) ==
+                    num_closed &&
+                fwrite(&num_closed, sizeof(uint32), 1, tmp) == 1 &&
+                fwrite(&num_prev, sizeof(uint32), 1, tmp) == 1,
+            "Writing temporary file failed");
+    if (i == h) break;
+
+    // Recomeçar a union-find com as classes da linha atual.
+    memset(remap, 0, (num_labels + 1) * sizeof(uint32));
+    for (uint32 l = 1; l <= k; l++) parent[l] = l;
+    uint64_t* t = first;
+    first = next_first;
+    next_first = t;
+    num_prev = k;
+
+    for (int j = 0; j < w; j++) {
+      row[j] = cur[j] ? cur[j] : MARK | row[j];
+    }
+    IOCHECK(fwrite(row, sizeof(uint32), w, tmp) == (size_t)w,
+            "Writing temporary file failed");
+    uint32* p = prev;
+    prev = cur;
+    cur = p;
+  }
+  fclose(in);
+  in = NULL;
+  qsort(firsts, num_regions, sizeof(uint64_t), CompareUint64);
+
+  // 2ª passagem: ler os registos do fim para o início, obtendo a cor
+  // de cada label de cada linha (a do label da linha seguinte, ou a da
+  // região fechada), e escrever cada linha do PPM na sua posição (as
+  // linhas de texto têm tamanho fixo).
+  size_t row_len = (size_t)w * PPM_PIXEL_CHARS + 1;
+  text = malloc(row_len);
+  check(text != NULL, "malloc");
+  IOCHECK((out = fopen(outfilename, "wb")) != NULL, "Open failed");
+  IOCHECK(fprintf(out, "P3\n%d %d\n255\n", w, h) > 0, "Writing header failed");
+  off_t header_len = ftello(out);
+  IOCHECK(fseeko(tmp, 0, SEEK_END) == 0, "Seeking temporary file failed");
+  off_t pos = ftello(tmp);
+  uint32* below = prev;  // cor de cada label da linha seguinte
+  uint32* color = cur;   // cor de cada label da linha atual
+  for (int i = h - 1; i >= 0; i--) {
+    uint32 n[2];  // regiões fechadas, labels da linha
+    if (!ReadBack(tmp, &pos, n, sizeof(uint32), 2)) goto failed;
+    IOCHECK(n[0] <= n[1] && n[1] < max_labels, "Invalid temporary file");
+    if (!ReadBack(tmp, &pos, closed, sizeof(uint64_t), n[0])) goto failed;
+    if (!ReadBack(tmp, &pos, trans + 1, sizeof(uint32), n[1])) goto failed;
+    for (uint32 c = 0; c < n[0]; c++) {
+      // A cor da região de ordem m é GenerateNextColor aplicada m+1 vezes.
+      uint64_t* f = bsearch(&closed[c], firsts, num_regions, sizeof(uint64_t),
+                            CompareUint64);
+      IOCHECK(f != NULL, "Invalid temporary file");
+      closed[c] = (uint64_t)(f - firsts + 1) * 7639 & 0xffffff;
+    }
+    for (uint32 l = 1; l <= n[1]; l++) {
+      color[l] = trans[l] & MARK ? (rgb_t)closed[trans[l] & ~MARK]
+                                 : below[trans[l]];
+    }
+    if (!ReadBack(tmp, &pos, row, sizeof(uint32), w)) goto failed;
+    char* p = text;
+    for (int j = 0; j < w; j++) {
+      rgb_t c = row[j] & MARK ? row[j] & 0xffffff : color[row[j]];
+      *p++ = ' ';
+      *p++ = ' ';
+      p = FormatLevel(p, c >> 16 & 0xff);
+      *p++ = ' ';
+      p = FormatLevel(p, c >> 8 & 0xff);
+      *p++ = ' ';
+      p = FormatLevel(p, c & 0xff);
+    }
+    *p = '\n';
+    IOCHECK(fseeko(out, header_len + (off_t)i * row_len, SEEK_SET) == 0 &&
+                fwrite(text, 1, row_len, out) == row_len,
+            "Writing pixels failed");
+    uint32* t = below;
+    below = color;
+    color = t;
+  }
+  FILE* closing = out;
+  out = NULL;
+  IOCHECK(fclose(closing) == 0, "Closing file failed");
+  region_count = (int)num_regions;
+
+  // Cleanup
+failed:
+  if (in != NULL) fclose(in);
+  if (out != NULL) fclose(out);
+  if (tmp != NULL) fclose(tmp);
+  free(row);
+  free(bytes);
+  free(raw_row);
+  free(prev);
+  free(cur);
+  free(parent);
+  free(remap);
+  free(trans);
+  free(first);
+  free(next_first);
+  free(closed);
+  free(firsts);
+  free(text);
+
+  InstrEnd();
+  return region_count;
+}
+
+/// Connected components of all colors.
+/// Label the 4-connected components of every color label of img.
+///
+/// Returns the number of components found.
+uint32 ImageConnectedComponents(const Image img, uint32* comp) {
+  assert(img != NULL);
+  assert(comp != NULL);
+
+  uint32 w = img->width;
+  uint32 h = img->height;
+
+  // Union-find dos labels provisórios (o label 0 não é usado).
+  uint32 max_labels = 1024;
+  uint32 num_labels = 0;
+  uint32* parent = malloc(max_labels * sizeof(uint32));
+  check(parent != NULL, "malloc");
+
+  // Etiquetagem: cada pixel junta-se aos vizinhos da esquerda e de cima
+  // com a mesma cor (label da LUT).
+  for (uint32 v = 0; v < h; v++) {
+    const uint16* row = RowR(img, v);
+    const uint16* up_row = v > 0 ? RowR(img, v - 1) : NULL;
+    uint32* c = comp + (size_t)v * w;
+    // Uma linha toda WHITE por baixo de outra (já etiquetada com um só
+    // label, por aqui) continua a componente dessa, sem ser lida.
+    if (v > 0 && RowIsWhite(img, v) && RowIsWhite(img, v - 1)) {
+      for (uint32 u = 0; u < w; u++) c[u] = (c - w)[0];
+      continue;
+    }
+    for (uint32 u = 0; u < w; u++) {
+      uint32 left = u > 0 && row[u - 1] == row[u] ? c[u - 1] : 0;
+      uint32 up = up_row != NULL && up_row[u] == row[u] ? (c - w)[u] : 0;
+      if (left && up) {
+        c[u] = left == up ? left : UFUnion(parent, left, up);
+      } else if (left || up) {
+        c[u] = left ? left : up;
+      } else {
+        // Novo label provisório.
+        if (num_labels + 1 == max_labels) {
+          check(max_labels <= UINT32_MAX / 2, "Too many labels");
+          max_labels *= 2;
+          parent = realloc(parent, (size_t)max_labels * sizeof(uint32));
+          check(parent != NULL, "realloc");
+        }
+        num_labels++;
+        parent[num_labels] = num_labels;
+        c[u] = num_labels;
+      }
+    }
+    PIXMEM_ADD(w);
+  }
+
+  // Numerar as componentes (raízes) por ordem do primeiro pixel; como
+  // parent[i] <= i, a tabela é convertida no lugar em label -> componente.
+  uint32 num_comps = 0;
+  for (uint32 l = 1; l <= num_labels; l++) {
+    parent[l] = parent[l] == l ? num_comps++ : parent[parent[l]];
+  }
+  for (size_t i = 0; i < (size_t)w * h; i++) {
+    comp[i] = parent[comp[i]];
+  }
+
+  free(parent);
+
+  return num_comps;
+}
+
+/// Region Adjacency Graph
+
+// Internal structure for storing region adjacency graphs (CSR form):
+// the neighbors of node n are adj[offset[n]] .. adj[offset[n + 1] - 1],
+// with the shared boundary lengths in the parallel array len.
+struct regionGraph {
+  uint32 num_nodes;
+  uint32 num_edges;  // number of undirected edges
+  uint32* offset;    // num_nodes + 1 offsets into adj / len
+  uint16* adj;       // neighbor labels
+  uint32* len;       // shared boundary lengths
+};
+
+// A pair of adjacent region labels, with the number of pixel pairs
+// (of one row) where they meet.
+struct labelPair {
+  uint16 a;
+  uint16 b;
+  uint32 count;
+};
+
+// Pairs of adjacent labels found in the image, deduplicated per row with
+// a small hash table of the pairs of the current row.
+struct labelPairs {
+  struct labelPair* pairs;
+  size_t num;
+  size_t max;
+  uint32* slot_pair;  // index of the pair in pairs (for the current row)
+  uint32* slot_row;   // row (+1) of the pair in the slot (0: empty)
+  uint32 mask;        // number of slots - 1
+  uint32 row;         // current row + 1
+  size_t row_first;   // first pair of the current row
+};
+
+// Add pair (a, b) of the current row to p.
+static void AddLabelPair(struct labelPairs* p, uint16 a, uint16 b) {
+  if (a > b) {
+    uint16 t = a;
+    a = b;
+    b = t;
+  }
+  uint32 key = (uint32)a << 16 | b;
+  uint32 s = (key * 2654435761u) >> 7 & p->mask;
+  while (p->slot_row[s] == p->row) {
+    struct labelPair* q = &p->pairs[p->row_first + p->slot_pair[s]];
+    if (q->a == a && q->b == b) {
+      q->count++;
+      return;
+    }
+    s = (s + 1) & p->mask;
+  }
+  if (p->num == p->max) {
+    check(p->max <= SIZE_MAX / 2 / sizeof(struct labelPair),
+          "Too many pairs");
+    p->max *= 2;
+    p->pairs = realloc(p->pairs, p->max * sizeof(struct labelPair));
+    check(p->pairs != NULL, "realloc");
+  }
+  p->slot_row[s] = p->row;
+  p->slot_pair[s] = (uint32)(p->num - p->row_first);
+  p->pairs[p->num].a = a;
+  p->pairs[p->num].b = b;
+  p->pairs[p->num].count = 1;
+  p->num++;
+}
+
+/// Build the region adjacency graph of a segmented image.
+RegionGraph ImageRegionGraph(const Image img) {
+  assert(img != NULL);
+
+  uint32 n = img->num_colors;
+  uint32 w = img->width;
+  uint32 h = img->height;
+
+  // Percorrer a imagem uma vez, registando cada par de pixels adjacentes
+  // (diretamente ou através de um contorno BLACK de largura 1) de regiões
+  // diferentes. Só se olha para a direita e para baixo: cada par uma vez.
+  // Os pares de labels de cada linha são contados sem repetições (uma
+  // linha tem no máximo 2w pares de pixels): a tabela de dispersão tem
+  // pelo menos 4w posições.
+  struct labelPairs p = {.num = 0, .max = 1024, .mask = 15, .row = 0};
+  while (p.mask + 1 < 4 * (uint64_t)w) p.mask = p.mask << 1 | 1;
+  p.pairs = malloc(p.max * sizeof(struct labelPair));
+  p.slot_pair = malloc((p.mask + 1) * sizeof(uint32));
+  p.slot_row = calloc(p.mask + 1, sizeof(uint32));
+  check(p.pairs != NULL && p.slot_pair != NULL && p.slot_row != NULL,
+        "malloc");
+
+  for (uint32 v = 0; v < h; v++) {
+    const uint16* row = RowR(img, v);
+    p.row = v + 1;
+    p.row_first = p.num;
+    for (uint32 u = 0; u < w; u++) {
+      uint16 a = row[u];
+      if (a == BLACK) continue;
+      // Vizinho da direita.
+      if (u + 1 < w) {
+        uint16 b = row[u + 1];
+        if (b == BLACK && u + 2 < w) b = row[u + 2];
+        if (b != BLACK && b != a) AddLabelPair(&p, a, b);
+      }
+      // Vizinho de baixo.
+      if (v + 1 < h) {
+        uint16 b = img->image[v + 1][u];
+        if (b == BLACK && v + 2 < h) b = img->image[v + 2][u];
+        if (b != BLACK && b != a) AddLabelPair(&p, a, b);
+      }
+    }
+  }
+  free(p.slot_pair);
+  free(p.slot_row);
+  struct labelPair* pairs = p.pairs;
+  size_t num_pairs = p.num;
+
+  // Ordenar os pares (nos dois sentidos) por (a, b), com duas ordenações
+  // por contagem (counting sort) estáveis: primeiro por b, depois por a.
+  size_t num_dir = 2 * (size_t)num_pairs;
+  struct labelPair* byb = malloc((num_dir + 1) * sizeof(struct labelPair));
+  struct labelPair* byab = malloc((num_dir + 1) * sizeof(struct labelPair));
+  size_t* next = malloc((n + 1) * sizeof(size_t));
+  check(byb != NULL && byab != NULL && next != NULL, "malloc");
+
+  memset(next, 0, (n + 1) * sizeof(size_t));
+  for (size_t i = 0; i < num_pairs; i++) {
+    next[pairs[i].a + 1]++;
+    next[pairs[i].b + 1]++;
+  }
+  for (uint32 k = 0; k < n; k++) next[k + 1] += next[k];
+  for (size_t i = 0; i < num_pairs; i++) {
+    struct labelPair q = pairs[i];
+    byb[next[q.b]++] = q;
+    byb[next[q.a]++] = (struct labelPair){.a = q.b, .b = q.a, .count = q.count};
+  }
+  free(pairs);
+
+  // Os dois sentidos dão a mesma contagem por label, seja a ou b.
+  for (uint32 k = n; k > 0; k--) next[k] = next[k - 1];
+  next[0] = 0;
+  for (size_t i = 0; i < num_dir; i++) byab[next[byb[i].a]++] = byb[i];
+  free(byb);
+  free(next);
+
+  // Juntar os repetidos (de linhas diferentes): a soma das contagens de
+  // um par (a, b) é o comprimento da fronteira partilhada.
+  RegionGraph g = malloc(sizeof(struct regionGraph));
+  check(g != NULL, "malloc");
+  g->num_nodes = n;
+  g->offset = malloc((n + 1) * sizeof(uint32));
+  g->adj = malloc((num_dir + 1) * sizeof(uint16));
+  g->len = malloc((num_dir + 1) * sizeof(uint32));
+  check(g->offset != NULL && g->adj != NULL && g->len != NULL, "malloc");
+
+  uint32 m = 0;
+  size_t i = 0;
+  for (uint32 k = 0; k < n; k++) {
+    g->offset[k] = m;
+    while (i < num_dir && byab[i].a == k) {
+      if (m > g->offset[k] && g->adj[m - 1] == byab[i].b) {
+        g->len[m - 1] += byab[i].count;
+      } else {
+        g->adj[m] = byab[i].b;
+        g->len[m] = byab[i].count;
+        m++;
+      }
+      i++;
+    }
+  }
+  g->offset[n] = m;
+  g->num_edges = m / 2;
+  free(byab);
+
+  return g;
+}
+
+/// Destroy the graph pointed to by (*gp).
+void RegionGraphDestroy(RegionGraph* gp) {
+  assert(gp != NULL);
+
+  RegionGraph g = *gp;
+  free(g->offset);
+  free(g->adj);
+  free(g->len);
+  free(g);
+
+  *gp = NULL;
+}
+
+/// Get number of nodes.
+uint32 RegionGraphNumNodes(const RegionGraph g) {
+  assert(g != NULL);
+  return g->num_nodes;
+}
+
+/// Get number of (undirected) edges.
+uint32 RegionGraphNumEdges(const RegionGraph g) {
+  assert(g != NULL);
+  return g->num_edges;
+}
+
+/// Get number of regions adjacent to region label.
+uint32 RegionGraphDegree(const RegionGraph g, uint16 label) {
+  assert(g != NULL);
+  assert(label < g->num_nodes);
+  return g->offset[label + 1] - g->offset[label];
+}
+
+/// Get the labels of the regions adjacent to region label.
+const uint16* RegionGraphNeighbors(const RegionGraph g, uint16 label) {
+  assert(g != NULL);
+  assert(label < g->num_nodes);
+  return g->adj + g->offset[label];
+}
+
+/// Get the shared boundary lengths with each of the adjacent regions.
+const uint32* RegionGraphBoundaryLengths(const RegionGraph g, uint16 label) {
+  assert(g != NULL);
+  assert(label < g->num_nodes);
+  return g->len + g->offset[label];
+}
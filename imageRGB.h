@@ -14,6 +14,7 @@
 #define IMAGERGB_H
 
 #include <inttypes.h>
+#include <stddef.h>
 
 // Types for non-negative integer values
 typedef uint8_t uint8;
@@ -32,10 +33,102 @@ typedef struct image* Image;
 #define WHITE 0  // White pixel label (i.e., LUT index)
 #define BLACK 1  // Black pixel label
 
+/// Concurrency
+///
+/// The library is reentrant: different threads may process distinct
+/// images concurrently, and read (e.g., copy, compare, save) the same image
+/// concurrently, without any locking.  An image must not be read by one
+/// thread while it is modified by another one.
+/// The instrumentation counters (e.g., pixmem) are per thread, so each
+/// thread counts the operations it calls.
+/// Call ImageInit once, before starting other threads.
+
+/// Timing regions
+///
+/// Loading and saving, segmentation and region filling are timed in the
+/// instrumentation timing regions "load", "save", "segment",
+/// "segment-stream", "update" and "fill" (e.g., "segment/fill" for the
+/// region fillings of a segmentation): see InstrRegionsWrite.
+
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Currently, simply set names of counters.
+/// (Instrumentation is calibrated lazily, when first needed.)
 void ImageInit(void);
 
+/// Get the message describing the last I/O error of the calling thread
+/// (e.g., after an ImageLoad* function returned NULL).
+const char* ImageErrMsg(void);
+
+/// Set the number of threads used by the library (the calling thread
+/// included), e.g., 1 to run everything serially.
+/// n == 0 restores the default: the value of the IMAGERGB_THREADS
+/// environment variable, or the number of processors.
+/// Bulk operations (creation, rotations, comparison, PPM saving)
+/// process bands of rows in parallel on large images, with the same results.
+/// (Pixel accesses made by other threads are counted in their own
+/// instrumentation counters: see InstrSnapshot and InstrPrint.)
+void ImageSetThreads(uint32 n);
+
+/// Image memory
+///
+/// The pixels of an image are stored in a single buffer, row after row.
+/// A copy of an image shares its buffer, in blocks of rows, until either
+/// image writes to a block (copy-on-write; see ImageCopy).
+/// The buffers of destroyed images are kept in a pool, by size, and reused
+/// by the next images of the same size (e.g., the copies and rotations of
+/// an image), so that creating and destroying images seldom calls malloc
+/// and free.  The pool is shared by all threads.
+/// Large buffers are mapped directly from the system, so a new WHITE
+/// image (see ImageCreate) takes memory only for the rows that are
+/// written; rows that are still all WHITE are not even read by
+/// ImageSavePBM, ImageIsEqual, ImageRotate180CW, region
+/// filling and ImageConnectedComponents.
+
+/// Default maximum number of bytes kept in the pool
+#define IMAGE_POOL_DEFAULT_LIMIT ((size_t)256 << 20)
+
+/// Set the maximum number of bytes kept in the pool (0 disables it).
+/// Memory beyond the limit is released.
+void ImagePoolSetLimit(size_t bytes);
+
+/// Release all the memory kept in the pool.
+void ImagePoolTrim(void);
+
+/// Start an image arena for the calling thread, e.g., for a job:
+/// the images the thread creates until the matching ImageArenaEnd
+/// belong to the arena.  Arenas may be nested.
+void ImageArenaBegin(void);
+
+/// End the current image arena of the calling thread, destroying all
+/// of its images that were not destroyed yet (at once, into the pool).
+/// Ensures: Those images must no longer be used.
+void ImageArenaEnd(void);
+
+/// Tiled images
+///
+/// Images larger than the memory may be stored in files: while a tile
+/// directory is set, the pixels of each new image of at least 256 KiB are
+/// stored in a temporary file there (removed when the image is destroyed),
+/// in tiles of a block of rows (about 64 KiB).
+/// Only the tiles used last, up to a memory budget shared by all tiled
+/// images, are kept in memory; the others are written back to their files,
+/// and read again when needed.
+/// Bulk operations go through the tiles in order (ImageRotate90CW, by
+/// strips of rows that fit in the budget), so disk I/O is mostly
+/// sequential.  Region filling follows the region, tile by tile.
+/// Tiled images are not shared by their copies (see ImageCopy).
+/// (Writing to a tiled image when the disk is full is fatal.)
+
+/// Set the tile directory of the images created from now on (dir == NULL:
+/// none, the default), and the memory budget of all tiles, in bytes.
+/// On success, returns nonzero.
+/// On failure (e.g., files cannot be created in dir), returns 0
+/// (see ImageErrMsg), and nothing is changed.
+int ImageSetTileStorage(const char* dir, size_t budget);
+
+/// Get the number of bytes of the tiles kept in memory.
+size_t ImageTileResidentBytes(void);
+
 /// Image management functions
 
 /// Create a new RGB image. All pixels with the background WHITE color.
@@ -67,11 +160,17 @@ Image ImageCreatePalete(uint32 width, uint32 height, uint32 edge);
 /// Ensures: (*imgp)==NULL.
 void ImageDestroy(Image* imgp);
 
-/// Create a deep copy of the image pointed to by img.
+/// Create a copy of the image pointed to by img.
 ///   img : address of an Image variable.
 ///
 /// On success, a new copied image is returned.
 /// (The caller is responsible for destroying the returned image!)
+///
+/// The copy shares the pixels of img, so it takes little time and memory,
+/// whatever the size of the image: the blocks of rows that either image
+/// writes later are duplicated then (copy-on-write).
+/// (An image and its copies may be modified by different threads.)
+/// A tiled image is copied tile by tile, instead (see ImageSetTileStorage).
 Image ImageCopy(const Image img);
 
 /// Printing on the console
@@ -87,11 +186,13 @@ void ImageRAWPrint(const Image img);
 /// Only binary PBM files are accepted.
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL (see ImageErrMsg).
 Image ImageLoadPBM(const char* filename);
 
 /// Save image to PBM file.
 /// On success, returns nonzero.
-/// On failure, a partial and invalid file may be left in the system.
+/// On failure, returns 0 (see ImageErrMsg),
+/// and a partial and invalid file may be left in the system.
 int ImageSavePBM(const Image img, const char* filename);
 
 /// PPM file operations --- For RGB images
@@ -100,13 +201,69 @@ int ImageSavePBM(const Image img, const char* filename);
 /// Only ASCII PPM files are accepted.
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL (see ImageErrMsg).
 Image ImageLoadPPM(const char* filename);
 
 /// Save image to PPM file.
 /// On success, returns nonzero.
-/// On failure, a partial and invalid file may be left in the system.
+/// On failure, returns 0 (see ImageErrMsg),
+/// and a partial and invalid file may be left in the system.
 int ImageSavePPM(const Image img, const char* filename);
 
+/// QOI file operations --- For RGB images, compressed
+
+/// QOI ("Quite OK Image") files are losslessly compressed, and much
+/// smaller and faster to save and load than PPM files, namely for images
+/// with large regions of one color (e.g., segmented images).
+/// See https://qoiformat.org
+
+/// Load a QOI file.
+/// The alpha of the pixels is ignored.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL (see ImageErrMsg).
+Image ImageLoadQOI(const char* filename);
+
+/// Save image to QOI file.
+/// On success, returns nonzero.
+/// On failure, returns 0 (see ImageErrMsg),
+/// and a partial and invalid file may be left in the system.
+int ImageSaveQOI(const Image img, const char* filename);
+
+/// Native image files
+///
+/// A native image file stores the pixel labels and the LUT of an image
+/// in binary, as they are in memory, so an image saved and loaded back
+/// is identical, labels included (PPM files only keep the colors).
+/// The pixels may be stored in two formats:
+///   IMAGE_RAW: the rows as in memory, aligned, so that ImageLoad maps
+///     them in place, without copying them (it reads them once, to check
+///     their labels, and writes to the image do not change the file);
+///   IMAGE_RLE: the runs of equal labels of each row, for smaller files,
+///     e.g., for segmented images.
+/// The files are in the byte order of the machine that wrote them.
+
+#define IMAGE_RAW 0  // Pixels as in memory
+#define IMAGE_RLE 1  // Runs of pixels of each row
+
+/// Save image to a native image file, with the pixels in format
+/// (IMAGE_RAW or IMAGE_RLE).
+/// The file is written under a temporary name, in the same directory, and
+/// then renamed to filename: the images loaded from an older file with
+/// that name (even img itself) are not affected.
+/// On success, returns nonzero.
+/// On failure, returns 0 (see ImageErrMsg), and filename is unchanged.
+int ImageSave(const Image img, const char* filename, int format);
+
+/// Load a native image file.
+/// The pixels of IMAGE_RAW files are mapped in place: do not modify the
+/// file in place while the image exists (ImageSave replaces it).
+/// Files whose labels WHITE and BLACK are not those colors are rejected.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL (see ImageErrMsg).
+Image ImageLoad(const char* filename);
+
 /// Information queries
 
 /// These functions do not modify the image and never fail.
@@ -161,6 +318,53 @@ Image ImageRotate180CW(const Image img);
 ///   v : row index
 int ImageIsValidPixel(const Image img, int u, int v);
 
+/// Pixel access
+
+/// Get the color label (LUT index) of pixel (u, v).
+/// Requires: (u, v) must be a valid pixel of img.
+uint16 ImageGetPixel(const Image img, int u, int v);
+
+/// Set the color label (LUT index) of pixel (u, v).
+/// Used, e.g., to draw BLACK contour strokes on a segmented image.
+/// Requires: (u, v) must be a valid pixel of img and
+///           label must be an existing label of img.
+void ImageSetPixel(Image img, int u, int v, uint16 label);
+
+/// Undo journal
+///
+/// To try several seeds or algorithms on an image, and roll back, without
+/// copying it: while img has a journal, the region filling and
+/// segmentation functions and ImageSetPixel record the old labels of the
+/// rows they change (each row once after each checkpoint, whatever the
+/// number of its changed pixels), and the colors they add to the LUT.
+/// The journal grows with the number of changed rows, up to a copy of the
+/// image between two checkpoints, and undoing takes time proportional to
+/// it.
+/// (ImageRegionFillingParallel runs serially on an image with a journal.)
+///
+/// Use as follows:
+///   ImageJournalBegin(img);
+///   uint32 cp = ImageCheckpoint(img);
+///   ImageRegionFillingWithQUEUE(img, u, v, label);
+///   ...
+///   ImageUndo(img, cp);  // img is back as it was at the checkpoint
+///   ImageJournalEnd(img);
+
+/// Start recording the modifications of img (if not yet recording).
+void ImageJournalBegin(Image img);
+
+/// Stop recording the modifications of img, and discard the journal.
+void ImageJournalEnd(Image img);
+
+/// Get a checkpoint: the current position of the journal of img.
+/// Requires: img must have a journal.
+uint32 ImageCheckpoint(Image img);
+
+/// Undo the modifications of img made after the given checkpoint.
+/// Later checkpoints are no longer valid; this one still is.
+/// Requires: img must have a journal, and checkpoint must be valid.
+void ImageUndo(Image img, uint32 checkpoint);
+
 /// Region Growing
 
 /// The following three *RegionFilling* functions perform region growing
@@ -188,6 +392,18 @@ int ImageRegionFillingWithSTACK(Image img, int u, int v, uint16 label);
 /// implement the flood-filling algorithm.
 int ImageRegionFillingWithQUEUE(Image img, int u, int v, uint16 label);
 
+/// Region growing for very large regions, using several threads.
+/// Rows are filled by runs (spans) of pixels; the spans still to be
+/// examined are kept in per-thread work-stealing deques, and each pixel is
+/// claimed with an atomic compare-and-swap of its label.
+/// The region is filled serially until it turns out to be large, so small
+/// regions never pay for the threads.
+/// The threads are those of the library thread pool (see ImageSetThreads).
+///
+/// The filled pixels and the result are the same as with the serial
+/// functions above.
+int ImageRegionFillingParallel(Image img, int u, int v, uint16 label);
+
 /// Type: Pointer to a region filling function:
 typedef int (*FillingFunction)(Image img, int u, int v, uint16 label);
 
@@ -203,4 +419,102 @@ typedef int (*FillingFunction)(Image img, int u, int v, uint16 label);
 /// Returns the number of image regions found.
 int ImageSegmentation(Image img, FillingFunction fillFunct);
 
+/// Incremental re-segmentation after a localized edit.
+/// Relabel only the regions of a segmented image that intersect the
+/// "dirty" rectangle with top-left corner (u, v) and size w x h,
+/// e.g., after BLACK contour strokes were drawn inside it.
+/// - A region split by the edit keeps its label in the first piece found;
+///   the other pieces get new colors (as in ImageSegmentation).
+/// - New WHITE pixels (e.g., an erased stroke) join the regions they
+///   touch, merging them: the merged region keeps the first of their
+///   labels not yet kept by another piece, or gets a new color.
+///   WHITE pixels that touch no region form a new region.
+/// - Regions with different labels that touch directly (with no WHITE
+///   pixel between them) are never merged.
+/// A rectangle that meets more than about 64500 pieces is relabeled in
+/// batches, and then the merged regions get new colors.
+/// Pixels of regions that do not touch the rectangle and existing LUT
+/// entries are left untouched.
+///
+/// The filling function is used to apply the final labels.
+///
+/// Returns the number of regions (re)labeled.
+int ImageSegmentationUpdate(Image img, int u, int v, uint32 w, uint32 h,
+                            FillingFunction fillFunct);
+
+/// Streaming (out-of-core) segmentation, for images larger than memory.
+/// Label each WHITE region of the image stored in file infilename
+/// (a binary PBM or an ASCII PPM file) and save the segmented image to
+/// file outfilename, as a PPM file.
+/// The image is never fully loaded: rows are read one at a time and
+/// labeled (4-neighbors) against the previous row, using a union-find of
+/// provisional labels that is renumbered at each row boundary; regions
+/// with no pixel in the current row are closed at once.
+/// Regions get the same colors as with ImageSegmentation (regions are
+/// numbered by the raster order of their first pixel), but colors are
+/// never reused, as there is no LUT size limit.  As a region's number is
+/// only known when all the regions that start before it are closed
+/// (possibly at the last row), the labeled rows are spooled to a temporary
+/// file and the output is written in a second pass, from the last row up
+/// (so outfilename must be seekable).
+/// Peak memory is O(width + number of regions): 8 bytes per region.
+///
+/// Returns the number of image regions found,
+/// or -1 on failure (see ImageErrMsg).
+int ImageSegmentationStream(const char* infilename, const char* outfilename);
+
+/// Connected components of all colors.
+/// Label the 4-connected components of every color label of img
+/// (not only WHITE), in a single labeling pass with a union-find of
+/// provisional labels, whatever the number of colors.
+///   comp: array of width*height elements (row-major order) that receives
+///         the component ID of each pixel.
+/// Components are numbered 0, 1, ... by the raster order of their first
+/// pixel. The image is not modified, so each component keeps its color
+/// label: it is the label of any of its pixels.
+///
+/// Returns the number of components found.
+uint32 ImageConnectedComponents(const Image img, uint32* comp);
+
+/// Region Adjacency Graph
+
+// Type RegionGraph is a pointer to region adjacency graph objects
+typedef struct regionGraph* RegionGraph;
+
+/// Build the region adjacency graph (RAG) of a segmented image.
+/// Nodes are the color labels (LUT indices) of img, except BLACK.
+/// Two regions are adjacent if they touch directly (4-neighbors) or
+/// across a horizontal or vertical BLACK contour of width 1.
+/// The weight of an edge is the length of the shared boundary,
+/// i.e., the number of such pairs of pixels.
+///
+/// The graph is built in one linear pass over the pixels and stored in
+/// CSR (compressed sparse row) form, with deduplicated edges.
+///
+/// On success, a new graph is returned.
+/// (The caller is responsible for destroying the returned graph!)
+RegionGraph ImageRegionGraph(const Image img);
+
+/// Destroy the graph pointed to by (*gp).
+///
+/// Ensures: (*gp)==NULL.
+void RegionGraphDestroy(RegionGraph* gp);
+
+/// Get number of nodes (equal to the number of colors of the image).
+uint32 RegionGraphNumNodes(const RegionGraph g);
+
+/// Get number of (undirected) edges.
+uint32 RegionGraphNumEdges(const RegionGraph g);
+
+/// Get number of regions adjacent to region label.
+uint32 RegionGraphDegree(const RegionGraph g, uint16 label);
+
+/// Get the labels of the regions adjacent to region label,
+/// in increasing order (an array with RegionGraphDegree elements).
+const uint16* RegionGraphNeighbors(const RegionGraph g, uint16 label);
+
+/// Get the shared boundary lengths with each of the adjacent regions
+/// (an array with RegionGraphDegree elements, parallel to the above).
+const uint32* RegionGraphBoundaryLengths(const RegionGraph g, uint16 label);
+
 #endif
@@ -0,0 +1,503 @@
+// imageRGBBatch - Process image files in batch, with the imageRGB module.
+//
+// Each input file is loaded (as a PBM, PPM, QOI or native image file,
+// by the extension of its name: .pbm, .ppm, .qoi or .img), then the
+// operations are applied to it, in order:
+//   rotate90 rotate180  rotate the image clockwise
+//   segment[:FILL]      segment the image, filling its regions with FILL:
+//                       recursive, stack, queue (default) or parallel
+//   save:FORMAT         save the image, as it is then, to DIR/NAME.EXT,
+//                       NAME being the input file name without directory
+//                       and extension, and FORMAT one of pbm, ppm, qoi
+//                       (EXT: FORMAT), raw or rle (EXT: img); two input
+//                       files with the same NAME are an error
+// e.g., imageRGBBatch -o segment:stack,save:qoi -d out img/*.pbm
+//
+// The files go through a pipeline of threads: readers load them, workers
+// apply the operations and writers save the results, all at the same
+// time, so that the next files are read and the previous ones are written
+// while the current ones are processed.  The queues between the stages
+// hold at most DEPTH images each, which bounds the memory used.
+// (The images to save are copies, that share the pixels: see ImageCopy.)
+//
+// Files that fail are reported, and the others are processed.
+// The exit status is 2 if some file failed.
+//
+// This program is part of a programming project
+// for the course AED, DETI / UA.PT
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+//
+// The AED Team <jmadeira@ua.pt, jmr@ua.pt, ...>
+// 2025
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "ThreadPool.h"
+#include "imageRGB.h"
+
+#define MAX_OPS 32      // maximum number of operations
+#define MAX_THREADS 64  // maximum number of threads of each stage
+
+/// File formats
+
+static int SaveRaw(const Image img, const char* filename) {
+  return ImageSave(img, filename, IMAGE_RAW);
+}
+
+static int SaveRLE(const Image img, const char* filename) {
+  return ImageSave(img, filename, IMAGE_RLE);
+}
+
+typedef struct {
+  const char* name;
+  const char* ext;  // the extension of the file names
+  int bw;           // only for 2-color (BLACK and WHITE) images
+  Image (*load)(const char* filename);
+  int (*save)(const Image img, const char* filename);
+} Format;
+
+// (Files are loaded with the first format with their extension)
+static const Format formats[] = {
+    {"pbm", "pbm", 1, ImageLoadPBM, ImageSavePBM},
+    {"ppm", "ppm", 0, ImageLoadPPM, ImageSavePPM},
+    {"qoi", "qoi", 0, ImageLoadQOI, ImageSaveQOI},
+    {"raw", "img", 0, ImageLoad, SaveRaw},
+    {"rle", "img", 0, ImageLoad, SaveRLE},
+};
+#define NUM_FORMATS (sizeof(formats) / sizeof(formats[0]))
+
+static const Format* FindFormat(const char* name) {
+  for (size_t i = 0; i < NUM_FORMATS; i++)
+    if (strcmp(name, formats[i].name) == 0) return &formats[i];
+  return NULL;
+}
+
+// The format of file filename, by its extension (NULL if unknown).
+static const Format* FileFormat(const char* filename) {
+  const char* dot = strrchr(filename, '.');
+  if (dot == NULL || strchr(dot, '/') != NULL) return NULL;
+  for (size_t i = 0; i < NUM_FORMATS; i++)
+    if (strcmp(dot + 1, formats[i].ext) == 0) return &formats[i];
+  return NULL;
+}
+
+/// Operations
+
+typedef enum { ROTATE90, ROTATE180, SEGMENT, SAVE } OperationKind;
+
+typedef struct {
+  OperationKind kind;
+  FillingFunction fill;  // SEGMENT
+  const Format* format;  // SAVE
+} Operation;
+
+static const struct {
+  const char* name;
+  FillingFunction fill;
+} fillings[] = {
+    {"recursive", ImageRegionFillingRecursive},
+    {"stack", ImageRegionFillingWithSTACK},
+    {"queue", ImageRegionFillingWithQUEUE},
+    {"parallel", ImageRegionFillingParallel},
+};
+#define NUM_FILLINGS (sizeof(fillings) / sizeof(fillings[0]))
+
+// Parse operation s (e.g., "segment:stack", modified) into op.
+// Returns 0 if s is invalid.
+static int ParseOperation(char* s, Operation* op) {
+  char* arg = strchr(s, ':');
+  if (arg != NULL) *arg++ = '\0';
+  if (strcmp(s, "rotate90") == 0 || strcmp(s, "rotate180") == 0) {
+    op->kind = strcmp(s, "rotate90") == 0 ? ROTATE90 : ROTATE180;
+    return arg == NULL;
+  }
+  if (strcmp(s, "segment") == 0) {
+    op->kind = SEGMENT;
+    op->fill = ImageRegionFillingWithQUEUE;
+    if (arg == NULL) return 1;
+    for (size_t i = 0; i < NUM_FILLINGS; i++) {
+      if (strcmp(arg, fillings[i].name) == 0) {
+        op->fill = fillings[i].fill;
+        return 1;
+      }
+    }
+    return 0;
+  }
+  if (strcmp(s, "save") == 0 && arg != NULL) {
+    op->kind = SAVE;
+    op->format = FindFormat(arg);
+    return op->format != NULL;
+  }
+  return 0;
+}
+
+/// The pipeline
+
+// A file, going through the pipeline
+typedef struct job {
+  struct job* next;    // (in a queue)
+  const char* input;   // the name of the file
+  dev_t dev;           // the device and i-node of the file
+  ino_t ino;
+  Image img;           // the image loaded, then processed
+  Image out[MAX_OPS];  // out[i]: the image saved by operation i (or NULL)
+} Job;
+
+// A bounded FIFO queue of jobs, between two stages
+typedef struct {
+  pthread_mutex_t lock;  // protects the fields below
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  Job* head;
+  Job* tail;
+  int count;
+  int depth;      // maximum count
+  int producers;  // threads still putting jobs (when none, the queue ends)
+} Queue;
+
+static void QueueInit(Queue* q, int depth, int producers) {
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->not_empty, NULL);
+  pthread_cond_init(&q->not_full, NULL);
+  q->head = q->tail = NULL;
+  q->count = 0;
+  q->depth = depth;
+  q->producers = producers;
+}
+
+// Put job at the tail of q, waiting while q is full.
+static void QueuePut(Queue* q, Job* job) {
+  pthread_mutex_lock(&q->lock);
+  while (q->count == q->depth) pthread_cond_wait(&q->not_full, &q->lock);
+  job->next = NULL;
+  if (q->tail != NULL) q->tail->next = job;
+  else q->head = job;
+  q->tail = job;
+  q->count++;
+  pthread_cond_signal(&q->not_empty);
+  pthread_mutex_unlock(&q->lock);
+}
+
+// Get the job at the head of q, waiting while q is empty.
+// Returns NULL if q is empty and has no producers left.
+static Job* QueueGet(Queue* q) {
+  pthread_mutex_lock(&q->lock);
+  while (q->count == 0 && q->producers > 0) {
+    pthread_cond_wait(&q->not_empty, &q->lock);
+  }
+  Job* job = q->head;
+  if (job != NULL) {
+    q->head = job->next;
+    if (q->head == NULL) q->tail = NULL;
+    q->count--;
+    pthread_cond_signal(&q->not_full);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return job;
+}
+
+// Called by each producer of q, when it has no more jobs to put.
+static void QueueDone(Queue* q) {
+  pthread_mutex_lock(&q->lock);
+  if (--q->producers == 0) pthread_cond_broadcast(&q->not_empty);
+  pthread_mutex_unlock(&q->lock);
+}
+
+static struct {
+  Operation ops[MAX_OPS];
+  int num_ops;
+  const char* dir;   // the directory of the files saved
+  char** files;      // the input files
+  int num_files;
+  uint32 next_file;  // the next input file to read (atomic)
+  uint32 failed;     // the number of files failed (atomic)
+  int verbose;
+  FILE* out;         // the standard output (that of the library is discarded)
+  Queue loaded;      // read, to be processed
+  Queue processed;   // processed, to be written
+} batch;
+
+// Report that file failed, with message.
+static void Fail(const char* file, const char* message) {
+  error(0, 0, "%s: %s", file, message);
+}
+
+// Readers: load the input files, one at a time.
+static void* Reader(void* unused) {
+  (void)unused;
+  uint32 i;
+  while ((i = __atomic_fetch_add(&batch.next_file, 1, __ATOMIC_RELAXED)) <
+         (uint32)batch.num_files) {
+    const char* input = batch.files[i];
+    const Format* format = FileFormat(input);
+    Image img = NULL;
+    struct stat st;
+    if (format == NULL) {
+      Fail(input, "Unknown file format");
+    } else if ((img = format->load(input)) == NULL) {
+      Fail(input, ImageErrMsg());
+    } else if (stat(input, &st) != 0) {
+      Fail(input, strerror(errno));
+      ImageDestroy(&img);
+    }
+    if (img == NULL) {
+      __atomic_add_fetch(&batch.failed, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+
+    Job* job = calloc(1, sizeof(*job));
+    if (job == NULL) error(2, errno, "calloc");
+    job->input = input;
+    job->dev = st.st_dev;
+    job->ino = st.st_ino;
+    job->img = img;
+    QueuePut(&batch.loaded, job);
+  }
+  QueueDone(&batch.loaded);
+  return NULL;
+}
+
+// Workers: apply the operations to the images loaded.
+static void* Worker(void* unused) {
+  (void)unused;
+  Job* job;
+  while ((job = QueueGet(&batch.loaded)) != NULL) {
+    for (int i = 0; i < batch.num_ops; i++) {
+      const Operation* op = &batch.ops[i];
+      Image img = job->img;
+      switch (op->kind) {
+        case ROTATE90:
+          job->img = ImageRotate90CW(img);
+          ImageDestroy(&img);
+          break;
+        case ROTATE180:
+          job->img = ImageRotate180CW(img);
+          ImageDestroy(&img);
+          break;
+        case SEGMENT:
+          ImageSegmentation(img, op->fill);
+          break;
+        case SAVE:
+          job->out[i] = ImageCopy(img);
+          break;
+      }
+    }
+    ImageDestroy(&job->img);
+    QueuePut(&batch.processed, job);
+  }
+  QueueDone(&batch.processed);
+  return NULL;
+}
+
+// Find in file input its name without directory and extension.
+// Returns its length, and stores its start in *name.
+static int BaseName(const char* input, const char** name) {
+  const char* slash = strrchr(input, '/');
+  *name = slash != NULL ? slash + 1 : input;
+  const char* dot = strrchr(*name, '.');
+  return dot != NULL ? (int)(dot - *name) : (int)strlen(*name);
+}
+
+// Compare the names without directory and extension of two input files
+// (for qsort).
+static int CompareBaseNames(const void* a, const void* b) {
+  const char *name_a, *name_b;
+  int len_a = BaseName(*(char* const*)a, &name_a);
+  int len_b = BaseName(*(char* const*)b, &name_b);
+  int cmp = strncmp(name_a, name_b, (size_t)(len_a < len_b ? len_a : len_b));
+  return cmp != 0 ? cmp : len_a - len_b;
+}
+
+// Write to path the name of the file of format saved from file input.
+// Returns 0 if it is too long.
+static int OutputName(char* path, size_t size, const char* input,
+                      const Format* format) {
+  const char* name;
+  int len = BaseName(input, &name);
+  int n = snprintf(path, size, "%s/%.*s.%s", batch.dir, len, name,
+                   format->ext);
+  return n >= 0 && (size_t)n < size;
+}
+
+// Writers: save the images processed.
+static void* Writer(void* unused) {
+  (void)unused;
+  char path[PATH_MAX];
+  Job* job;
+  while ((job = QueueGet(&batch.processed)) != NULL) {
+    int ok = 1;
+    for (int i = 0; i < batch.num_ops; i++) {
+      if (job->out[i] == NULL) continue;
+      const Format* format = batch.ops[i].format;
+      struct stat st;
+      if (!OutputName(path, sizeof(path), job->input, format)) {
+        Fail(job->input, "Output file name too long");
+        ok = 0;
+      } else if (stat(path, &st) == 0 && st.st_dev == job->dev &&
+                 st.st_ino == job->ino) {
+        Fail(path, "Would overwrite the input file");
+        ok = 0;
+      } else if (format->bw && ImageColors(job->out[i]) != 2) {
+        Fail(path, "Not a BLACK and WHITE image");
+        ok = 0;
+      } else if (!format->save(job->out[i], path)) {
+        Fail(path, ImageErrMsg());
+        ok = 0;
+      } else if (batch.verbose) {
+        fprintf(batch.out, "%s -> %s\n", job->input, path);
+      }
+      ImageDestroy(&job->out[i]);
+    }
+    if (!ok) __atomic_add_fetch(&batch.failed, 1, __ATOMIC_RELAXED);
+    free(job);
+  }
+  return NULL;
+}
+
+static double WallTime(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double)t.tv_sec + 1e-9 * (double)t.tv_nsec;
+}
+
+/// Main
+
+static void Usage(void) {
+  error(1, 0,
+        "Usage: imageRGBBatch -o OPERATIONS [-d DIR] [-j WORKERS]\n"
+        "                     [-r READERS] [-w WRITERS] [-q DEPTH] [-v]"
+        " FILE...\n"
+        "  -o  operations, applied in order to each FILE (.pbm .ppm .qoi"
+        " .img):\n"
+        "      rotate90 rotate180\n"
+        "      segment[:FILL]  FILL: recursive stack queue parallel"
+        " (default: queue)\n"
+        "      save:FORMAT     FORMAT: pbm ppm qoi raw rle (to DIR/NAME.EXT)\n"
+        "  -d  directory of the files saved (default: .)\n"
+        "  -j  worker threads (default: the library threads)\n"
+        "  -r  reader threads (default: 1)\n"
+        "  -w  writer threads (default: 1)\n"
+        "  -q  images waiting in each queue, at most (default: 2 * WORKERS)\n"
+        "  -v  list the files saved");
+}
+
+static int SplitList(char* s, char* items[]) {
+  int n = 0;
+  for (char* p = strtok(s, ","); p != NULL; p = strtok(NULL, ",")) {
+    if (n == MAX_OPS) Usage();
+    items[n++] = p;
+  }
+  return n;
+}
+
+// Start n threads running fn.
+static void StartThreads(pthread_t* threads, int n, void* (*fn)(void*)) {
+  for (int i = 0; i < n; i++) {
+    int err = pthread_create(&threads[i], NULL, fn, NULL);
+    if (err != 0) error(2, err, "pthread_create");
+  }
+}
+
+int main(int argc, char* argv[]) {
+  program_name = argv[0];
+
+  char* op_list = NULL;
+  int workers = 0, readers = 1, writers = 1, depth = 0;
+  batch.dir = ".";
+
+  int opt;
+  while ((opt = getopt(argc, argv, "o:d:j:r:w:q:vh")) != -1) {
+    switch (opt) {
+      case 'o': op_list = optarg; break;
+      case 'd': batch.dir = optarg; break;
+      case 'j': workers = atoi(optarg); break;
+      case 'r': readers = atoi(optarg); break;
+      case 'w': writers = atoi(optarg); break;
+      case 'q': depth = atoi(optarg); break;
+      case 'v': batch.verbose = 1; break;
+      default: Usage();
+    }
+  }
+  if (op_list == NULL || optind == argc || workers < 0 ||
+      workers > MAX_THREADS || readers < 1 || readers > MAX_THREADS ||
+      writers < 1 || writers > MAX_THREADS || depth < 0)
+    Usage();
+  batch.files = argv + optind;
+  batch.num_files = argc - optind;
+
+  char* items[MAX_OPS];
+  batch.num_ops = SplitList(op_list, items);
+  int saves = 0;
+  for (int i = 0; i < batch.num_ops; i++) {
+    if (!ParseOperation(items[i], &batch.ops[i])) Usage();
+    // Each save must be to another file
+    for (int j = 0; j < i && batch.ops[i].kind == SAVE; j++) {
+      if (batch.ops[j].kind == SAVE &&
+          strcmp(batch.ops[j].format->ext, batch.ops[i].format->ext) == 0)
+        error(1, 0, "More than one save to .%s files",
+              batch.ops[i].format->ext);
+    }
+    saves += batch.ops[i].kind == SAVE;
+  }
+  // ... and so must each input file: the files saved are named after the
+  // input files without directory and extension
+  if (saves > 0) {
+    char** sorted = malloc((size_t)batch.num_files * sizeof(char*));
+    if (sorted == NULL) error(2, errno, "malloc");
+    memcpy(sorted, batch.files, (size_t)batch.num_files * sizeof(char*));
+    qsort(sorted, (size_t)batch.num_files, sizeof(char*), CompareBaseNames);
+    for (int i = 1; i < batch.num_files; i++) {
+      if (CompareBaseNames(&sorted[i - 1], &sorted[i]) == 0)
+        error(1, 0, "%s and %s would be saved to the same files",
+              sorted[i - 1], sorted[i]);
+    }
+    free(sorted);
+  }
+
+  ImageInit();
+  if (workers == 0) {
+    workers = (int)ThreadPoolThreads();
+    if (workers > MAX_THREADS) workers = MAX_THREADS;
+  }
+  if (depth == 0) depth = 2 * workers;
+
+  // The library prints (e.g., each region found by ImageSegmentation):
+  // its output is discarded, and ours goes to the original stdout.
+  fflush(stdout);
+  int fd = dup(STDOUT_FILENO);
+  int null = open("/dev/null", O_WRONLY);
+  if (fd < 0 || null < 0 || (batch.out = fdopen(fd, "w")) == NULL)
+    error(2, errno, "/dev/null");
+  dup2(null, STDOUT_FILENO);
+  close(null);
+
+  QueueInit(&batch.loaded, depth, readers);
+  QueueInit(&batch.processed, depth, workers);
+  pthread_t threads[3 * MAX_THREADS];
+  double start = WallTime();
+  StartThreads(threads, readers, Reader);
+  StartThreads(threads + readers, workers, Worker);
+  StartThreads(threads + readers + workers, writers, Writer);
+  for (int i = 0; i < readers + workers + writers; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  double elapsed = WallTime() - start;
+
+  fprintf(batch.out, "%d files, %u failed, %.3f s (%.1f files/s)\n",
+          batch.num_files, batch.failed, elapsed,
+          elapsed > 0 ? batch.num_files / elapsed : 0.0);
+  fclose(batch.out);
+  return batch.failed > 0 ? 2 : 0;
+}
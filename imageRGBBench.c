@@ -0,0 +1,859 @@
+// imageRGBBench - A benchmark of the operations of the imageRGB module.
+//
+// Each operation is run on generated images of the given sizes,
+// some of them worst cases for region filling and segmentation:
+//   blank       all WHITE (one big, easy region)
+//   spiral      a 1-pixel-wide corridor spiraling inwards
+//   maze        a random maze of 1-pixel-wide corridors
+//   serpentine  1-pixel-wide rows, connected at alternate ends
+//   comb        a 1-pixel-wide spine with 1-pixel-wide teeth
+//   noise<d>    random BLACK pixels, with density d% (e.g., noise41)
+// After some warm-up samples, each operation is repeated and timed
+// (wall-clock time) and the statistics of the repetitions are printed.
+// A sample runs a fast operation as many times as it takes a few
+// milliseconds, and its time is the mean time of those runs.
+//
+// With -b, the results are compared with a baseline: a CSV file written
+// by a previous run with -c (e.g., imageRGBBench.csv, see make benchcheck),
+// with the same number of threads.
+// Times are compared in calibrated time units (see InstrGetCTU), so that
+// a baseline may be used on other machines: a minimum time (the least
+// disturbed by other activity) more than tolerance (a fraction; a column
+// of the file, editable for each benchmark) above the baseline is a
+// regression.  Differences below BASELINE_MIN_DIFF per run are noise:
+// the benchmarks too fast for their tolerance to exceed it are gated by
+// it alone, and marked "ok*" (they are counted in the summary).
+// The results, and the pixmem counts of all but the parallel
+// fill (which depend on how its threads interleave), are deterministic,
+// so they must be equal.
+// The exit status is 3 if there are regressions.
+//
+// This program is part of a programming project
+// for the course AED, DETI / UA.PT
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+//
+// The AED Team <jmadeira@ua.pt, jmr@ua.pt, ...>
+// 2025
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "ThreadPool.h"
+#include "imageRGB.h"
+#include "instrumentation.h"
+
+#define MAX_SIZE 16384  // maximum width and height
+#define MAX_LIST 32     // maximum number of sizes, operations, generators
+
+// The recursive filling needs a stack frame per pixel of the region:
+// it is only run on images up to this number of pixels.
+#define RECURSIVE_MAX_PIXELS (1 << 16)
+
+/// Image generators
+
+// A small, fast and reproducible pseudo-random generator (xorshift64*)
+static uint64_t rng_state;
+
+static uint32 Random(void) {
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return (uint32)((rng_state * 0x2545F4914F6CDD1Dull) >> 32);
+}
+
+static Image CreateBlack(uint32 w, uint32 h) {
+  Image img = ImageCreate(w, h);
+  for (uint32 v = 0; v < h; v++)
+    for (uint32 u = 0; u < w; u++) ImageSetPixel(img, u, v, BLACK);
+  return img;
+}
+
+// Carve a corridor from (0, 0), turning right whenever it would reach
+// the border or touch the corridor already carved.
+static Image GenerateSpiral(uint32 w, uint32 h) {
+  Image img = CreateBlack(w, h);
+  const int du[4] = {1, 0, -1, 0};
+  const int dv[4] = {0, 1, 0, -1};
+  int u = 0, v = 0, dir = 0, turns = 0;
+  ImageSetPixel(img, 0, 0, WHITE);
+  while (turns < 2) {
+    int u1 = u + du[dir], v1 = v + dv[dir];
+    int u2 = u1 + du[dir], v2 = v1 + dv[dir];
+    if (ImageIsValidPixel(img, u1, v1) && ImageGetPixel(img, u1, v1) == BLACK &&
+        (!ImageIsValidPixel(img, u2, v2) || ImageGetPixel(img, u2, v2) == BLACK)) {
+      u = u1;
+      v = v1;
+      ImageSetPixel(img, u, v, WHITE);
+      turns = 0;
+    } else {
+      dir = (dir + 1) % 4;
+      turns++;
+    }
+  }
+  return img;
+}
+
+// A binary tree maze: cells at even coordinates, each one connected to
+// the cell to its left or to the one above it (chosen at random).
+static Image GenerateMaze(uint32 w, uint32 h) {
+  Image img = CreateBlack(w, h);
+  for (uint32 v = 0; v < h; v += 2) {
+    for (uint32 u = 0; u < w; u += 2) {
+      ImageSetPixel(img, u, v, WHITE);
+      if (u > 0 && (v == 0 || Random() & 1))
+        ImageSetPixel(img, u - 1, v, WHITE);
+      else if (v > 0)
+        ImageSetPixel(img, u, v - 1, WHITE);
+    }
+  }
+  return img;
+}
+
+static Image GenerateSerpentine(uint32 w, uint32 h) {
+  Image img = ImageCreate(w, h);
+  for (uint32 v = 1; v < h; v += 2) {
+    uint32 gap = (v / 2) % 2 == 0 ? w - 1 : 0;
+    for (uint32 u = 0; u < w; u++)
+      if (u != gap) ImageSetPixel(img, u, v, BLACK);
+  }
+  return img;
+}
+
+static Image GenerateComb(uint32 w, uint32 h) {
+  Image img = ImageCreate(w, h);
+  for (uint32 v = 1; v < h; v++)
+    for (uint32 u = 1; u < w; u += 2) ImageSetPixel(img, u, v, BLACK);
+  return img;
+}
+
+static Image GenerateNoise(uint32 w, uint32 h, uint32 density) {
+  Image img = ImageCreate(w, h);
+  for (uint32 v = 0; v < h; v++)
+    for (uint32 u = 0; u < w; u++)
+      if (Random() % 100 < density) ImageSetPixel(img, u, v, BLACK);
+  return img;
+}
+
+static const char* const generators[] = {
+    "blank", "spiral", "maze", "serpentine", "comb",
+    "noise10", "noise41", "noise60"};
+#define NUM_GENERATORS (sizeof(generators) / sizeof(generators[0]))
+
+static int IsGenerator(const char* name) {
+  int d;
+  char c;
+  if (sscanf(name, "noise%d%c", &d, &c) == 1) return 0 <= d && d <= 100;
+  for (size_t i = 0; i < NUM_GENERATORS; i++)
+    if (strcmp(name, generators[i]) == 0) return 1;
+  return 0;
+}
+
+// Generate image name, of w x h pixels.
+// (*u, *v) is set to the first pixel of its largest WHITE region: the seed
+// for region filling (in all but the noise images, the only region, with
+// the worst shape).
+// Returns NULL if there is none.
+static Image Generate(const char* name, uint32 w, uint32 h, int* u, int* v) {
+  Image img;
+  int density;
+  rng_state = 0x9E3779B97F4A7C15ull ^ ((uint64_t)w << 32 | h);
+  if (strcmp(name, "blank") == 0) img = ImageCreate(w, h);
+  else if (strcmp(name, "spiral") == 0) img = GenerateSpiral(w, h);
+  else if (strcmp(name, "maze") == 0) img = GenerateMaze(w, h);
+  else if (strcmp(name, "serpentine") == 0) img = GenerateSerpentine(w, h);
+  else if (strcmp(name, "comb") == 0) img = GenerateComb(w, h);
+  else if (sscanf(name, "noise%d", &density) == 1)
+    img = GenerateNoise(w, h, (uint32)density);
+  else return NULL;
+
+  // Contar os pixels das componentes WHITE, e escolher a maior
+  // (a primeira, em caso de empate).
+  uint32* comp = malloc((size_t)w * h * sizeof(uint32));
+  if (comp == NULL) error(2, errno, "malloc");
+  uint32 num_comps = ImageConnectedComponents(img, comp);
+  uint32* count = calloc(num_comps, sizeof(uint32));
+  if (count == NULL) error(2, errno, "calloc");
+  uint32 best = 0;
+  for (size_t i = 0; i < (size_t)w * h; i++) {
+    if (ImageGetPixel(img, i % w, i / w) != WHITE) continue;
+    if (++count[comp[i]] > count[best]) best = comp[i];
+  }
+  int found = count[best] > 0;
+  for (size_t i = 0; found; i++) {
+    if (comp[i] == best) {
+      *u = (int)(i % w);
+      *v = (int)(i / w);
+      break;
+    }
+  }
+  free(count);
+  free(comp);
+  if (!found) ImageDestroy(&img);
+  return img;
+}
+
+/// Operations
+
+typedef struct {
+  Image src;   // the generated image
+  int u, v;    // its seed pixel
+  Image work;  // the image operated on, or produced
+  long result; // e.g., the number of pixels filled
+  char pbm[256], ppm[256], out[256], img[256], qoi[256];  // temporary files
+} Bench;
+
+// Each operation has (optional) untimed steps: setup, once for each
+// image; prepare and cleanup, before and after each (timed) run.
+typedef struct {
+  const char* name;
+  void (*setup)(Bench* b);
+  void (*prepare)(Bench* b);
+  void (*run)(Bench* b);
+  void (*cleanup)(Bench* b);
+} Operation;
+
+static void SaveFail(const char* filename) {
+  error(2, 0, "%s: %s", filename, ImageErrMsg());
+}
+
+static void SetupPBM(Bench* b) {
+  if (!ImageSavePBM(b->src, b->pbm)) SaveFail(b->pbm);
+}
+
+static void SetupPPM(Bench* b) {
+  if (!ImageSavePPM(b->src, b->ppm)) SaveFail(b->ppm);
+}
+
+static void SetupQOI(Bench* b) {
+  if (!ImageSaveQOI(b->src, b->qoi)) SaveFail(b->qoi);
+}
+
+static void SetupRaw(Bench* b) {
+  if (!ImageSave(b->src, b->img, IMAGE_RAW)) SaveFail(b->img);
+}
+
+static void SetupRLE(Bench* b) {
+  if (!ImageSave(b->src, b->img, IMAGE_RLE)) SaveFail(b->img);
+}
+
+static void PrepareCopy(Bench* b) { b->work = ImageCopy(b->src); }
+
+static void DestroyWork(Bench* b) {
+  if (b->work != NULL) ImageDestroy(&b->work);
+}
+
+static void RunSavePBM(Bench* b) { b->result = ImageSavePBM(b->src, b->out); }
+static void RunSavePPM(Bench* b) { b->result = ImageSavePPM(b->src, b->out); }
+
+static void RunSaveQOI(Bench* b) { b->result = ImageSaveQOI(b->src, b->out); }
+
+static void RunSaveRaw(Bench* b) {
+  b->result = ImageSave(b->src, b->out, IMAGE_RAW);
+}
+
+static void RunSaveRLE(Bench* b) {
+  b->result = ImageSave(b->src, b->out, IMAGE_RLE);
+}
+
+static void RunLoadPBM(Bench* b) {
+  b->work = ImageLoadPBM(b->pbm);
+  b->result = b->work != NULL;
+}
+
+static void RunLoadPPM(Bench* b) {
+  b->work = ImageLoadPPM(b->ppm);
+  b->result = b->work != NULL;
+}
+
+static void RunLoadQOI(Bench* b) {
+  b->work = ImageLoadQOI(b->qoi);
+  b->result = b->work != NULL;
+}
+
+static void RunLoad(Bench* b) {
+  b->work = ImageLoad(b->img);
+  b->result = b->work != NULL;
+}
+
+static void RunCopy(Bench* b) {
+  b->work = ImageCopy(b->src);
+  b->result = 1;
+}
+
+static void RunRotate90(Bench* b) {
+  b->work = ImageRotate90CW(b->src);
+  b->result = 1;
+}
+
+static void RunRotate180(Bench* b) {
+  b->work = ImageRotate180CW(b->src);
+  b->result = 1;
+}
+
+static void RunEqual(Bench* b) { b->result = ImageIsEqual(b->src, b->work); }
+
+static void RunFillRecursive(Bench* b) {
+  b->result = ImageRegionFillingRecursive(b->work, b->u, b->v, BLACK);
+}
+
+static void RunFillStack(Bench* b) {
+  b->result = ImageRegionFillingWithSTACK(b->work, b->u, b->v, BLACK);
+}
+
+static void RunFillQueue(Bench* b) {
+  b->result = ImageRegionFillingWithQUEUE(b->work, b->u, b->v, BLACK);
+}
+
+static void RunFillParallel(Bench* b) {
+  b->result = ImageRegionFillingParallel(b->work, b->u, b->v, BLACK);
+}
+
+// Are the pixmem counts of op the same in every run?
+// (Those of the parallel fill depend on how its threads interleave.)
+static int ExactPixmem(const Operation* op);
+
+static void RunSegment(Bench* b) {
+  b->result = ImageSegmentation(b->work, ImageRegionFillingWithQUEUE);
+}
+
+static void RunSegmentStream(Bench* b) {
+  b->result = ImageSegmentationStream(b->pbm, b->out);
+}
+
+static const Operation operations[] = {
+    {"savepbm", NULL, NULL, RunSavePBM, NULL},
+    {"loadpbm", SetupPBM, NULL, RunLoadPBM, DestroyWork},
+    {"saveppm", NULL, NULL, RunSavePPM, NULL},
+    {"loadppm", SetupPPM, NULL, RunLoadPPM, DestroyWork},
+    {"saveqoi", NULL, NULL, RunSaveQOI, NULL},
+    {"loadqoi", SetupQOI, NULL, RunLoadQOI, DestroyWork},
+    {"saveraw", NULL, NULL, RunSaveRaw, NULL},
+    {"loadraw", SetupRaw, NULL, RunLoad, DestroyWork},
+    {"saverle", NULL, NULL, RunSaveRLE, NULL},
+    {"loadrle", SetupRLE, NULL, RunLoad, DestroyWork},
+    {"copy", NULL, NULL, RunCopy, DestroyWork},
+    {"rotate90", NULL, NULL, RunRotate90, DestroyWork},
+    {"rotate180", NULL, NULL, RunRotate180, DestroyWork},
+    {"equal", NULL, PrepareCopy, RunEqual, DestroyWork},
+    {"fill-recursive", NULL, PrepareCopy, RunFillRecursive, DestroyWork},
+    {"fill-stack", NULL, PrepareCopy, RunFillStack, DestroyWork},
+    {"fill-queue", NULL, PrepareCopy, RunFillQueue, DestroyWork},
+    {"fill-parallel", NULL, PrepareCopy, RunFillParallel, DestroyWork},
+    {"segment", NULL, PrepareCopy, RunSegment, DestroyWork},
+    {"segment-stream", SetupPBM, NULL, RunSegmentStream, NULL},
+};
+#define NUM_OPERATIONS (sizeof(operations) / sizeof(operations[0]))
+
+static int ExactPixmem(const Operation* op) {
+  return op->run != RunFillParallel;
+}
+
+static const Operation* FindOperation(const char* name) {
+  for (size_t i = 0; i < NUM_OPERATIONS; i++)
+    if (strcmp(name, operations[i].name) == 0) return &operations[i];
+  return NULL;
+}
+
+/// Measurement
+
+static double WallTime(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double)t.tv_sec + 1e-9 * (double)t.tv_nsec;
+}
+
+// Some operations print (e.g., each region found by ImageSegmentation):
+// their output is discarded while they run.
+static int saved_stdout = -1;
+
+static void Silence(void) {
+  fflush(stdout);
+  saved_stdout = dup(STDOUT_FILENO);
+  int null = open("/dev/null", O_WRONLY);
+  if (saved_stdout < 0 || null < 0) error(2, errno, "/dev/null");
+  dup2(null, STDOUT_FILENO);
+  close(null);
+}
+
+static void Unsilence(void) {
+  fflush(stdout);
+  dup2(saved_stdout, STDOUT_FILENO);
+  close(saved_stdout);
+}
+
+static int CompareDoubles(const void* a, const void* b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of the sorted times t[0..n-1]
+static double Percentile(const double t[], int n, double p) {
+  int rank = (int)(p * n + 0.999999);
+  return t[rank < 1 ? 0 : rank - 1];
+}
+
+typedef struct {
+  double min, mean, p50, p99, max;  // (of the samples: time per run)
+  double ctu;  // the CTU when measured
+  unsigned long pixmem;  // pixel memory accesses (of a run)
+  long result;
+} Stats;
+
+// Each timed sample runs an operation as many times as needed to take
+// at least this time (in seconds), so that the time of a fast operation
+// is not lost in the resolution of the clock and the noise of the system.
+#define SAMPLE_MIN_TIME 2e-3
+#define SAMPLE_MAX_RUNS 4096
+
+// Run op once on b->src, and count its pixmem in counts.
+// Returns its time, in seconds.
+static double RunOnce(const Operation* op, Bench* b,
+                      unsigned long counts[]) {
+  b->work = NULL;
+  if (op->prepare != NULL) op->prepare(b);
+  Silence();
+  InstrReset();
+  double t = WallTime();
+  op->run(b);
+  t = WallTime() - t;
+  InstrSnapshot(counts);
+  Unsilence();
+  if (op->cleanup != NULL) op->cleanup(b);
+  return t;
+}
+
+// Run op on b->src (warmup + reps samples, of the same number of runs),
+// and collect the statistics of the last reps samples (of the mean time
+// of their runs).
+static void Measure(const Operation* op, Bench* b, int warmup, int reps,
+                    Stats* st) {
+  double* times = malloc(reps * sizeof(double));
+  if (times == NULL) error(2, errno, "malloc");
+  unsigned long counts[INSTR_MAX_COUNTERS];
+
+  if (op->setup != NULL) op->setup(b);
+  // (The first run, untimed, gives the number of runs of each sample.)
+  double first = RunOnce(op, b, counts);
+  int runs = first * SAMPLE_MAX_RUNS < SAMPLE_MIN_TIME
+                 ? SAMPLE_MAX_RUNS
+                 : (int)(SAMPLE_MIN_TIME / first) + 1;
+  for (int i = -warmup; i < reps; i++) {
+    double t = 0.0;
+    for (int k = 0; k < runs; k++) t += RunOnce(op, b, counts);
+    if (i >= 0) times[i] = t / runs;
+  }
+
+  qsort(times, reps, sizeof(double), CompareDoubles);
+  double sum = 0.0;
+  for (int i = 0; i < reps; i++) sum += times[i];
+  st->min = times[0];
+  st->mean = sum / reps;
+  st->p50 = Percentile(times, reps, 0.50);
+  st->p99 = Percentile(times, reps, 0.99);
+  st->max = times[reps - 1];
+  st->ctu = InstrGetCTU();
+  st->pixmem = counts[0];
+  st->result = b->result;
+  free(times);
+}
+
+// Order Stats by their minimum time, in CTUs
+static int CompareStats(const void* a, const void* b) {
+  const Stats* p = a;
+  const Stats* q = b;
+  double x = p->min / p->ctu, y = q->min / q->ctu;
+  return (x > y) - (x < y);
+}
+
+/// Baselines
+
+// Differences below this time per run (in seconds) are noise, and ignored
+// (the samples take at least SAMPLE_MIN_TIME, so this is about the noise
+// of a sample of a few milliseconds, per run); the benchmarks faster than
+// BASELINE_MIN_DIFF / tolerance are thus gated more loosely than their
+// tolerance, and marked "ok*".
+#define BASELINE_MIN_DIFF 1e-6
+
+// Exit status when there are regressions
+#define EXIT_REGRESSION 3
+
+typedef struct {
+  char op[32], image[32];
+  uint32 w, h;
+  uint32 threads;  // (0: any)
+  double caltime;
+  unsigned long pixmem;
+  long result;
+  double tolerance;
+} BaselineEntry;
+
+static BaselineEntry* baseline = NULL;
+static int baseline_size = 0;
+
+// Columns of the CSV files, as written with -c
+// (caltime is the minimum time, in calibrated time units)
+enum {
+  COL_OPERATION, COL_IMAGE, COL_WIDTH, COL_HEIGHT, COL_THREADS, COL_REPS,
+  COL_MIN, COL_MEAN, COL_P50, COL_P99, COL_MAX, COL_CALTIME, COL_PIXMEM,
+  COL_RESULT, COL_TOLERANCE
+};
+static const char* const columns[] = {
+    "operation", "image", "width", "height", "threads", "reps", "min",
+    "mean", "p50", "p99", "max", "caltime", "pixmem", "result", "tolerance"};
+#define NUM_COLUMNS (int)(sizeof(columns) / sizeof(columns[0]))
+
+static void PrintCSVHeader(void) {
+  for (int i = 0; i < NUM_COLUMNS; i++)
+    printf("%s%c", columns[i], i < NUM_COLUMNS - 1 ? ',' : '\n');
+}
+
+// Read the baseline file (CSV, with a header line; '#' starts a comment).
+static void ReadBaseline(const char* filename, double default_tolerance) {
+  FILE* f = fopen(filename, "r");
+  if (f == NULL) error(2, errno, "%s", filename);
+
+  char line[1024];
+  int index[NUM_COLUMNS];  // field number of each column (or -1)
+  int header = 0, line_num = 0;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    line_num++;
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '#' || line[0] == '\0') continue;
+
+    char* fields[NUM_COLUMNS + 8];
+    int n = 0;
+    for (char* p = strtok(line, ","); p != NULL && n < NUM_COLUMNS + 8;
+         p = strtok(NULL, ","))
+      fields[n++] = p;
+
+    if (!header) {
+      for (int c = 0; c < NUM_COLUMNS; c++) {
+        index[c] = -1;
+        for (int i = 0; i < n; i++)
+          if (strcmp(fields[i], columns[c]) == 0) index[c] = i;
+      }
+      // (the threads and tolerance columns are optional)
+      for (int c = 0; c < NUM_COLUMNS; c++)
+        if (index[c] < 0 && c != COL_THREADS && c != COL_TOLERANCE)
+          error(2, 0, "%s: no %s column", filename, columns[c]);
+      header = 1;
+      continue;
+    }
+
+    for (int c = 0; c < NUM_COLUMNS; c++)
+      if (index[c] >= n) error(2, 0, "%s:%d: missing fields", filename, line_num);
+    baseline = realloc(baseline, (baseline_size + 1) * sizeof(BaselineEntry));
+    if (baseline == NULL) error(2, errno, "realloc");
+    BaselineEntry* e = &baseline[baseline_size++];
+    snprintf(e->op, sizeof(e->op), "%s", fields[index[COL_OPERATION]]);
+    snprintf(e->image, sizeof(e->image), "%s", fields[index[COL_IMAGE]]);
+    e->w = (uint32)strtoul(fields[index[COL_WIDTH]], NULL, 10);
+    e->h = (uint32)strtoul(fields[index[COL_HEIGHT]], NULL, 10);
+    e->threads = index[COL_THREADS] >= 0
+                     ? (uint32)strtoul(fields[index[COL_THREADS]], NULL, 10)
+                     : 0;
+    e->caltime = strtod(fields[index[COL_CALTIME]], NULL);
+    e->pixmem = strtoul(fields[index[COL_PIXMEM]], NULL, 10);
+    e->result = strtol(fields[index[COL_RESULT]], NULL, 10);
+    e->tolerance = index[COL_TOLERANCE] >= 0
+                       ? strtod(fields[index[COL_TOLERANCE]], NULL)
+                       : default_tolerance;
+  }
+  fclose(f);
+  if (!header) error(2, 0, "%s: empty", filename);
+}
+
+static const BaselineEntry* FindBaseline(const char* op, const char* image,
+                                         uint32 w, uint32 h, uint32 threads) {
+  for (int i = 0; i < baseline_size; i++)
+    if (strcmp(baseline[i].op, op) == 0 &&
+        strcmp(baseline[i].image, image) == 0 && baseline[i].w == w &&
+        baseline[i].h == h &&
+        (baseline[i].threads == 0 || baseline[i].threads == threads))
+      return &baseline[i];
+  return NULL;
+}
+
+// Number of rows gated more loosely than their tolerance (see
+// BASELINE_MIN_DIFF)
+static int loose_rows = 0;
+
+// Compare a measurement with the baseline and print the outcome.
+// Returns 1 if it is a regression.
+static int CompareBaseline(const Operation* op, const char* image, uint32 w,
+                           uint32 h, const Stats* st) {
+  const BaselineEntry* e =
+      FindBaseline(op->name, image, w, h, ThreadPoolThreads());
+  double caltime = st->min / st->ctu;
+  char size[32];
+  snprintf(size, sizeof(size), "%ux%u", w, h);
+  printf("%-15s %-10s %11s %11.5g", op->name, image, size, caltime);
+  if (e == NULL) {
+    printf(" %11s %8s  new\n", "-", "-");
+    return 0;
+  }
+
+  double change = e->caltime > 0.0 ? caltime / e->caltime - 1.0 : 0.0;
+  printf(" %11.5g %+7.1f%%", e->caltime, 100.0 * change);
+  const char* status = "ok";
+  int regression = 1;
+#ifndef NINSTR  // (pixmem is not counted with -DNINSTR)
+  if (ExactPixmem(op) && st->pixmem != e->pixmem) {
+    status = "PIXMEM";
+    printf("  %s %lu (was %lu)\n", status, st->pixmem, e->pixmem);
+    return 1;
+  }
+#endif
+  if (st->result != e->result) {
+    status = "RESULT";
+    printf("  %s %ld (was %ld)\n", status, st->result, e->result);
+    return 1;
+  }
+  if (change > e->tolerance &&
+      (caltime - e->caltime) * st->ctu > BASELINE_MIN_DIFF) {
+    status = "SLOWER";
+  } else {
+    regression = 0;
+    if (e->caltime * e->tolerance * st->ctu < BASELINE_MIN_DIFF) {
+      status = "ok*";
+      loose_rows++;
+    }
+  }
+  printf("  %s\n", status);
+  return regression;
+}
+
+/// Main program
+
+static void Usage(void) {
+  error(1, 0,
+        "Usage: imageRGBBench [-s SIZES] [-g GENERATORS] [-o OPERATIONS]\n"
+        "                     [-w WARMUP] [-r REPS] [-t THREADS] [-c]\n"
+        "                     [-b BASELINE] [-T TOLERANCE]\n"
+        "  -s  image sizes, N or WxH, up to %d (default: 256,1024)\n"
+        "  -g  image generators (default: all):\n"
+        "      blank spiral maze serpentine comb noise<d> (d%% BLACK)\n"
+        "  -o  operations (default: all):\n"
+        "      savepbm loadpbm saveppm loadppm saveqoi loadqoi\n"
+        "      saveraw loadraw saverle loadrle copy rotate90 rotate180\n"
+        "      equal fill-recursive fill-stack fill-queue fill-parallel\n"
+        "      segment segment-stream\n"
+        "      (fill-recursive only runs on images up to %d pixels)\n"
+        "  -w  warm-up samples (default: 1)\n"
+        "  -r  timed samples (default: 7)\n"
+        "  -n  rounds of the whole suite (default: 3)\n"
+        "  -t  threads (default: IMAGERGB_THREADS or the processors)\n"
+        "  -c  CSV output (e.g., to write a baseline)\n"
+        "  -b  compare with the baseline file (exit status %d on regressions)\n"
+        "  -T  tolerance, when the baseline has none (default: 0.25)\n"
+        "Lists are separated by commas.",
+        MAX_SIZE, RECURSIVE_MAX_PIXELS, EXIT_REGRESSION);
+}
+
+// Split the comma-separated list s (modified) into items.
+// Returns the number of items.
+static int SplitList(char* s, char* items[]) {
+  int n = 0;
+  for (char* p = strtok(s, ","); p != NULL; p = strtok(NULL, ",")) {
+    if (n == MAX_LIST) Usage();
+    items[n++] = p;
+  }
+  return n;
+}
+
+static int ParseSize(const char* s, uint32* w, uint32* h) {
+  int x, y, n;
+  if (sscanf(s, "%dx%d%n", &x, &y, &n) != 2) {
+    if (sscanf(s, "%d%n", &x, &n) != 1) return 0;
+    y = x;
+  }
+  if (s[n] != '\0') return 0;
+  if (x < 1 || x > MAX_SIZE || y < 1 || y > MAX_SIZE) return 0;
+  *w = (uint32)x;
+  *h = (uint32)y;
+  return 1;
+}
+
+int main(int argc, char* argv[]) {
+  program_name = argv[0];
+
+  char default_sizes[] = "256,1024";
+  char* size_list = default_sizes;
+  char* gen_list = NULL;
+  char* op_list = NULL;
+  char* baseline_file = NULL;
+  int warmup = 1, reps = 7, rounds = 3, threads = 0, csv = 0;
+  double tolerance = 0.25;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s:g:o:w:r:n:t:cb:T:h")) != -1) {
+    switch (opt) {
+      case 's': size_list = optarg; break;
+      case 'g': gen_list = optarg; break;
+      case 'o': op_list = optarg; break;
+      case 'w': warmup = atoi(optarg); break;
+      case 'r': reps = atoi(optarg); break;
+      case 'n': rounds = atoi(optarg); break;
+      case 't': threads = atoi(optarg); break;
+      case 'c': csv = 1; break;
+      case 'b': baseline_file = optarg; break;
+      case 'T': tolerance = atof(optarg); break;
+      default: Usage();
+    }
+  }
+  if (optind != argc || warmup < 0 || reps < 1 || rounds < 1 || threads < 0 ||
+      tolerance < 0.0 || (csv && baseline_file != NULL))
+    Usage();
+  if (baseline_file != NULL) ReadBaseline(baseline_file, tolerance);
+
+  char* items[MAX_LIST];
+  uint32 widths[MAX_LIST], heights[MAX_LIST];
+  int num_sizes = SplitList(size_list, items);
+  for (int i = 0; i < num_sizes; i++)
+    if (!ParseSize(items[i], &widths[i], &heights[i])) Usage();
+
+  const char* gens[MAX_LIST];
+  int num_gens = 0;
+  if (gen_list == NULL) {
+    for (size_t i = 0; i < NUM_GENERATORS; i++) gens[num_gens++] = generators[i];
+  } else {
+    num_gens = SplitList(gen_list, items);
+    for (int i = 0; i < num_gens; i++) {
+      if (!IsGenerator(items[i])) Usage();
+      gens[i] = items[i];
+    }
+  }
+
+  const Operation* ops[MAX_LIST];
+  int num_ops = 0;
+  if (op_list == NULL) {
+    for (size_t i = 0; i < NUM_OPERATIONS; i++) ops[num_ops++] = &operations[i];
+  } else {
+    num_ops = SplitList(op_list, items);
+    for (int i = 0; i < num_ops; i++)
+      if ((ops[i] = FindOperation(items[i])) == NULL) Usage();
+  }
+
+  ImageInit();
+  ImageSetThreads((uint32)threads);
+
+  Bench b;
+  const char* dir = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+  snprintf(b.pbm, sizeof(b.pbm), "%s/imageRGBBench-%d.pbm", dir, (int)getpid());
+  snprintf(b.ppm, sizeof(b.ppm), "%s/imageRGBBench-%d.ppm", dir, (int)getpid());
+  snprintf(b.img, sizeof(b.img), "%s/imageRGBBench-%d.img", dir, (int)getpid());
+  snprintf(b.qoi, sizeof(b.qoi), "%s/imageRGBBench-%d.qoi", dir, (int)getpid());
+  snprintf(b.out, sizeof(b.out), "%s/imageRGBBench-%d-out", dir, (int)getpid());
+
+  double ctu = InstrGetCTU();
+  if (csv) {
+    PrintCSVHeader();
+  } else if (baseline_file != NULL) {
+    printf("# threads: %u  warm-up: %d  reps: %d  rounds: %d  CTU: %.6f s  "
+           "baseline: %s\n",
+           (unsigned)ThreadPoolThreads(), warmup, reps, rounds, ctu,
+           baseline_file);
+    printf("#%-14s %-10s %11s %11s %11s %8s  %s\n", "operation", "image",
+           "size", "caltime", "baseline", "change", "status");
+  } else {
+    printf("# threads: %u  warm-up: %d  reps: %d  rounds: %d  CTU: %.6f s\n",
+           (unsigned)ThreadPoolThreads(), warmup, reps, rounds, ctu);
+    printf("#%-14s %-10s %11s %11s %11s %11s %11s %11s %11s %13s %10s\n",
+           "operation", "image", "size", "min", "mean", "p50", "p99", "max",
+           "caltime", "pixmem", "result");
+  }
+
+  // The whole suite is run in rounds, so that the measurements of each
+  // benchmark are spread in time (the load of a shared machine changes
+  // over seconds, so each round calibrates the CTU again, unless it is
+  // cached).  A baseline records the slowest round, and is compared with
+  // the fastest one: a regression must show in every round (on a noisy
+  // machine, whose rounds differ by up to 1.5x, that takes a slowdown of
+  // about 2x for most benchmarks, with their default tolerance).  Other
+  // outputs use the round with the median minimum time.
+  int num_rows = num_sizes * num_gens * num_ops;
+  Stats* results = malloc((size_t)num_rows * rounds * sizeof(Stats));
+  char* measured = calloc((size_t)num_rows, 1);
+  if (results == NULL || measured == NULL) error(2, errno, "malloc");
+  for (int r = 0; r < rounds; r++) {
+    if (r > 0 && getenv("INSTR_CTU_CACHE") == NULL) InstrCalibrate();
+    int row = 0;
+    for (int s = 0; s < num_sizes; s++) {
+      uint32 w = widths[s], h = heights[s];
+      for (int g = 0; g < num_gens; g++) {
+        b.src = Generate(gens[g], w, h, &b.u, &b.v);
+        if (b.src == NULL) {  // (no WHITE pixels)
+          row += num_ops;
+          continue;
+        }
+        for (int o = 0; o < num_ops; o++, row++) {
+          if (ops[o]->run == RunFillRecursive &&
+              (uint64_t)w * h > RECURSIVE_MAX_PIXELS)
+            continue;
+          Measure(ops[o], &b, warmup, reps, &results[(size_t)row * rounds + r]);
+          measured[row] = 1;
+        }
+        ImageDestroy(&b.src);
+      }
+    }
+  }
+
+  int regressions = 0;
+  int row = 0;
+  for (int s = 0; s < num_sizes; s++) {
+    uint32 w = widths[s], h = heights[s];
+    for (int g = 0; g < num_gens; g++) {
+      for (int o = 0; o < num_ops; o++, row++) {
+        if (!measured[row]) continue;
+        Stats* round = &results[(size_t)row * rounds];
+        qsort(round, rounds, sizeof(Stats), CompareStats);
+        Stats st = round[csv ? rounds - 1 : baseline_file != NULL ? 0 : rounds / 2];
+        if (csv) {
+          printf("%s,%s,%u,%u,%u,%d,%.9f,%.9f,%.9f,%.9f,%.9f,%.6g,%lu,%ld,%g\n",
+                 ops[o]->name, gens[g], w, h, (unsigned)ThreadPoolThreads(),
+                 reps, st.min, st.mean, st.p50, st.p99, st.max, st.min / st.ctu,
+                 st.pixmem, st.result, tolerance);
+        } else if (baseline_file != NULL) {
+          regressions += CompareBaseline(ops[o], gens[g], w, h, &st);
+        } else {
+          char size[32];
+          snprintf(size, sizeof(size), "%ux%u", w, h);
+          printf("%-15s %-10s %11s %11.6f %11.6f %11.6f %11.6f %11.6f %11.6f "
+                 "%13lu %10ld\n",
+                 ops[o]->name, gens[g], size, st.min, st.mean, st.p50, st.p99,
+                 st.max, st.min / st.ctu, st.pixmem, st.result);
+        }
+        fflush(stdout);
+      }
+    }
+  }
+  free(results);
+  free(measured);
+
+  remove(b.pbm);
+  remove(b.ppm);
+  remove(b.img);
+  remove(b.qoi);
+  remove(b.out);
+
+  if (baseline_file != NULL) {
+    printf("# %d regression(s)", regressions);
+    if (loose_rows > 0)
+      printf(", %d row(s) ok* (too fast for their tolerance: gated by a "
+             "difference of %g s per run)",
+             loose_rows, BASELINE_MIN_DIFF);
+    printf("\n");
+    if (regressions > 0) return EXIT_REGRESSION;
+  }
+  free(baseline);
+  return 0;
+}
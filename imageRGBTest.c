@@ -11,6 +11,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -34,7 +35,7 @@ void test_RegionFilling_performance() {
 
     //Teste 1: ImageRegionFillingRecursive
     printf("\n1) ImageRegionFillingRecursive\n");
-    PIXMEM = 0;  // Zera o contador de acessos à memória de pixels.
+    InstrSet(0, 0);  // Zera o contador de acessos à memória de pixels.
     Image img1 = ImageCreate(size, size);
     int pixels1 = ImageRegionFillingRecursive(img1, 0, 0, BLACK);
     printf("Pixels preenchidos: %d\n", pixels1);
@@ -43,7 +44,7 @@ void test_RegionFilling_performance() {
 
     // Teste 2: ImageRegionFillingWithSTACK
     printf("\n2) ImageRegionFillingWithSTACK\n");
-    PIXMEM = 0;  // Zera o contador de acessos à memória de pixels.
+    InstrSet(0, 0);  // Zera o contador de acessos à memória de pixels.
     Image img2 = ImageCreate(size, size);
     int pixels2 = ImageRegionFillingWithSTACK(img2, 0, 0, BLACK);
     printf("Pixels preenchidos: %d\n", pixels2);
@@ -52,7 +53,7 @@ void test_RegionFilling_performance() {
 
     // Teste 3: ImageRegionFillingWithQUEUE
     printf("\n3) ImageRegionFillingWithQUEUE\n");
-    PIXMEM = 0;  // Zera o contador de acessos à memória de pixels.
+    InstrSet(0, 0);  // Zera o contador de acessos à memória de pixels.
     Image img3 = ImageCreate(size, size);
     int pixels3 = ImageRegionFillingWithQUEUE(img3, 0, 0, BLACK);
     printf("Pixels preenchidos: %d\n", pixels3);
@@ -93,6 +94,23 @@ void test_RegionFilling_performance() {
   printf("\n=== FIM DOS TESTES DE DESEMPENHO ===\n");
 }
 
+// Passos da thread auxiliar do teste 35), alternados com os da principal.
+static pthread_barrier_t instr_barrier;
+static unsigned long instr_counts[INSTR_MAX_COUNTERS];
+
+static void* test_Instr_thread(void* unused) {
+  (void)unused;
+  InstrReset();
+  INSTR_ADD(0, 100);
+  pthread_barrier_wait(&instr_barrier);  // (a principal faz InstrReset)
+  pthread_barrier_wait(&instr_barrier);
+  InstrSet(0, 0);  // Zera o contador de acessos à memória de pixels.
+  pthread_barrier_wait(&instr_barrier);  // (a principal conta 10)
+  pthread_barrier_wait(&instr_barrier);
+  InstrSnapshot(instr_counts);
+  return NULL;
+}
+
 int main(int argc, char* argv[]) {
   program_name = argv[0];
   if (argc != 1) {
@@ -213,6 +231,382 @@ int main(int argc, char* argv[]) {
   ImageRAWPrint(image_11);
   ImageSavePPM(image_11, "feep_segment.ppm");
 
+  printf("\n16) ImageSegmentationUpdate\n");
+  Image image_12 = ImageCreateChess(80, 80, 20, 0x000000);
+  ImageSegmentation(image_12, ImageRegionFillingWithQUEUE);
+  // Traço BLACK vertical que divide o quadrado WHITE (20..39, 0..19) em dois
+  for (int v = 0; v < 20; v++) {
+    ImageSetPixel(image_12, 30, v, BLACK);
+  }
+  int regions_update =
+      ImageSegmentationUpdate(image_12, 30, 0, 1, 20, ImageRegionFillingWithQUEUE);
+  printf("Regioes reetiquetadas: %d (esperado: 2)\n", regions_update);
+
+  // Apagar um pixel do traço BLACK que divide uma imagem volta a juntar
+  // as duas regiões numa só, com o label da primeira
+  Image image_merge = ImageCreate(9, 5);
+  for (int v = 0; v < 5; v++) {
+    ImageSetPixel(image_merge, 4, v, BLACK);
+  }
+  ImageSegmentation(image_merge, ImageRegionFillingWithQUEUE);
+  ImageSetPixel(image_merge, 4, 2, WHITE);
+  regions_update = ImageSegmentationUpdate(image_merge, 4, 2, 1, 1,
+                                           ImageRegionFillingWithQUEUE);
+  printf("Regioes reetiquetadas: %d (esperado: 1) Labels: %d %d\n",
+         regions_update, ImageGetPixel(image_merge, 0, 0),
+         ImageGetPixel(image_merge, 8, 0));
+  ImageDestroy(&image_merge);
+  // Mais componentes do que os labels temporários (pixels WHITE isolados)
+  Image image_dots = ImageCreateChess(600, 600, 1, 0x000000);
+  regions_update = ImageSegmentationUpdate(image_dots, 0, 0, 600, 600,
+                                           ImageRegionFillingWithQUEUE);
+  printf("Regioes reetiquetadas: %d (esperado: 180000)\n", regions_update);
+  ImageDestroy(&image_dots);
+
+  printf("\n17) ImageSegmentationStream\n");
+  // Segmentar diretamente do ficheiro, sem carregar a imagem
+  int regions_stream = ImageSegmentationStream("img/feep.pbm", "feep_stream.ppm");
+  printf("Regioes encontradas: %d\n", regions_stream);
+
+  printf("\n18) ImageRegionGraph\n");
+  // Grafo de adjacência das regiões da imagem segmentada em 16)
+  RegionGraph graph = ImageRegionGraph(image_12);
+  printf("Nos: %u Arestas: %u\n", RegionGraphNumNodes(graph),
+         RegionGraphNumEdges(graph));
+  for (uint16 l = 2; l < RegionGraphNumNodes(graph); l++) {
+    const uint16* adj = RegionGraphNeighbors(graph, l);
+    const uint32* len = RegionGraphBoundaryLengths(graph, l);
+    for (uint32 k = 0; k < RegionGraphDegree(graph, l); k++) {
+      printf("%u - %u (fronteira %u)\n", l, adj[k], len[k]);
+    }
+  }
+  RegionGraphDestroy(&graph);
+
+  printf("\n19) ImageConnectedComponents\n");
+  // Componentes de todas as cores, numa só passagem
+  Image image_13 = ImageCreateChess(80, 80, 20, 0xff0000);
+  uint32* comp = malloc(80 * 80 * sizeof(uint32));
+  uint32 num_comps = ImageConnectedComponents(image_13, comp);
+  printf("Componentes encontradas: %u (esperado: 16)\n", num_comps);
+  free(comp);
+  ImageDestroy(&image_13);
+
+  printf("\n20) ImageRegionFillingParallel\n");
+  // Região grande em serpentina (preenchida em paralelo),
+  // comparada com o preenchimento com QUEUE
+  Image image_14 = ImageCreate(600, 600);
+  for (int u = 3; u < 600; u += 4) {
+    for (int v = 0; v < 600 - 1; v++) {
+      ImageSetPixel(image_14, u, (u / 4) % 2 == 0 ? v : v + 1, BLACK);
+    }
+  }
+  Image image_15 = ImageCopy(image_14);
+  int pixels_par = ImageRegionFillingParallel(image_14, 0, 600 - 1, BLACK);
+  int pixels_seq = ImageRegionFillingWithQUEUE(image_15, 0, 600 - 1, BLACK);
+  printf("Pixels preenchidos: %d (QUEUE: %d)\n", pixels_par, pixels_seq);
+  printf("Imagens iguais: %d\n", ImageIsEqual(image_14, image_15));
+  ImageDestroy(&image_14);
+  ImageDestroy(&image_15);
+
+  printf("\n21) ImageSetThreads\n");
+  // Rotação de uma imagem grande em série e com 4 threads: resultados iguais
+  Image image_16 = ImageCreatePalete(400, 300, 10);
+  ImageSetThreads(1);
+  Image image_17 = ImageRotate90CW(image_16);
+  ImageSetThreads(4);
+  Image image_18 = ImageRotate90CW(image_16);
+  ImageSetThreads(0);
+  printf("Imagens iguais: %d\n", ImageIsEqual(image_17, image_18));
+  ImageDestroy(&image_16);
+  ImageDestroy(&image_17);
+  ImageDestroy(&image_18);
+
+  printf("\n22) ImageErrMsg\n");
+  // Erros de I/O não terminam o programa: a função falha e descreve o erro
+  Image missing = ImageLoadPBM("img/nao_existe.pbm");
+  printf("ImageLoadPBM: %s (%s)\n", missing == NULL ? "NULL" : "imagem",
+         ImageErrMsg());
+
+  printf("\n23) InstrRegister + InstrSnapshot\n");
+  // Contador registado dinamicamente; contagens agregadas de todas as threads
+  int regions_counter = InstrRegister("regions");
+  InstrReset();
+  Image image_19 = ImageCreateChess(300, 200, 100, 0x000000);
+  INSTR_ADD(regions_counter,
+            ImageSegmentation(image_19, ImageRegionFillingParallel));
+  unsigned long counts[INSTR_MAX_COUNTERS];
+  InstrSnapshot(counts);
+  printf("%s: %lu %s: %lu\n", InstrName[regions_counter],
+         counts[regions_counter], InstrName[0], counts[0]);
+  ImageDestroy(&image_19);
+
+  printf("\n24) InstrBegin + InstrRegionGet\n");
+  // Regiões de tempo aninhadas: segmentação e cada preenchimento
+  InstrRegionsReset();
+  Image image_20 = ImageCreateChess(300, 200, 100, 0x000000);
+  ImageSegmentation(image_20, ImageRegionFillingWithQUEUE);
+  const char* paths[] = {"segment", "segment/fill"};
+  for (int i = 0; i < 2; i++) {
+    InstrRegionStats st;
+    InstrRegionGet(InstrRegionFind(paths[i]), &st);
+    printf("%s: %llu chamadas, p50 <= max: %d\n", paths[i], st.calls,
+           st.wall_min <= st.wall_p50 && st.wall_p50 <= st.wall_max);
+  }
+  ImageDestroy(&image_20);
+
+  printf("\n25) ImageArenaBegin + ImageArenaEnd\n");
+  // As imagens criadas numa arena são destruídas no fim, de uma só vez
+  // (a memória das imagens destruídas é reutilizada pelas seguintes)
+  ImageArenaBegin();
+  Image image_21 = ImageCreateChess(64, 48, 8, 0x000000);
+  Image image_22 = ImageRotate90CW(image_21);
+  Image image_23 = ImageRotate90CW(image_22);
+  ImageDestroy(&image_22);  // pode ser destruída antes do fim
+  ImageArenaBegin();
+  Image image_24 = ImageRotate180CW(image_21);
+  printf("Imagens iguais: %d\n", ImageIsEqual(image_23, image_24));
+  ImageArenaEnd();  // destrói image_24
+  ImageArenaEnd();  // destrói image_21 e image_23
+  ImagePoolTrim();
+
+  printf("\n26) ImageCreate (grande) + ImageRotate180CW + ImageIsEqual\n");
+  // Uma imagem grande quase toda WHITE: as linhas onde nada se desenhou
+  // não ocupam memória, e não são lidas ao rodar ou comparar
+  Image big_image = ImageCreate(4096, 4096);
+  for (int k = 0; k < 4096; k += 512) ImageSetPixel(big_image, k, k, BLACK);
+  Image big_180 = ImageRotate180CW(big_image);
+  Image big_360 = ImageRotate180CW(big_180);
+  printf("Imagens iguais: %d\n", ImageIsEqual(big_image, big_360));
+  ImageDestroy(&big_360);
+  ImageDestroy(&big_180);
+  ImageDestroy(&big_image);
+
+  printf("\n27) ImageCopy (copy-on-write) + ImageRegionFillingWithQUEUE\n");
+  // A cópia partilha os pixels da original: preencher uma região numa
+  // delas não altera a outra
+  Image image_25 = ImageCreateChess(300, 200, 50, 0x000000);
+  Image image_26 = ImageCopy(image_25);
+  Image image_180 = ImageRotate180CW(image_25);
+  Image image_27 = ImageRotate180CW(image_180);  // uma cópia "a sério"
+  ImageDestroy(&image_180);
+  printf("Pixels preenchidos: %d\n",
+         ImageRegionFillingWithQUEUE(image_26, 60, 10, BLACK));
+  printf("Imagens iguais: %d\n", ImageIsEqual(image_25, image_27));
+  printf("Imagens iguais: %d\n", ImageIsEqual(image_25, image_26));
+  ImageSetPixel(image_25, 0, 0, WHITE);
+  printf("Pixel (0, 0): original %d, copia %d\n",
+         ImageGetPixel(image_25, 0, 0), ImageGetPixel(image_26, 0, 0));
+  ImageDestroy(&image_25);
+  ImageDestroy(&image_26);
+  ImageDestroy(&image_27);
+
+  printf("\n28) ImageCheckpoint + ImageSegmentation + ImageUndo\n");
+  // Com o registo ativo, as alterações podem ser desfeitas até um ponto
+  // de controlo (cada corrida de pixels alterados é um só registo)
+  Image image_28 = ImageCreateChess(100, 100, 25, 0x000000);
+  Image image_29 = ImageCopy(image_28);
+  ImageJournalBegin(image_28);
+  uint32 checkpoint = ImageCheckpoint(image_28);
+  printf("Pixels preenchidos: %d\n",
+         ImageRegionFillingParallel(image_28, 30, 0, BLACK));
+  printf("Registos: %u\n", ImageCheckpoint(image_28) - checkpoint);
+  printf("Regioes: %d\n",
+         ImageSegmentation(image_28, ImageRegionFillingWithSTACK));
+  ImageUndo(image_28, checkpoint);
+  printf("Imagens iguais: %d\n", ImageIsEqual(image_28, image_29));
+  ImageJournalEnd(image_28);
+  ImageDestroy(&image_28);
+  ImageDestroy(&image_29);
+
+  printf("\n29) ImageSetTileStorage + ImageRotate90CW + ImageCopy\n");
+  // As imagens criadas a seguir ficam em ficheiros, com um orçamento de
+  // memória de 256 KiB: só alguns dos seus tiles estão em memória
+  Image image_30 = ImageCreateChess(1024, 768, 64, 0x000000);  // em memória
+  if (!ImageSetTileStorage(".", 256 << 10)) {
+    error(0, 0, "ImageSetTileStorage: %s", ImageErrMsg());
+  }
+  Image image_31 = ImageRotate90CW(image_30);
+  Image image_32 = ImageRotate90CW(image_31);
+  Image image_33 = ImageRotate180CW(image_30);
+  printf("Imagens iguais: %d\n", ImageIsEqual(image_32, image_33));
+  Image image_34 = ImageCopy(image_33);
+  printf("Pixels preenchidos: %d\n",
+         ImageRegionFillingParallel(image_34, 0, 0, WHITE));
+  printf("Memoria dentro do orcamento: %d\n",
+         ImageTileResidentBytes() <= 256 << 10);
+  ImageSetTileStorage(NULL, 0);
+  ImageDestroy(&image_30);
+  ImageDestroy(&image_31);
+  ImageDestroy(&image_32);
+  ImageDestroy(&image_33);
+  ImageDestroy(&image_34);
+
+  printf("\n30) ImageSave + ImageLoad (IMAGE_RAW e IMAGE_RLE)\n");
+  // O formato nativo guarda os rótulos e a LUT: a imagem lida é igual,
+  // com as mesmas cores
+  Image image_35 = ImageCreateChess(100, 100, 50, 0x000000);
+  ImageSegmentation(image_35, ImageRegionFillingWithQUEUE);
+  const int formats[] = {IMAGE_RAW, IMAGE_RLE};
+  for (int i = 0; i < 2; i++) {
+    if (!ImageSave(image_35, "test_native.img", formats[i])) {
+      error(2, errno, "Saving test_native.img: %s", ImageErrMsg());
+    }
+    Image image_36 = ImageLoad("test_native.img");
+    if (image_36 == NULL) {
+      error(2, errno, "Loading test_native.img: %s", ImageErrMsg());
+    }
+    printf("Imagens iguais: %d Cores: %d %d\n",
+           ImageIsEqual(image_35, image_36), ImageColors(image_35),
+           ImageColors(image_36));
+    ImageDestroy(&image_36);
+  }
+  remove("test_native.img");
+
+  printf("\n31) ImageSaveQOI + ImageLoadQOI\n");
+  // Um ficheiro QOI guarda as cores sem perdas, comprimidas: as regiões
+  // de uma só cor ocupam muito pouco
+  if (!ImageSaveQOI(image_35, "test_segment.qoi")) {
+    error(2, errno, "Saving test_segment.qoi: %s", ImageErrMsg());
+  }
+  Image image_37 = ImageLoadQOI("test_segment.qoi");
+  if (image_37 == NULL) {
+    error(2, errno, "Loading test_segment.qoi: %s", ImageErrMsg());
+  }
+  printf("Imagens iguais: %d Cores: %d %d\n", ImageIsEqual(image_35, image_37),
+         ImageColors(image_35), ImageColors(image_37));
+  remove("test_segment.qoi");
+  ImageDestroy(&image_37);
+  ImageDestroy(&image_35);
+
+  printf("\n32) ImageCreateChess + ImageDestroy (muitos tamanhos)\n");
+  // Mais tamanhos de imagem do que as classes do pool: os blocos dos
+  // tamanhos a mais não ficam guardados, e os guardados são reutilizados
+  Image many[40];
+  for (int k = 0; k < 40; k++) many[k] = ImageCreateChess(8 + k, 8, 4, 0);
+  for (int k = 0; k < 40; k++) ImageDestroy(&many[k]);
+  int equal = 0;
+  for (int k = 0; k < 40; k++) {
+    Image chess = ImageCreateChess(8 + k, 8, 4, 0);
+    Image chess_180 = ImageRotate180CW(chess);
+    Image chess_360 = ImageRotate180CW(chess_180);
+    equal += ImageIsEqual(chess, chess_360);
+    ImageDestroy(&chess_360);
+    ImageDestroy(&chess_180);
+    ImageDestroy(&chess);
+  }
+  printf("Imagens iguais: %d de 40\n", equal);
+  ImagePoolTrim();
+
+  printf("\n33) ImageJournalBegin + ImageRegionFillingWithSTACK (grande)\n");
+  // O registo guarda cada linha alterada uma só vez por ponto de
+  // controlo, seja qual for a ordem pela qual os pixels são alterados
+  Image image_38 = ImageCreate(1024, 1024);
+  Image image_39 = ImageCreate(1024, 1024);
+  ImageJournalBegin(image_38);
+  const FillingFunction fills[] = {ImageRegionFillingWithSTACK,
+                                   ImageRegionFillingWithQUEUE};
+  for (int i = 0; i < 2; i++) {
+    uint32 checkpoint_2 = ImageCheckpoint(image_38);
+    printf("Pixels preenchidos: %d\n", fills[i](image_38, 512, 512, BLACK));
+    printf("Registos: %u (1 por linha: %d)\n",
+           ImageCheckpoint(image_38) - checkpoint_2,
+           ImageCheckpoint(image_38) - checkpoint_2 == 1024);
+    ImageUndo(image_38, checkpoint_2);
+    printf("Imagens iguais: %d\n", ImageIsEqual(image_38, image_39));
+  }
+  ImageJournalEnd(image_38);
+  ImageDestroy(&image_38);
+  ImageDestroy(&image_39);
+
+  printf("\n34) ImageSave + ImageLoad (IMAGE_RAW, o mesmo ficheiro)\n");
+  // Gravar por cima do ficheiro de onde a imagem foi lida não a altera;
+  // um ficheiro com rótulos fora da LUT, ou cuja LUT não começa por WHITE
+  // e BLACK, não é lido
+  Image image_40 = ImageCreateChess(256, 256, 32, 0x000000);
+  if (!ImageSave(image_40, "test_native.img", IMAGE_RAW)) {
+    error(2, errno, "Saving test_native.img: %s", ImageErrMsg());
+  }
+  Image image_41 = ImageLoad("test_native.img");
+  if (image_41 == NULL) {
+    error(2, errno, "Loading test_native.img: %s", ImageErrMsg());
+  }
+  ImageRegionFillingWithQUEUE(image_41, 0, 0,
+                              1 - ImageGetPixel(image_41, 0, 0));
+  for (int i = 0; i < 2; i++) {
+    if (!ImageSave(image_41, "test_native.img", IMAGE_RAW)) {
+      error(2, errno, "Saving test_native.img: %s", ImageErrMsg());
+    }
+  }
+  Image image_42 = ImageLoad("test_native.img");
+  if (image_42 == NULL) {
+    error(2, errno, "Loading test_native.img: %s", ImageErrMsg());
+  }
+  printf("Imagens iguais: %d %d\n", ImageIsEqual(image_41, image_42),
+         ImageIsEqual(image_40, image_42));
+  ImageDestroy(&image_42);
+  ImageDestroy(&image_41);
+  ImageDestroy(&image_40);
+  // (Rótulos 0xFFFF no fim dos pixels)
+  FILE* damaged = fopen("test_native.img", "r+b");
+  if (damaged == NULL) error(2, errno, "Opening test_native.img");
+  char ones[4096];
+  memset(ones, 0xFF, sizeof(ones));
+  if (fseek(damaged, -(long)sizeof(ones), SEEK_END) != 0 ||
+      fwrite(ones, 1, sizeof(ones), damaged) != sizeof(ones) ||
+      fclose(damaged) != 0) {
+    error(2, errno, "Writing test_native.img");
+  }
+  Image image_43 = ImageLoad("test_native.img");
+  printf("ImageLoad: %s (%s)\n", image_43 == NULL ? "NULL" : "imagem",
+         ImageErrMsg());
+  if (image_43 != NULL) ImageDestroy(&image_43);
+  // (LUT com as cores dos rótulos WHITE e BLACK trocadas)
+  Image image_44 = ImageCreateChess(64, 64, 8, 0x000000);
+  if (!ImageSave(image_44, "test_native.img", IMAGE_RLE)) {
+    error(2, errno, "Saving test_native.img: %s", ImageErrMsg());
+  }
+  ImageDestroy(&image_44);
+  rgb_t header[256];
+  damaged = fopen("test_native.img", "r+b");
+  if (damaged == NULL || fread(header, sizeof(header), 1, damaged) != 1) {
+    error(2, errno, "Reading test_native.img");
+  }
+  size_t lut = 0;
+  while (lut + 1 < 256 && !(header[lut] == 0xffffff && header[lut + 1] == 0))
+    lut++;
+  if (lut + 1 == 256) error(2, 0, "test_native.img: LUT not found");
+  header[lut] = 0x000000;
+  header[lut + 1] = 0xffffff;
+  if (fseek(damaged, 0, SEEK_SET) != 0 ||
+      fwrite(header, sizeof(header), 1, damaged) != 1 ||
+      fclose(damaged) != 0) {
+    error(2, errno, "Writing test_native.img");
+  }
+  image_44 = ImageLoad("test_native.img");
+  printf("ImageLoad: %s (%s)\n", image_44 == NULL ? "NULL" : "imagem",
+         ImageErrMsg());
+  if (image_44 != NULL) ImageDestroy(&image_44);
+  remove("test_native.img");
+
+  printf("\n35) InstrReset + InstrSnapshot (duas threads)\n");
+  // Cada thread conta desde o seu próprio InstrReset, e as contagens não
+  // diminuem quando outra thread zera os seus contadores (InstrSet)
+  pthread_t instr_thread;
+  pthread_barrier_init(&instr_barrier, NULL, 2);
+  if (pthread_create(&instr_thread, NULL, test_Instr_thread, NULL) != 0) {
+    error(2, 0, "pthread_create");
+  }
+  pthread_barrier_wait(&instr_barrier);  // (a outra thread conta 100)
+  InstrReset();
+  pthread_barrier_wait(&instr_barrier);
+  pthread_barrier_wait(&instr_barrier);  // (a outra thread zera o seu)
+  INSTR_ADD(0, 10);
+  pthread_barrier_wait(&instr_barrier);
+  InstrSnapshot(counts);
+  pthread_join(instr_thread, NULL);
+  pthread_barrier_destroy(&instr_barrier);
+  printf("Contagens: %lu %lu (esperado: 10 110)\n", counts[0], instr_counts[0]);
+
   // Teste de desempenho das funções de preenchimento de região
   test_RegionFilling_performance();
 
@@ -232,6 +626,7 @@ int main(int argc, char* argv[]) {
   ImageDestroy(&image_9);
   ImageDestroy(&image_10);
   ImageDestroy(&image_11);
+  ImageDestroy(&image_12);
 
   return 0;
 }
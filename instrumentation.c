@@ -20,8 +20,11 @@
 /// InstrPrint();  // to show time and counters
 
 #include "instrumentation.h"
+#include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 /// Cpu time in seconds
 double cpu_time(void) ; ///
@@ -42,6 +45,18 @@ double cpu_time(void) {
   return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
 }
 
+static unsigned long long ClockNs(clockid_t id) {
+  struct timespec t;
+  if (clock_gettime(id, &t) != 0) return 0;
+  return (unsigned long long)t.tv_sec * 1000000000ull + (unsigned long long)t.tv_nsec;
+}
+
+// Wall-clock time and CPU time of the calling thread, in nanoseconds
+static unsigned long long WallNs(void) { return ClockNs(CLOCK_MONOTONIC); }
+static unsigned long long ThreadCpuNs(void) {
+  return ClockNs(CLOCK_THREAD_CPUTIME_ID);
+}
+
 #endif
 
 
@@ -66,64 +81,716 @@ double cpu_time(void) {
   return (double)current_time.QuadPart / (double)frequency.QuadPart;
 }
 
+// (cpu_time is the wall-clock time here)
+static unsigned long long WallNs(void) {
+  return (unsigned long long)(cpu_time() * 1e9);
+}
+static unsigned long long ThreadCpuNs(void) { return WallNs(); }
+
+#endif
+
+/// Hardware performance counters
+
+/// Names of the hardware events:
+const char* InstrHwName[INSTR_HW_EVENTS] = {"cycles", "instructions",
+                                            "cache-misses", "branch-misses"};
+
+// Each thread opens its own event counters (on its first InstrReset):
+// -1 if the event is not available.
+static _Thread_local int hw_fd[INSTR_HW_EVENTS];
+static _Thread_local int hw_opened = 0;
+
+#if defined(__linux__)
+
+//
+// GNU/Linux code to read hardware counters, with perf_event_open
+//
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static const unsigned long long hw_config[INSTR_HW_EVENTS] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+
+// Open the event counters of the calling thread (user space only).
+// Events that cannot be opened (no PMU, no permission, a container...)
+// are just left unavailable.
+static void HwOpen(void) {
+  hw_opened = 1;
+  for (int e = 0; e < INSTR_HW_EVENTS; e++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = hw_config[e];
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    hw_fd[e] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+}
+
+static void HwClose(void) {
+  if (!hw_opened) return;
+  for (int e = 0; e < INSTR_HW_EVENTS; e++)
+    if (hw_fd[e] >= 0) close(hw_fd[e]);
+  hw_opened = 0;
+}
+
+static void HwReset(void) {
+  if (!hw_opened) HwOpen();
+  for (int e = 0; e < INSTR_HW_EVENTS; e++) {
+    if (hw_fd[e] < 0) continue;
+    ioctl(hw_fd[e], PERF_EVENT_IOC_RESET, 0);
+    ioctl(hw_fd[e], PERF_EVENT_IOC_ENABLE, 0);
+  }
+}
+
+static long long HwRead(int e) {
+  long long value;
+  if (!hw_opened || hw_fd[e] < 0 ||
+      read(hw_fd[e], &value, sizeof(value)) != sizeof(value))
+    return -1;
+  return value;
+}
+
+#else
+
+static void HwClose(void) {}
+static void HwReset(void) { hw_opened = 1; }
+static long long HwRead(int e) { (void)e; return -1; }
+
 #endif
 
-/// Array of operation counters:
-unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// Get the hardware event counts of the calling thread, since its last
+/// InstrReset.
+int InstrHwSnapshot(long long counts[]) { ///
+  int available = 0;
+  for (int e = 0; e < INSTR_HW_EVENTS; e++) {
+    counts[e] = HwRead(e);
+    if (counts[e] >= 0) available++;
+  }
+  return available;
+}
 
 /// Array of names for the counters:
-char* InstrName[NUMCOUNTERS] = {NULL};  ///extern
+char* InstrName[INSTR_MAX_COUNTERS] = {NULL};  ///extern
     // All elements initialized to NULL
     // See: https://en.cppreference.com/w/c/language/array_initialization
 
-/// Cpu_time read on previous reset (~seconds)
-double InstrTime;  ///extern
+// Per-thread counter slots.
+// Each slot is owned by one thread, which is the only one that writes it
+// (except for zeroing, when the slot is released); aggregation only reads.
+// Slots are never removed from the list, so it may be traversed without
+// locks; slots of exited threads are reused by new threads.
+
+#define INSTR_CACHE_LINE 64
+
+struct regionStats;
+
+struct instrSlot {
+  _Alignas(INSTR_CACHE_LINE) unsigned long count[INSTR_MAX_COUNTERS];
+  struct instrSlot* next;  // next slot in the list of all slots
+  int in_use;              // owned by a thread? (atomic)
+  // Timing tables of the regions (atomic; allocated when first used).
+  // They are kept when the slot is released: the next owner adds to them.
+  struct regionStats* region[INSTR_MAX_REGIONS];
+};
+
+static struct instrSlot* slots = NULL;  // list of all slots (atomic)
+
+// Counts of exited threads, and counts that threads removed from their
+// slots (by lowering them), so that the aggregates never decrease (atomic)
+static unsigned long retired[INSTR_MAX_COUNTERS];
+
+// Aggregated counts at the last reset of the calling thread
+static _Thread_local unsigned long base[INSTR_MAX_COUNTERS];
+
+// Number of registered counters (atomic)
+static int num_registered = 0;
+
+// Key to release the slot when its thread exits
+static pthread_key_t slot_key;
+static pthread_once_t slot_key_once = PTHREAD_ONCE_INIT;
+
+/// The counters of the calling thread (NULL until it first uses them)
+_Thread_local unsigned long* InstrLocal = NULL;  ///extern
+
+// Move the counts of the slot of an exiting thread to retired,
+// and release the slot.
+static void ReleaseSlot(void* p) {
+  struct instrSlot* s = p;
+  for (int i = 0; i < INSTR_MAX_COUNTERS; i++)
+    InstrRetire(i, __atomic_load_n(&s->count[i], __ATOMIC_RELAXED));
+  for (int i = 0; i < INSTR_MAX_COUNTERS; i++)
+    __atomic_store_n(&s->count[i], 0ul, __ATOMIC_RELAXED);
+  __atomic_store_n(&s->in_use, 0, __ATOMIC_RELEASE);
+  HwClose();  // (this runs in the exiting thread)
+}
+
+static void CreateSlotKey(void) {
+  if (pthread_key_create(&slot_key, ReleaseSlot) != 0) {
+    perror("pthread_key_create");
+    exit(2);
+  }
+}
+
+/// Get a counter slot for the calling thread.
+unsigned long* InstrAttach(void) { ///
+  pthread_once(&slot_key_once, CreateSlotKey);
+
+  // Reuse a free slot, if any...
+  struct instrSlot* s = __atomic_load_n(&slots, __ATOMIC_ACQUIRE);
+  for (; s != NULL; s = s->next) {
+    int expected = 0;
+    if (__atomic_compare_exchange_n(&s->in_use, &expected, 1, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      break;
+  }
+
+  // ... or add a new slot to the list
+  if (s == NULL) {
+    s = aligned_alloc(INSTR_CACHE_LINE, sizeof(struct instrSlot));
+    if (s == NULL) {
+      perror("aligned_alloc");
+      exit(2);
+    }
+    for (int i = 0; i < INSTR_MAX_COUNTERS; i++)
+      s->count[i] = 0ul;
+    for (int r = 0; r < INSTR_MAX_REGIONS; r++)
+      s->region[r] = NULL;
+    s->in_use = 1;
+    s->next = __atomic_load_n(&slots, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&slots, &s->next, s, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+  }
+
+  pthread_setspecific(slot_key, s);
+  InstrLocal = s->count;
+  return InstrLocal;
+}
+
+/// Register a new counter with the given name.
+int InstrRegister(char* name) { ///
+  int i = NUMCOUNTERS + __atomic_fetch_add(&num_registered, 1,
+                                           __ATOMIC_RELAXED);
+  if (i >= INSTR_MAX_COUNTERS) return -1;
+  InstrName[i] = name;
+  return i;
+}
+
+// Sum the counters of all slots and of the exited threads.
+// (The slots are read before retired: a count moved from a slot to
+// retired, see InstrRetire, is then counted once or twice, never missed.)
+static void Aggregate(unsigned long sum[]) {
+  for (int i = 0; i < INSTR_MAX_COUNTERS; i++) sum[i] = 0;
+  struct instrSlot* s = __atomic_load_n(&slots, __ATOMIC_ACQUIRE);
+  for (; s != NULL; s = s->next)
+    for (int i = 0; i < INSTR_MAX_COUNTERS; i++)
+      sum[i] += __atomic_load_n(&s->count[i], __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  for (int i = 0; i < INSTR_MAX_COUNTERS; i++)
+    sum[i] += __atomic_load_n(&retired[i], __ATOMIC_RELAXED);
+}
+
+/// Keep n counts of counter i, before the calling thread lowers it by n.
+void InstrRetire(int i, unsigned long n) { ///
+  __atomic_add_fetch(&retired[i], n, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+// Number of threads that have counter slots (that have counted).
+static int CountingThreads(void) {
+  int n = 0;
+  struct instrSlot* s = __atomic_load_n(&slots, __ATOMIC_ACQUIRE);
+  for (; s != NULL; s = s->next)
+    n += __atomic_load_n(&s->in_use, __ATOMIC_RELAXED);
+  return n;
+}
+
+/// Cpu_time read on previous reset (~seconds) (by the calling thread)
+_Thread_local double InstrTime;  ///extern
 
 /// Calibrated Time Unit (in seconds, initially 1s)
 double InstrCTU = 1.0;  ///extern
 
-/// Find the Calibrated Time Unit (CTU).
-/// Run and time a loop of basic memory and arithmetic operations to set
-/// a reasonably cpu-independent time unit.
-void InstrCalibrate(void) { ///
+// The CTU is the time of CALIBRATE_ITERS iterations of the loop below.
+// To be fast, the loop runs CALIBRATE_ITERS / CALIBRATE_SCALE iterations,
+// CALIBRATE_TRIALS times (an odd number), and the median time is scaled
+// up.  The target is the precision of the full loop itself, whose time
+// varies by a few percent from run to run: the median is usually within
+// 1% of it, and within 5% on a busy machine.  (The fastest time is not
+// used: it is biased low, by up to 15% on a busy machine.)
+#define CALIBRATE_ITERS 40000000
+#define CALIBRATE_SCALE 128
+#define CALIBRATE_TRIALS 5
+
+// Has the CTU been set?  (Written only under calibrate_once, or by
+// an explicit InstrCalibrate before starting threads.)
+static int calibrated = 0;
+static pthread_once_t calibrate_once = PTHREAD_ONCE_INIT;
+
+// Time a loop of basic memory and arithmetic operations.
+static double CalibrationLoop(int iters) {
   const int size = 4*1024;     // 2^12!
   const int mask = size - 1;
   int array[size];  // alloc array in stack, not initialized on purpose
   double time = cpu_time();
-  srand((unsigned int)(time*1e9));
-  for (int n = 0; n < 40000000; n++) {
+  for (int n = 0; n < iters; n++) {
     int i = rand() & mask;
     int j = rand() & mask;
     int k = rand() & mask;
     array[k] ^= array[i] + array[j] + i*j;
     //printf("%d %d %d\n", i, j, k);  // debug
   }
-  InstrCTU = cpu_time() - time;
+  time = cpu_time() - time;
+  // use the array, so that the loop is not optimized away
+  volatile int sink = array[0];
+  (void)sink;
+  return time;
+}
+
+/// Find the Calibrated Time Unit (CTU).
+/// Run and time a loop of basic memory and arithmetic operations to set
+/// a reasonably cpu-independent time unit.
+void InstrCalibrate(void) { ///
+  srand((unsigned int)(cpu_time()*1e9));
+  // Insertion sort of the times, for the median.
+  double times[CALIBRATE_TRIALS];
+  for (int t = 0; t < CALIBRATE_TRIALS; t++) {
+    double time = CalibrationLoop(CALIBRATE_ITERS / CALIBRATE_SCALE);
+    int k = t;
+    for (; k > 0 && times[k - 1] > time; k--) times[k] = times[k - 1];
+    times[k] = time;
+  }
+  InstrCTU = times[CALIBRATE_TRIALS / 2] * CALIBRATE_SCALE;
+  calibrated = 1;
+}
+
+// Get the CPU model name (for the CTU cache).
+static void CpuModel(char* model, size_t size) {
+  snprintf(model, size, "unknown");
+  FILE* f = fopen("/proc/cpuinfo", "r");
+  if (f == NULL) return;
+  char line[256];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char* colon = strchr(line, ':');
+    if (strncmp(line, "model name", 10) == 0 && colon != NULL) {
+      snprintf(model, size, "%s", colon + 2);
+      model[strcspn(model, "\n")] = '\0';
+      break;
+    }
+  }
+  fclose(f);
+}
+
+// Calibrate, unless already done, using the CTU cache file named by the
+// INSTR_CTU_CACHE environment variable, if any.
+// The cache has a line "<ctu>\t<cpu model>" per CPU model.
+static void LazyCalibrate(void) {
+  if (calibrated) return;
+
+  const char* path = getenv("INSTR_CTU_CACHE");
+  if (path == NULL) {
+    InstrCalibrate();
+    return;
+  }
+
+  char model[128];
+  CpuModel(model, sizeof(model));
+  FILE* f = fopen(path, "r");
+  if (f != NULL) {
+    char line[256];
+    while (fgets(line, sizeof(line), f) != NULL) {
+      double ctu;
+      int n;
+      line[strcspn(line, "\n")] = '\0';
+      if (sscanf(line, "%lf\t%n", &ctu, &n) == 1 && ctu > 0.0 &&
+          strcmp(line + n, model) == 0) {
+        InstrCTU = ctu;
+        calibrated = 1;
+        break;
+      }
+    }
+    fclose(f);
+  }
+  if (calibrated) return;
+
+  InstrCalibrate();
+  f = fopen(path, "a");
+  if (f != NULL) {  // the cache is optional: ignore errors
+    fprintf(f, "%.9f\t%s\n", InstrCTU, model);
+    fclose(f);
+  }
+}
+
+/// Get the CTU, calibrating it first, if needed.
+double InstrGetCTU(void) { ///
+  pthread_once(&calibrate_once, LazyCalibrate);
+  return InstrCTU;
 }
 
 /// Reset counters to zero and store cpu_time.
 void InstrReset(void) { ///
-  for (int i = 0; i < NUMCOUNTERS; i++)
-    InstrCount[i] = 0ul;
+  for (int i = 0; i < INSTR_MAX_COUNTERS; i++) InstrSet(i, 0);
+  Aggregate(base);
+  HwReset();
   InstrTime = cpu_time();
 }
 
+/// Get the counters aggregated over all threads, since the last reset.
+void InstrSnapshot(unsigned long counts[]) { ///
+  Aggregate(counts);
+  for (int i = 0; i < INSTR_MAX_COUNTERS; i++)
+    counts[i] = counts[i] > base[i] ? counts[i] - base[i] : 0;
+}
+
 // Print times and all named counter values
 void InstrPrint(void) { ///
   // elapsed time since last reset:
   double time = cpu_time() - InstrTime;
+  // hardware events since last reset (read first, not to count the rest):
+  long long hw[INSTR_HW_EVENTS];
+  InstrHwSnapshot(hw);
   // compute time in calibrated time units:
-  double caltime = time / InstrCTU;
+  double caltime = time / InstrGetCTU();
+
+  unsigned long counts[INSTR_MAX_COUNTERS];
+  InstrSnapshot(counts);
 
+  // The hardware events (marked with *) are of the calling thread only,
+  // while the other counters are of all threads.
+  int hw_available = 0;
   printf("#%14.15s\t%15.15s", "time", "caltime");
-  for (int i = 0; i < NUMCOUNTERS; i++)
+  for (int i = 0; i < INSTR_MAX_COUNTERS; i++)
     if (InstrName[i] != NULL)
       printf("\t%15.15s", InstrName[i]);
+  for (int e = 0; e < INSTR_HW_EVENTS; e++)
+    if (hw[e] >= 0) {
+      printf("\t%14.14s*", InstrHwName[e]);
+      hw_available = 1;
+    }
   puts("");
   printf("%15.6f\t%15.6f", time, caltime);
-  for (int i = 0; i < NUMCOUNTERS; i++)
+  for (int i = 0; i < INSTR_MAX_COUNTERS; i++)
     if (InstrName[i] != NULL)
-      printf("\t%15lu", InstrCount[i]);  
+      printf("\t%15lu", counts[i]);
+  for (int e = 0; e < INSTR_HW_EVENTS; e++)
+    if (hw[e] >= 0)
+      printf("\t%15lld", hw[e]);
   puts("");
+  if (hw_available)
+    printf("# * calling thread only (counters: %d threads)\n",
+           CountingThreads());
+}
+
+
+/// Timing regions
+
+// The regions form a tree: a region is identified by its name and the
+// region it was entered in.  Regions are only added, in order, so the
+// first num_regions entries may be read without locks.
+struct regionNode {
+  const char* name;
+  int parent;  // -1 for top-level regions
+  int depth;
+};
+
+static struct regionNode regions[INSTR_MAX_REGIONS];
+static int num_regions = 0;  // (atomic)
+static pthread_mutex_t regions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Times are also counted in a histogram with HIST_SUB buckets per power
+// of 2 (a relative width of 1/HIST_SUB), for the percentiles.
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+// The timing table of a region, in a thread (times in ns).
+// Only the owner thread writes it, as the counters.
+struct regionStats {
+  unsigned long long calls, wall, cpu, wall_min, wall_max;
+  unsigned int hist[HIST_BUCKETS];
+};
+
+// Add n to x, which only the calling thread writes.
+#define OWNER_ADD(x, n)                                                  \
+  __atomic_store_n(&(x), __atomic_load_n(&(x), __ATOMIC_RELAXED) + (n), \
+                   __ATOMIC_RELAXED)
+
+// The open regions of the calling thread (-1: not timed)
+static _Thread_local struct {
+  int region;
+  unsigned long long wall, cpu;  // at the start
+} open_regions[INSTR_MAX_DEPTH];
+static _Thread_local int open_depth = 0;
+
+static int HistBucket(unsigned long long ns) {
+  if (ns < HIST_SUB) return (int)ns;
+  int e = 63 - __builtin_clzll(ns);  // e >= HIST_SUB_BITS
+  return (e - HIST_SUB_BITS + 1) * HIST_SUB +
+         (int)(ns >> (e - HIST_SUB_BITS) & (HIST_SUB - 1));
+}
+
+// The middle of bucket b (in ns).
+static double HistValue(int b) {
+  if (b < HIST_SUB) return b;
+  int e = b / HIST_SUB + HIST_SUB_BITS - 1;
+  double width = (double)(1ull << (e - HIST_SUB_BITS));
+  return (HIST_SUB + b % HIST_SUB) * width + width / 2;
+}
+
+// Find the region with the given name inside region parent, or add it.
+// Returns -1 if there are already INSTR_MAX_REGIONS regions.
+static int FindRegion(int parent, const char* name) {
+  int n = __atomic_load_n(&num_regions, __ATOMIC_ACQUIRE);
+  for (int r = 0; r < n; r++)
+    if (regions[r].parent == parent &&
+        (regions[r].name == name || strcmp(regions[r].name, name) == 0))
+      return r;
+
+  pthread_mutex_lock(&regions_lock);
+  int r;
+  for (r = n; r < num_regions; r++)  // added meanwhile?
+    if (regions[r].parent == parent && strcmp(regions[r].name, name) == 0)
+      break;
+  if (r == num_regions) {
+    if (r < INSTR_MAX_REGIONS) {
+      regions[r].name = name;
+      regions[r].parent = parent;
+      regions[r].depth = parent < 0 ? 0 : regions[parent].depth + 1;
+      __atomic_store_n(&num_regions, r + 1, __ATOMIC_RELEASE);
+    } else {
+      r = -1;
+    }
+  }
+  pthread_mutex_unlock(&regions_lock);
+  return r;
+}
+
+/// Enter a timing region, inside the current region of the calling thread.
+void InstrBegin(const char* name) { ///
+  int d = open_depth++;
+  if (d >= INSTR_MAX_DEPTH) return;
+  int r = -1;
+  if (d == 0 || open_regions[d - 1].region >= 0)
+    r = FindRegion(d == 0 ? -1 : open_regions[d - 1].region, name);
+  open_regions[d].region = r;
+  open_regions[d].cpu = ThreadCpuNs();
+  open_regions[d].wall = WallNs();
 }
 
+/// Leave the current timing region of the calling thread.
+void InstrEnd(void) { ///
+  unsigned long long wall = WallNs();
+  unsigned long long cpu = ThreadCpuNs();
+  assert(open_depth > 0);
+  int d = --open_depth;
+  if (d >= INSTR_MAX_DEPTH || open_regions[d].region < 0) return;
+  int r = open_regions[d].region;
+  wall -= open_regions[d].wall;
+  cpu -= open_regions[d].cpu;
+
+  // The counters slot of this thread (count is its first member)
+  struct instrSlot* slot = (struct instrSlot*)InstrThreadCounts();
+  struct regionStats* st = slot->region[r];
+  if (st == NULL) {
+    st = calloc(1, sizeof(*st));
+    if (st == NULL) {
+      perror("calloc");
+      exit(2);
+    }
+    st->wall_min = ~0ull;
+    __atomic_store_n(&slot->region[r], st, __ATOMIC_RELEASE);
+  }
+  OWNER_ADD(st->calls, 1);
+  OWNER_ADD(st->wall, wall);
+  OWNER_ADD(st->cpu, cpu);
+  if (wall < st->wall_min) __atomic_store_n(&st->wall_min, wall, __ATOMIC_RELAXED);
+  if (wall > st->wall_max) __atomic_store_n(&st->wall_max, wall, __ATOMIC_RELAXED);
+  OWNER_ADD(st->hist[HistBucket(wall)], 1);
+}
+
+/// Number of timing regions entered so far (by any thread).
+int InstrRegions(void) { ///
+  return __atomic_load_n(&num_regions, __ATOMIC_ACQUIRE);
+}
+
+// The time of histogram hist (calls entries) at quantile q, in ns.
+static double Percentile(const unsigned long long hist[],
+                         unsigned long long calls, double q) {
+  unsigned long long rank = (unsigned long long)(q * calls + 0.999999);
+  if (rank == 0) rank = 1;
+  unsigned long long sum = 0;
+  for (int b = 0; b < HIST_BUCKETS; b++) {
+    sum += hist[b];
+    if (sum >= rank) return HistValue(b);
+  }
+  return 0.0;
+}
+
+/// Get the statistics of region i, merged over all threads.
+void InstrRegionGet(int i, InstrRegionStats* st) { ///
+  assert(0 <= i && i < InstrRegions());
+  unsigned long long hist[HIST_BUCKETS] = {0};
+  unsigned long long calls = 0, wall = 0, cpu = 0, wall_min = ~0ull,
+                     wall_max = 0;
+
+  struct instrSlot* s = __atomic_load_n(&slots, __ATOMIC_ACQUIRE);
+  for (; s != NULL; s = s->next) {
+    struct regionStats* t = __atomic_load_n(&s->region[i], __ATOMIC_ACQUIRE);
+    if (t == NULL) continue;
+    calls += __atomic_load_n(&t->calls, __ATOMIC_RELAXED);
+    wall += __atomic_load_n(&t->wall, __ATOMIC_RELAXED);
+    cpu += __atomic_load_n(&t->cpu, __ATOMIC_RELAXED);
+    unsigned long long x = __atomic_load_n(&t->wall_min, __ATOMIC_RELAXED);
+    if (x < wall_min) wall_min = x;
+    x = __atomic_load_n(&t->wall_max, __ATOMIC_RELAXED);
+    if (x > wall_max) wall_max = x;
+    for (int b = 0; b < HIST_BUCKETS; b++)
+      hist[b] += __atomic_load_n(&t->hist[b], __ATOMIC_RELAXED);
+  }
+
+  st->name = regions[i].name;
+  st->parent = regions[i].parent;
+  st->depth = regions[i].depth;
+  st->calls = calls;
+  if (calls == 0) {
+    st->wall_total = st->wall_min = st->wall_mean = st->wall_p50 =
+        st->wall_p99 = st->wall_max = st->cpu_total = st->cpu_mean = 0.0;
+    return;
+  }
+  // (the percentiles are kept within the exact minimum and maximum)
+  double p50 = Percentile(hist, calls, 0.50);
+  double p99 = Percentile(hist, calls, 0.99);
+  if (p50 < wall_min) p50 = wall_min;
+  if (p50 > wall_max) p50 = wall_max;
+  if (p99 < wall_min) p99 = wall_min;
+  if (p99 > wall_max) p99 = wall_max;
+  st->wall_total = 1e-9 * wall;
+  st->wall_min = 1e-9 * wall_min;
+  st->wall_mean = 1e-9 * wall / calls;
+  st->wall_p50 = 1e-9 * p50;
+  st->wall_p99 = 1e-9 * p99;
+  st->wall_max = 1e-9 * wall_max;
+  st->cpu_total = 1e-9 * cpu;
+  st->cpu_mean = 1e-9 * cpu / calls;
+}
+
+// Write the path of region r ("a/b/c") into path.
+static void RegionPath(int r, char* path, size_t size) {
+  if (regions[r].parent < 0) {
+    snprintf(path, size, "%s", regions[r].name);
+    return;
+  }
+  RegionPath(regions[r].parent, path, size);
+  size_t len = strlen(path);
+  snprintf(path + len, size - len, "/%s", regions[r].name);
+}
+
+/// Find a region by its path.
+int InstrRegionFind(const char* path) { ///
+  char p[256];
+  int n = InstrRegions();
+  for (int r = 0; r < n; r++) {
+    RegionPath(r, p, sizeof(p));
+    if (strcmp(p, path) == 0) return r;
+  }
+  return -1;
+}
+
+/// Clear the statistics of all regions.
+void InstrRegionsReset(void) { ///
+  struct instrSlot* s = __atomic_load_n(&slots, __ATOMIC_ACQUIRE);
+  for (; s != NULL; s = s->next) {
+    for (int r = 0; r < INSTR_MAX_REGIONS; r++) {
+      struct regionStats* t = __atomic_load_n(&s->region[r], __ATOMIC_ACQUIRE);
+      if (t == NULL) continue;
+      memset(t, 0, sizeof(*t));
+      t->wall_min = ~0ull;
+    }
+  }
+}
+
+static void WriteJSONString(FILE* f, const char* str) {
+  fputc('"', f);
+  for (; *str != '\0'; str++) {
+    if (*str == '"' || *str == '\\')
+      fprintf(f, "\\%c", *str);
+    else if ((unsigned char)*str < 0x20)
+      fprintf(f, "\\u%04x", *str);
+    else
+      fputc(*str, f);
+  }
+  fputc('"', f);
+}
+
+// Write region r, then the regions inside it.
+static void WriteRegion(FILE* f, int format, int r, int n, int* count) {
+  InstrRegionStats st;
+  InstrRegionGet(r, &st);
+  char path[256];
+  RegionPath(r, path, sizeof(path));
+  int indent;
+
+  // (regions not entered since the last InstrRegionsReset are omitted)
+  switch (st.calls == 0 ? -1 : format) {
+    case INSTR_TEXT:
+      indent = st.depth < 10 ? 2 * st.depth : 20;
+      fprintf(f, "%*s%-*.*s\t%15llu", indent, "", 30 - indent, 30 - indent,
+              st.name, st.calls);
+      fprintf(f, "\t%15.6f\t%15.6f\t%15.6f\t%15.6f\t%15.6f\t%15.6f\n",
+              st.wall_total, st.wall_mean, st.wall_p50, st.wall_p99,
+              st.wall_max, st.cpu_total);
+      break;
+    case INSTR_CSV:
+      fprintf(f, "%s,%d,%llu,%.9f,%.9f,%.9f,%.9f,%.9f,%.9f,%.9f,%.9f\n",
+              path, st.depth, st.calls, st.wall_total, st.wall_min,
+              st.wall_mean, st.wall_p50, st.wall_p99, st.wall_max,
+              st.cpu_total, st.cpu_mean);
+      break;
+    case INSTR_JSON:
+      fprintf(f, "%s\n  {\"region\": ", *count > 0 ? "," : "");
+      WriteJSONString(f, path);
+      fprintf(f,
+              ", \"depth\": %d, \"calls\": %llu, \"wall_total\": %.9f, "
+              "\"wall_min\": %.9f, \"wall_mean\": %.9f, \"wall_p50\": %.9f, "
+              "\"wall_p99\": %.9f, \"wall_max\": %.9f, \"cpu_total\": %.9f, "
+              "\"cpu_mean\": %.9f}",
+              st.depth, st.calls, st.wall_total, st.wall_min, st.wall_mean,
+              st.wall_p50, st.wall_p99, st.wall_max, st.cpu_total,
+              st.cpu_mean);
+      break;
+  }
+  if (st.calls > 0) (*count)++;
+
+  for (int c = r + 1; c < n; c++)  // (regions are added after their parent)
+    if (regions[c].parent == r) WriteRegion(f, format, c, n, count);
+}
+
+/// Write the statistics of all regions to f, in the given format.
+void InstrRegionsWrite(FILE* f, int format) { ///
+  int n = InstrRegions();
+  int count = 0;
+
+  switch (format) {
+    case INSTR_TEXT:
+      fprintf(f, "#%-29s\t%15s\t%15s\t%15s\t%15s\t%15s\t%15s\t%15s\n",
+              "region", "calls", "wall", "mean", "p50", "p99", "max", "cpu");
+      break;
+    case INSTR_CSV:
+      fputs("region,depth,calls,wall_total,wall_min,wall_mean,wall_p50,"
+            "wall_p99,wall_max,cpu_total,cpu_mean\n", f);
+      break;
+    case INSTR_JSON:
+      fputs("[", f);
+      break;
+  }
+  for (int r = 0; r < n; r++)
+    if (regions[r].parent < 0) WriteRegion(f, format, r, n, &count);
+  if (format == INSTR_JSON) fputs("\n]\n", f);
+}